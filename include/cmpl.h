@@ -5,8 +5,41 @@
 #include <nob.h>
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #define AST_FLAG_REVERSE 0x1
+#define AST_FLAG_TAIL 0x2
+#define AST_FLAG_NO_TAIL 0x4
+#define AST_FLAG_UNROLL 0x8
+#define AST_FLAG_SIMD 0x10
+#define AST_FLAG_REORDER 0x20
+#define AST_FLAG_SOA 0x40
+#define AST_FLAG_SLICE 0x80
+
+#define TAC_FLAG_MUST_TAIL 0x1
+#define TAC_FLAG_NO_TAIL 0x2
+#define TAC_FLAG_ITERATOR 0x4
+#define TAC_FLAG_SLICE 0x8
+#define TAC_FLAG_COUNT 0x10
+
+#define ARG_REG_COUNT 6
+#define UNROLL_FACTOR 4
+#define VEC_REG_COUNT 16
+
+#define VM_STACK_WORDS (1 << 20)
+#define VM_MAX_DEPTH 65536
+#define VM_MAX_ARGS 64
+
+#define JIT_REGION_SIZE (64 << 20)
+#define JIT_MAX_PROCS 512
+#define JIT_THUNK_SIZE 8
+
+// "CMPLPROF", the first qword of every profile file
+#define PROFILE_MAGIC 0x464f52504c504d43ull
+
+// Slices are { data, count } pairs of qwords
+#define SLICE_SIZE 16
+#define SLICE_COUNT_OFFSET 8
 
 typedef enum {
 	TOKEN_EOF,
@@ -50,6 +83,7 @@ typedef enum {
 	TOKEN_PIPE,
 	TOKEN_CARET,
 	TOKEN_TILDE,
+	TOKEN_DIRECTIVE,
 	TOKEN_ERR,
 } Token_Type;
 
@@ -83,8 +117,29 @@ typedef enum {
     AST_FIELD,
 	AST_FIELD_ACCESS,
     AST_TYPE,
+    AST_CONST,
+    AST_RUN,
 } AST_Type;
 
+// Operators of AST_BIN_OP nodes, the unary ones have no left operand
+typedef enum {
+	AST_OP_NONE,
+	AST_OP_ADD,
+	AST_OP_SUB,
+	AST_OP_MUL,
+	AST_OP_DIV,
+	AST_OP_MOD,
+	AST_OP_EQ,
+	AST_OP_NOT_EQ,
+	AST_OP_LESS,
+	AST_OP_LESS_EQ,
+	AST_OP_GREATER,
+	AST_OP_GREATER_EQ,
+	AST_OP_NEG,
+	AST_OP_NOT,
+	AST_OP_COUNT,
+} AST_Op;
+
 typedef struct AST_Node AST_Node;
 
 typedef struct {
@@ -94,6 +149,7 @@ typedef struct {
 
 struct AST_Node {
 	AST_Type type;
+	AST_Op op;
 	char *name;
 
 	AST_Node *left, *right, *body;
@@ -123,17 +179,125 @@ typedef struct {
 
 typedef struct {
 	const char *name;
-	size_t size;
+	const char *type;
+	size_t offset, size;
+} Field_Info;
+
+// Builtin scalars have no fields, structs get their fields in memory order.
+// Arrays of soa structs store one contiguous array per field
+typedef struct {
+	const char *name;
+	size_t size, align;
+	bool soa;
+	struct {
+		Field_Info *items;
+		size_t count, capacity;
+	} fields;
 } TypeInfo;
 
+typedef struct {
+	TypeInfo *items;
+	size_t count, capacity;
+} Type_Table;
+
+// Block execution counts of an instrumented run. Procedures get one counter
+// per basic block of their final TAC, in program order, hash ties the
+// counts to the program and options they were taken with
+typedef struct {
+	uint64_t hash;
+	uint64_t *counts;
+	size_t count;
+} Profile;
+
+// Instrumented builds write their profile to instrument_path on exit.
+// debug_info builds carry symbols and line tables, or a perf map in the JIT.
+// flat_asm emits -O0 code as plain instructions instead of runtime macros
+typedef struct {
+	int opt_level;
+	bool avx2;
+	bool bounds_check;
+	bool debug_info;
+	bool flat_asm;
+	const char *instrument_path;
+	const Profile *profile;
+} Compile_Options;
+
+typedef struct {
+	const char *name;
+	uint64_t weight;
+} Var_Weight;
+
+typedef struct {
+	const char *callee;
+	uint64_t weight;
+} Call_Site;
+
+typedef struct {
+	const char *name;
+	const char *reg;
+} Reg_Var;
+
+// Offsets are positive below rbp, stack passed parameters get a negative
+// offset and no size since they live in the caller's frame. Variables
+// declared without a value are zeroed on entry, the way the VM has them
+typedef struct {
+	const char *name;
+	int offset, size;
+	bool zero;
+} Frame_Slot;
+
+typedef struct X86_Code X86_Code;
+
+// Buffered output to a file that never holds more than a few chunks. Full
+// chunks are queued to a background thread when threaded is set, written
+// in place otherwise
+#define WRITER_CHUNK (64*1024)
+#define WRITER_DEPTH 4
+
+typedef struct {
+	const char *path;
+	int fd;
+	bool threaded, closing, failed;
+	Nob_String_Builder slots[WRITER_DEPTH];
+	size_t put, take, pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} Asm_Writer;
+
+// A split build streams each unit to <exe>.<n>.asm and starts fasm on it
+// as soon as it's complete
+typedef struct {
+	const char *exe;
+	Nob_Procs running;
+	Nob_Cmd cmd, link;
+	size_t units, jobs;
+	bool failed;
+} Asm_Split;
+
 typedef struct {
 	Nob_String_Builder sb;
 	Arena *arena;
-	int local_offset, temp_count;
+	const Compile_Options *opts;
+	struct {
+		Reg_Var *items;
+		size_t count, capacity;
+	} reg_vars;
 	struct {
-		TypeInfo *items;
+		Frame_Slot *items;
 		size_t count, capacity;
-	} types;
+	} frame;
+	int local_offset, frame_size;
+	const char *proc_name;
+	bool self_tail, had_err;
+	Type_Table types;
+	AST_Node *program;
+	X86_Code *code;
+	AST_Node *only;
+	const Profile *profile;
+	size_t counter_base;
+	Asm_Split *split;
+	uint64_t profile_hash;
 } Generator;
 
 typedef enum {
@@ -141,12 +305,26 @@ typedef enum {
     TAC_BINOP,      
     TAC_COPY,       
     TAC_CALL,       
+    TAC_TAIL_CALL,  
     TAC_PARAM,      
     TAC_RETURN,     
     TAC_LABEL,      
     TAC_JUMP,       
     TAC_JUMP_IF,    
     TAC_JUMP_IF_NOT,
+    TAC_DEC_JUMP_NZ,
+    TAC_LOAD,
+    TAC_STORE,
+    TAC_LOAD_FIELD,
+    TAC_STORE_FIELD,
+    TAC_ADDR,
+    TAC_BOUNDS_CHECK,
+    TAC_VEC_SPLAT,
+    TAC_VEC_LOAD,
+    TAC_VEC_STORE,
+    TAC_VEC_BINOP,
+    TAC_VEC_END,
+    TAC_COUNT,
 } TAC_Op;
 
 typedef struct TAC_Inst TAC_Inst;
@@ -155,17 +333,377 @@ struct TAC_Inst {
     char *dest;
     char *src1;
     char *src2;
-    char *op;  
-    TAC_Inst *next;
+    const char *op;  
+    int64_t num;
+    uint32_t flags;
+    int64_t offset;   // constant displacement of field and vector memory ops
+    uint32_t size;    // access width of field loads and stores
+    uint32_t stride;  // bytes between consecutive elements of indexed fields
+    uint32_t line;    // source line of the statement, 0 for generated code
 };
 
+// The TAC of a procedure in one array. Passes refer to instructions by
+// index and to basic blocks by index ranges
+typedef struct {
+    TAC_Inst *items;
+    size_t count, capacity;
+} TAC_List;
+
+// Changes to a TAC_List collected while a pass looks at it, applied in one
+// go: instructions to drop and instructions to insert before an index
+typedef struct {
+    size_t before;
+    TAC_Inst inst;
+} TAC_Insert;
+
+typedef struct {
+    bool *dropped;
+    struct {
+        TAC_Insert *items;
+        size_t count, capacity;
+    } inserts;
+} TAC_Edit;
+
+// A procedure with its final TAC, waiting for its place in the output.
+// Variables weigh what the profile says their uses ran, call sites what
+// their block is expected to run
+typedef struct {
+    AST_Node *node;
+    TAC_List tac;
+    struct {
+        Var_Weight *items;
+        size_t count, capacity;
+    } var_weights;
+    struct {
+        Call_Site *items;
+        size_t count, capacity;
+    } calls;
+} Proc_Unit;
+
 typedef struct {
-    TAC_Inst *head;
-    TAC_Inst *tail;
+    const char *name;
+    char *alias;
+} TAC_Alias;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    int64_t length;
+    bool slice;
+} TAC_Var_Type;
+
+typedef struct {
+    TAC_List list;
     int temp_count;
+    int label_count;
+    int loop_depth;
+    uint32_t line;
+    struct {
+        TAC_Alias *items;
+        size_t count, capacity;
+    } aliases;
+    struct {
+        TAC_Var_Type *items;
+        size_t count, capacity;
+    } var_types;
+    const Compile_Options *opts;
+    const Type_Table *types;
+    bool had_err;
     Arena *arena;
 } TAC_Builder;
 
+// Register numbers match the ModRM/REX encoding
+typedef enum {
+	X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+	X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15,
+} X86_Reg;
+
+// Condition codes use the low nibble of the Jcc/SETcc opcodes
+typedef enum {
+	X86_CC_AE = 0x3,
+	X86_CC_E = 0x4,
+	X86_CC_NE = 0x5,
+	X86_CC_L = 0xC,
+	X86_CC_GE = 0xD,
+	X86_CC_LE = 0xE,
+	X86_CC_G = 0xF,
+} X86_Cond;
+
+typedef enum {
+	X86_OPND_NONE,
+	X86_OPND_REG,
+	X86_OPND_REG32,
+	X86_OPND_REG16,
+	X86_OPND_REG8,
+	X86_OPND_XMM,
+	X86_OPND_YMM,
+	X86_OPND_IMM,
+	X86_OPND_MEM,
+	X86_OPND_LABEL,
+} X86_Operand_Kind;
+
+// Memory operands are [reg + index*scale + disp], no index when scale is 0.
+// With a label they are [label + disp] instead, rip relative once encoded.
+// size is the access width in bytes, 0 means qword
+typedef struct {
+	X86_Operand_Kind kind;
+	uint8_t reg, index, scale, size;
+	int32_t disp;
+	int64_t imm;
+	const char *label;
+} X86_Operand;
+
+typedef enum {
+	X86_LABEL,
+	X86_MOV,
+	X86_MOVZX,
+	X86_LEA,
+	X86_ADD,
+	X86_SUB,
+	X86_IMUL,
+	X86_AND,
+	X86_XOR,
+	X86_SHL,
+	X86_CMP,
+	X86_TEST,
+	X86_DEC,
+	X86_INC,
+	X86_NEG,
+	X86_CQO,
+	X86_IDIV,
+	X86_SETCC,
+	X86_JCC,
+	X86_JMP,
+	X86_CALL,
+	X86_RET,
+	X86_SYSCALL,
+	X86_PUSH,
+	X86_POP,
+	X86_MOVQ,
+	X86_PUNPCKLQDQ,
+	X86_MOVDQA,
+	X86_PADDQ,
+	X86_PSUBQ,
+	X86_VMOVQ,
+	X86_VPBROADCASTQ,
+	X86_VMOVDQU,
+	X86_VPADDQ,
+	X86_VPSUBQ,
+	X86_VZEROUPPER,
+} X86_Op;
+
+typedef struct {
+	X86_Op op;
+	X86_Cond cc;
+	X86_Operand dst, src, src2;
+	uint32_t line;
+} X86_Inst;
+
+typedef struct {
+	X86_Inst *items;
+	size_t count, capacity;
+} X86_List;
+
+// Encoded machine code. Global labels become symbols, rel32 references to
+// labels outside the list they were encoded from are left as fixups at
+// offset until X86Link resolves them. Instrumented code expects counters
+// zeroed qwords at the _profile_counters symbol, their profile gets the
+// profile_hash of the program they were generated from. Lines map the
+// code from offset on to a source line, up to the next row
+typedef struct {
+	const char *name;
+	size_t offset;
+} X86_Symbol;
+
+typedef struct {
+	size_t offset;
+	uint32_t line;
+} X86_Line;
+
+struct X86_Code {
+	struct {
+		uint8_t *items;
+		size_t count, capacity;
+	} bytes;
+	struct {
+		X86_Symbol *items;
+		size_t count, capacity;
+	} symbols, fixups;
+	struct {
+		X86_Line *items;
+		size_t count, capacity;
+	} lines;
+	size_t counters;
+	uint64_t profile_hash;
+};
+
+// One timed call of main. cycles and instructions are -1 without access
+// to the hardware counters, ticks come from rdtsc
+typedef struct {
+	int64_t result;
+	uint64_t nanos, ticks;
+	int64_t cycles, instructions;
+} JIT_Sample;
+
+typedef struct {
+	const char *name;
+	uint64_t hash;
+} JIT_Proc;
+
+// Hot reload keeps one thunk per procedure, jumping through its slot of
+// table. Calls only ever reach a procedure through its thunk, new versions
+// are appended to the region and go live once their slot is patched. The
+// main thread owns procs, the thread running main only gets main_slot
+typedef struct {
+	Compile_Options opts;
+	Arena arena;
+	uint8_t *region, *thunks, *next;
+	void **table;
+	struct {
+		JIT_Proc *items;
+		size_t count, capacity;
+	} procs;
+	pthread_t thread;
+	size_t main_slot;
+	bool running, done, rerun;
+	int64_t result;
+} JIT_Session;
+
+typedef struct {
+	size_t *items;
+	size_t count, capacity;
+} Block_List;
+
+// Instructions begin up to end of the list the CFG was built from
+typedef struct {
+	size_t begin, end;
+	Block_List succs, preds;
+	bool reachable;
+} Basic_Block;
+
+typedef struct {
+	size_t header;
+	bool *blocks;
+	size_t size;
+} Natural_Loop;
+
+typedef struct {
+	Basic_Block *items;
+	size_t count, capacity;
+	TAC_List *tac;
+	uint64_t *dom;
+	size_t dom_words;
+	struct {
+		Natural_Loop *items;
+		size_t count, capacity;
+	} loops;
+} CFG;
+
+// Bytecode of the compile-time interpreter. a, b and c are registers of the
+// current frame, imm is a byte offset from the registers to frame memory, a
+// parameter position or a procedure index. Jumps keep their target in a
+typedef enum {
+	VM_MOV,
+	VM_ADD,
+	VM_SUB,
+	VM_MUL,
+	VM_DIV,
+	VM_MOD,
+	VM_AND,
+	VM_EQ,
+	VM_NE,
+	VM_LT,
+	VM_LE,
+	VM_GT,
+	VM_GE,
+	VM_JMP,
+	VM_JZ,
+	VM_JNZ,
+	VM_JEQ,
+	VM_JNE,
+	VM_JLT,
+	VM_JLE,
+	VM_JGT,
+	VM_JGE,
+	VM_DJNZ,
+	VM_LOAD,
+	VM_STORE,
+	VM_LOAD_PTR,
+	VM_STORE_PTR,
+	VM_LOAD_FIELD,
+	VM_STORE_FIELD,
+	VM_ADDR,
+	VM_CHECK,
+	VM_ARG,
+	VM_CALL,
+	VM_TAIL_CALL,
+	VM_RET,
+} VM_Op;
+
+typedef struct {
+	VM_Op op;
+	int32_t a, b, c;
+	uint32_t size, stride;
+	int64_t imm;
+} VM_Inst;
+
+// Scalars arrive in a register, slices in their 16 bytes of frame memory
+typedef struct {
+	int pos, words;
+	int32_t reg;
+	int64_t offset;
+} VM_Param;
+
+typedef enum {
+	VM_PROC_UNSEEN,
+	VM_PROC_PREPARING,
+	VM_PROC_READY,
+} VM_Proc_State;
+
+// A frame is the procedure's memory followed by its registers, init holds
+// the registers every call starts with, constants included
+typedef struct {
+	AST_Node *ast;
+	const char *name;
+	VM_Proc_State state;
+	struct {
+		VM_Inst *items;
+		size_t count, capacity;
+	} code;
+	struct {
+		VM_Param *items;
+		size_t count, capacity;
+	} params;
+	int64_t *init;
+	int reg_count, mem_words;
+} VM_Proc;
+
+typedef struct {
+	VM_Proc *proc;
+	const VM_Inst *ret;
+	int64_t *regs;
+	int32_t dest;
+} VM_Frame;
+
+typedef struct {
+	Arena *arena;
+	AST_Node *program;
+	Compile_Options opts;
+	Type_Table types;
+	struct {
+		VM_Proc *items;
+		size_t count, capacity;
+	} procs;
+	struct {
+		AST_Node **items;
+		size_t count, capacity;
+	} busy;
+	int64_t *stack;
+	VM_Frame *frames;
+	int64_t args[VM_MAX_ARGS];
+	bool had_err;
+} VM;
+
 #ifdef LEXER_DEF
     const char* token_names[] = {
         [TOKEN_EOF] = "EOF",
@@ -208,6 +746,7 @@ typedef struct {
         [TOKEN_PIPE] = "PIPE",
         [TOKEN_CARET] = "CARET",
         [TOKEN_TILDE] = "TILDE",
+        [TOKEN_DIRECTIVE] = "DIRECTIVE",
         [TOKEN_ERR] = "ERROR"
     };
 #endif
@@ -233,6 +772,8 @@ typedef struct {
 		[AST_FIELD] = "FIELD",
 		[AST_FIELD_ACCESS] = "FIELD_ACCESS",
 		[AST_TYPE] = "TYPE",
+		[AST_CONST] = "CONSTANT",
+		[AST_RUN] = "RUN",
 	};
 
 	static AST_Node *ParseExpression(Parser *parser);
@@ -246,10 +787,6 @@ typedef struct {
 	static AST_Node *ParseStruct(Parser *parser);
 #endif
 
-#ifdef GEN_DEF
-    static void GenExpr(Generator *g, AST_Node *node);
-    static void GenStmt(Generator *g, AST_Node *node);
-#endif
 
 #ifdef TAC_DEF
 	static void StmtToTAC(TAC_Builder *tb, AST_Node *node);
@@ -262,6 +799,9 @@ void LexerPrintToken(Token token);
 void LexerDumpTokenize(const char* src, Arena* arena);
 
 void CollectVariables(AST_Node *node, AST_Array *vars, Arena *arena);
+bool ASTReferences(AST_Node *node, const char *name);
+uint64_t ASTHash(AST_Node *node, uint64_t hash);
+const char* ASTOpName(AST_Op op);
 Parser* ParserCreate(Lexer* lexer, Arena* arena);
 AST_Node* ParserParseProgram(Parser* parser);
 bool ParserHadError(Parser* parser);
@@ -269,8 +809,66 @@ void ASTArrayInit(AST_Array *array);
 void ASTPrintNode(AST_Node* node, int depth);
 void ASTPrintProgram(AST_Node* program);
 
-int TACGetMaxTemp(TAC_Inst *tac);
+void LayoutInit(Type_Table *types, Arena *arena);
+TypeInfo* LayoutFindType(const Type_Table *types, const char *name);
+Field_Info* LayoutFindField(const TypeInfo *type, const char *name);
+bool LayoutStruct(Type_Table *types, AST_Node *node, Arena *arena);
+size_t LayoutArraySize(const TypeInfo *type, size_t length);
+size_t LayoutArrayField(const TypeInfo *type, const Field_Info *field, size_t length);
+int LayoutParamWords(AST_Node *param);
+int LayoutArgPosition(int *regs, int *stack, int words);
+
+int TACGetMaxTemp(TAC_List *tac);
 void TACInit(TAC_Builder *tb, Arena *arena);
 char* ExprToTAC(TAC_Builder *tb, AST_Node *node);
-TAC_Inst* FuncBodyToTAC(AST_Node *body, Arena *arena);
-bool Generate(AST_Node *ast, const char *output_path, Arena *arena);
+void TACMarkTailCalls(TAC_List *tac);
+void TACEditInit(TAC_Edit *edit, TAC_List *tac);
+void TACEditDrop(TAC_Edit *edit, size_t i);
+void TACEditInsert(TAC_Edit *edit, size_t before, TAC_Inst inst);
+void TACEditApply(TAC_Edit *edit, TAC_List *tac, Arena *arena);
+TAC_List FuncBodyToTAC(AST_Node *proc, const Compile_Options *opts, const Type_Table *types, Arena *arena, bool *had_err);
+void CFGBuild(CFG *cfg, TAC_List *tac);
+bool CFGDominates(CFG *cfg, size_t d, size_t b);
+void CFGFindLoops(CFG *cfg);
+void CFGFree(CFG *cfg);
+void OptimizeLoops(TAC_List *tac, Arena *arena);
+void EliminateBoundsChecks(TAC_List *tac);
+uint64_t ProfileHash(AST_Node *program, const Compile_Options *opts);
+bool ProfileLoad(Profile *profile, const char *path);
+bool ProfileWrite(const char *path, uint64_t hash, const uint64_t *counts, size_t count);
+void ProfileInstrument(TAC_List *tac, CFG *cfg, size_t base, Arena *arena);
+void PlaceBlocks(Proc_Unit *unit, const uint64_t *counts, Arena *arena);
+void PlaceProcs(Proc_Unit *units, size_t count);
+void EmitBuf(Nob_String_Builder *sb, const char *buf, size_t count);
+void EmitStr(Nob_String_Builder *sb, const char *str);
+void EmitChar(Nob_String_Builder *sb, char c);
+void EmitInt(Nob_String_Builder *sb, int64_t value);
+void EmitFmt(Nob_String_Builder *sb, const char *fmt, ...);
+#define EmitLit(sb, lit) EmitBuf((sb), "" lit, sizeof(lit) - 1)
+bool WriterOpen(Asm_Writer *w, const char *path, bool threaded);
+void WriterPut(Asm_Writer *w, Nob_String_Builder *sb);
+bool WriterClose(Asm_Writer *w, Nob_String_Builder *sb);
+void X86ZeroLocals(Generator *g, X86_List *out);
+void X86LowerProc(Generator *g, AST_Node *proc, TAC_List *tac, X86_List *out);
+void X86Print(Nob_String_Builder *sb, X86_List *list);
+void X86Peephole(X86_List *list);
+bool X86Encode(X86_Code *code, X86_List *list, Arena *arena);
+void X86Resolve(X86_Code *code);
+bool X86Link(X86_Code *code);
+X86_Symbol* X86FindSymbol(X86_Code *code, const char *name);
+size_t X86SymbolSize(X86_Code *code, size_t i);
+void X86CodeFree(X86_Code *code);
+bool VMRunDirectives(AST_Node *program, Arena *arena);
+bool VMRunMain(AST_Node *program, const Compile_Options *opts, Arena *arena, int64_t *result);
+bool GenerateAsm(AST_Node *ast, const Compile_Options *opts, Arena *arena, Nob_String_Builder *out);
+bool Generate(AST_Node *ast, const char *exe, const Compile_Options *opts, Arena *arena);
+bool GenerateCode(AST_Node *ast, const Compile_Options *opts, Arena *arena, X86_Code *code, AST_Node *only);
+bool GenerateElf(AST_Node *ast, const char *source_path, const char *output_path, const Compile_Options *opts, Arena *arena);
+bool GenerateObject(AST_Node *ast, const char *source_path, const char *output_path, const Compile_Options *opts, Arena *arena);
+bool JITRunMain(AST_Node *program, const Compile_Options *opts, Arena *arena, int64_t *result);
+bool JITBenchMain(AST_Node *program, const Compile_Options *opts, Arena *arena, JIT_Sample *samples, int runs);
+bool JITSessionInit(JIT_Session *s, const Compile_Options *opts);
+bool JITSessionLoad(JIT_Session *s, AST_Node *program, Arena *arena);
+bool JITSessionStart(JIT_Session *s);
+bool JITSessionPoll(JIT_Session *s, int64_t *result);
+void JITSessionFree(JIT_Session *s);
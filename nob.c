@@ -1,6 +1,9 @@
 #define NOB_IMPLEMENTATION
 #include "include/nob.h"
 
+#include <inttypes.h>
+#include <stddef.h>
+
 bool BuildAll() 
 {
     nob_mkdir_if_not_exists("out");
@@ -16,10 +19,621 @@ bool BuildAll()
     nob_cmd_append(&cmd, "src/parser.c");
     nob_cmd_append(&cmd, "src/generator.c");
     nob_cmd_append(&cmd, "src/tac.c");
+    nob_cmd_append(&cmd, "src/cfg.c");
+    nob_cmd_append(&cmd, "src/opt.c");
+    nob_cmd_append(&cmd, "src/layout.c");
+    nob_cmd_append(&cmd, "src/x86.c");
+    nob_cmd_append(&cmd, "src/peephole.c");
+    nob_cmd_append(&cmd, "src/vm.c");
+    nob_cmd_append(&cmd, "src/encoder.c");
+    nob_cmd_append(&cmd, "src/jit.c");
+    nob_cmd_append(&cmd, "src/profile.c");
+    nob_cmd_append(&cmd, "src/place.c");
+    nob_cmd_append(&cmd, "src/elf.c");
+    nob_cmd_append(&cmd, "src/emit.c");
     
     return nob_cmd_run(&cmd);
 }
 
+// Compile throughput: synthetic programs are generated at several sizes and
+// out/cmpl --stats times every phase of building them. The best of a few
+// runs is compared against the checked-in baseline
+#define BENCH_RUNS 3
+#define BENCH_PHASES 6
+#define BENCH_PROCS_PER_STRUCT 16
+#define COMPILER_BASELINE "bench/compiler_baseline.txt"
+
+static const struct {
+    const char *name, *unit;
+} bench_phases[BENCH_PHASES] = {
+    { "read",  "B" },
+    { "lex",   "tok" },
+    { "parse", "node" },
+    { "run",   NULL },
+    { "asm",   "B" },
+    { "code",  "B" },
+};
+
+static const char *bench_field_types[] = { "int", "u32", "u8", "u16" };
+
+typedef struct {
+    size_t lines;
+    int depth, fields;
+} Bench_Shape;
+
+typedef struct {
+    double seconds[BENCH_PHASES];
+    size_t counts[BENCH_PHASES];
+} Bench_Result;
+
+// Loops and branches alternate down to depth, the innermost level does
+// the arithmetic
+static void BenchNest(Nob_String_Builder *sb, int level, int depth, size_t *lines)
+{
+    int indent = (level + 1) * 4;
+    if (level == depth)
+	{
+        nob_sb_appendf(sb, "%*stotal = total + a * %d - b;\n", indent, "", level);
+        *lines += 1;
+        return;
+    }
+
+    if (level % 2 == 0)
+	{
+        nob_sb_appendf(sb, "%*sv%d := 0;\n%*swhile v%d < 3 {\n", indent, "", level, indent, "", level);
+        BenchNest(sb, level + 1, depth, lines);
+        nob_sb_appendf(sb, "%*s    v%d = v%d + 1;\n%*s}\n", indent, "", level, level, indent, "");
+    }
+    else
+	{
+        nob_sb_appendf(sb, "%*sif total > %d {\n", indent, "", level * 7);
+        BenchNest(sb, level + 1, depth, lines);
+        nob_sb_appendf(sb, "%*s} else {\n%*s    total = total - %d;\n%*s}\n", indent, "", indent, "", level, indent, "");
+    }
+    *lines += 4;
+}
+
+static void BenchProc(Nob_String_Builder *sb, size_t index, const Bench_Shape *shape, size_t *lines)
+{
+    size_t wide = index / BENCH_PROCS_PER_STRUCT;
+    if (index % BENCH_PROCS_PER_STRUCT == 0)
+	{
+        nob_sb_appendf(sb, "Wide_%zu :: struct {\n", wide);
+        for (int f = 0; f < shape->fields; f++)
+            nob_sb_appendf(sb, "    f%d: %s;\n", f, bench_field_types[f % 4]);
+        nob_sb_appendf(sb, "}\n\n");
+        *lines += shape->fields + 3;
+    }
+
+    nob_sb_appendf(sb, "bench_%zu :: (a: int, b: int) -> int {\n    w: Wide_%zu;\n", index, wide);
+    int stores = shape->fields < 8 ? shape->fields : 8;
+    for (int f = 0; f < stores; f++)
+        nob_sb_appendf(sb, "    w.f%d = a + %d;\n", f * shape->fields / stores, f);
+    nob_sb_appendf(sb, "    arr: [16]int;\n    for i: 0..15 {\n        arr[i] = i * a + b;\n    }\n");
+    nob_sb_appendf(sb, "    total := w.f0 + arr[7];\n");
+    BenchNest(sb, 0, shape->depth, lines);
+    if (index > 0)
+        nob_sb_appendf(sb, "    total = total + bench_%zu(total, b);\n", index - 1);
+    nob_sb_appendf(sb, "    return total;\n}\n\n");
+    *lines += stores + 11;
+}
+
+static bool GenerateBenchProgram(const char *path, const Bench_Shape *shape)
+{
+    Nob_String_Builder sb = {0};
+    size_t lines = 0, procs = 0;
+    while (lines < shape->lines)
+        BenchProc(&sb, procs++, shape, &lines);
+    nob_sb_appendf(&sb, "main :: () -> int {\n    return bench_%zu(1, 2);\n}\n", procs - 1);
+
+    bool ok = nob_write_entire_file(path, sb.items, sb.count);
+    nob_sb_free(sb);
+    return ok;
+}
+
+static bool RunStats(const char *program, Bench_Result *result)
+{
+    Nob_Cmd cmd = {0};
+    nob_cmd_append(&cmd, "out/cmpl", "-O1", "--stats", program);
+    if (!nob_cmd_run(&cmd, .stdout_path = "out/bench/stats.txt", .stderr_path = "out/bench/stats.log"))
+        return false;
+
+    Nob_String_Builder out = {0};
+    if (!nob_read_entire_file("out/bench/stats.txt", &out))
+        return false;
+    nob_sb_append_null(&out);
+
+    bool ok = true;
+    char *line = out.items;
+    for (int p = 0; p < BENCH_PHASES; p++)
+	{
+        char name[32];
+        if (!line || sscanf(line, "phase %31s %lf %zu", name, &result->seconds[p], &result->counts[p]) != 3 || 
+            strcmp(name, bench_phases[p].name) != 0)
+		{
+            nob_log(NOB_ERROR, "Unexpected output from out/cmpl --stats, see out/bench/stats.log");
+            ok = false;
+            break;
+        }
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+    nob_sb_free(out);
+    return ok;
+}
+
+static double BenchRate(const Bench_Result *result, int p)
+	{ return result->seconds[p] > 0 ? result->counts[p] / result->seconds[p] : 0; }
+
+static double BenchTotal(const Bench_Result *result)
+{
+    double total = 0;
+    for (int p = 0; p < BENCH_PHASES; p++)
+        total += result->seconds[p];
+    return total;
+}
+
+// Baseline lines are "<key> <name> <value>", 0 when there's no such line
+static double BaselineValue(const char *baseline, const char *key, const char *name)
+{
+    if (!baseline)
+        return 0;
+    for (const char *line = baseline; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
+	{
+        char line_key[64], line_name[32];
+        double value;
+        if (sscanf(line, "%63s %31s %lf", line_key, line_name, &value) == 3 && 
+            strcmp(line_key, key) == 0 && strcmp(line_name, name) == 0)
+            return value;
+    }
+    return 0;
+}
+
+static bool LoadBaseline(const char *path, Nob_String_Builder *baseline)
+{
+    if (nob_file_exists(path) != 1 || !nob_read_entire_file(path, baseline))
+        return false;
+    nob_sb_append_null(baseline);
+    return true;
+}
+
+static void PrintBenchRow(size_t lines, const char *phase, double seconds, double rate, const char *unit, double base)
+{
+    printf("%-9zu %-6s %10.4f %12.0f %-5s", lines, phase, seconds, rate, unit);
+    if (base > 0)
+        printf(" %12.0f %+7.1f%%", base, (rate / base - 1) * 100);
+    printf("\n");
+}
+
+static bool BenchCompiler(int argc, char **argv)
+{
+    Bench_Shape shape = { .depth = 6, .fields = 32 };
+    bool save = false;
+    struct {
+        size_t *items;
+        size_t count, capacity;
+    } sizes = {0};
+
+    for (int i = 0; i < argc; i++)
+	{
+        if (strcmp(argv[i], "--save") == 0)
+            save = true;
+        else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+            shape.depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--fields") == 0 && i + 1 < argc)
+            shape.fields = atoi(argv[++i]);
+        else if (atol(argv[i]) > 0)
+            nob_da_append(&sizes, (size_t)atol(argv[i]));
+        else
+		{
+            nob_log(NOB_ERROR, "Usage: nob bench-compiler [--save] [--depth N] [--fields N] [lines...]");
+            return false;
+        }
+    }
+    if (shape.fields < 1 || shape.depth < 0)
+	{
+        nob_log(NOB_ERROR, "--fields needs at least one field and --depth can't be negative");
+        return false;
+    }
+    // A million lines takes minutes, it only runs when asked for
+    if (sizes.count == 0)
+	{
+        nob_da_append(&sizes, 10000);
+        nob_da_append(&sizes, 100000);
+    }
+    if (!BuildAll() || !nob_mkdir_if_not_exists("out/bench"))
+        return false;
+
+    Nob_String_Builder baseline = {0};
+    bool has_baseline = !save && LoadBaseline(COMPILER_BASELINE, &baseline);
+    Nob_String_Builder saved = {0};
+
+    printf("%-9s %-6s %10s %12s %-5s %12s %8s\n", "lines", "phase", "seconds", "rate/s", "unit", "baseline", "change");
+    bool ok = true;
+    for (size_t i = 0; i < sizes.count && ok; i++)
+	{
+        shape.lines = sizes.items[i];
+        const char *program = nob_temp_sprintf("out/bench/gen_%zu.jai", shape.lines);
+        if (!GenerateBenchProgram(program, &shape))
+		{
+            ok = false;
+            break;
+        }
+
+        Bench_Result best = {0};
+        for (int run = 0; run < BENCH_RUNS && ok; run++)
+		{
+            Bench_Result result;
+            ok = RunStats(program, &result);
+            if (ok && (run == 0 || BenchTotal(&result) < BenchTotal(&best)))
+                best = result;
+        }
+        if (!ok)
+            break;
+
+        const char *key = nob_temp_sprintf("%zu", shape.lines);
+        for (int p = 0; p < BENCH_PHASES; p++)
+		{
+            if (!bench_phases[p].unit)
+                continue;
+            double rate = BenchRate(&best, p);
+            PrintBenchRow(shape.lines, bench_phases[p].name, best.seconds[p], rate, bench_phases[p].unit, 
+                          BaselineValue(has_baseline ? baseline.items : NULL, key, bench_phases[p].name));
+            nob_sb_appendf(&saved, "%zu %s %.0f\n", shape.lines, bench_phases[p].name, rate);
+        }
+        double total = BenchTotal(&best);
+        double rate = total > 0 ? shape.lines / total : 0;
+        PrintBenchRow(shape.lines, "total", total, rate, "line", 
+                      BaselineValue(has_baseline ? baseline.items : NULL, key, "total"));
+        nob_sb_appendf(&saved, "%zu total %.0f\n", shape.lines, rate);
+    }
+
+    if (ok && save)
+	{
+        ok = nob_mkdir_if_not_exists("bench") && nob_write_entire_file(COMPILER_BASELINE, saved.items, saved.count);
+        if (ok)
+            nob_log(NOB_INFO, "Saved baseline to %s", COMPILER_BASELINE);
+    }
+    nob_sb_free(baseline);
+    nob_sb_free(saved);
+    nob_da_free(sizes);
+    return ok;
+}
+
+// Runtime of generated code: every kernel in bench/kernels is built at each
+// level and its main called BENCH_SAMPLES times in out/cmpl's JIT, under the
+// hardware counters where the kernel allows them. Medians are compared
+// against the checked-in baseline, lower is better
+#define BENCH_SAMPLES 7
+#define KERNEL_DIR "bench/kernels"
+#define RUNTIME_BASELINE "bench/runtime_baseline.txt"
+
+static const char *bench_levels[] = { "-O1", "-O2" };
+
+typedef struct {
+    int64_t result;
+    uint64_t nanos, ticks;
+    int64_t cycles, instructions;
+} Bench_Sample;
+
+static int CompareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int CompareNames(const void *a, const void *b)
+	{ return strcmp(*(const char**)a, *(const char**)b); }
+
+static bool RunKernel(const char *kernel, const char *level, Bench_Sample *samples)
+{
+    Nob_Cmd cmd = {0};
+    nob_cmd_append(&cmd, "out/cmpl", level, "--bench", nob_temp_sprintf("%d", BENCH_SAMPLES), kernel);
+    if (!nob_cmd_run(&cmd, .stdout_path = "out/bench/samples.txt", .stderr_path = "out/bench/samples.log"))
+        return false;
+
+    Nob_String_Builder out = {0};
+    if (!nob_read_entire_file("out/bench/samples.txt", &out))
+        return false;
+    nob_sb_append_null(&out);
+
+    int count = 0;
+    for (char *line = out.items; line && count < BENCH_SAMPLES; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
+	{
+        Bench_Sample *sample = &samples[count];
+        if (sscanf(line, "sample %" SCNd64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64, &sample->result, 
+                   &sample->nanos, &sample->ticks, &sample->cycles, &sample->instructions) == 5)
+            count++;
+    }
+    nob_sb_free(out);
+    if (count != BENCH_SAMPLES)
+	{
+        nob_log(NOB_ERROR, "Unexpected output from out/cmpl --bench, see out/bench/samples.log");
+        return false;
+    }
+    return true;
+}
+
+static uint64_t Median(Bench_Sample *samples, size_t offset)
+{
+    uint64_t values[BENCH_SAMPLES];
+    for (int i = 0; i < BENCH_SAMPLES; i++)
+        memcpy(&values[i], (char*)&samples[i] + offset, sizeof(uint64_t));
+    qsort(values, BENCH_SAMPLES, sizeof(values[0]), CompareU64);
+    return values[BENCH_SAMPLES / 2];
+}
+
+static void PrintChange(double value, double base)
+{
+    if (base > 0)
+        printf(" %+7.1f%%", (value / base - 1) * 100);
+    else
+        printf(" %8s", "-");
+}
+
+static bool BenchRuntime(int argc, char **argv)
+{
+    bool save = false;
+    for (int i = 0; i < argc; i++)
+	{
+        if (strcmp(argv[i], "--save") != 0)
+		{
+            nob_log(NOB_ERROR, "Usage: nob bench [--save]");
+            return false;
+        }
+        save = true;
+    }
+    if (!BuildAll() || !nob_mkdir_if_not_exists("out/bench"))
+        return false;
+
+    Nob_File_Paths kernels = {0};
+    if (!nob_read_entire_dir(KERNEL_DIR, &kernels))
+        return false;
+    qsort(kernels.items, kernels.count, sizeof(kernels.items[0]), CompareNames);
+
+    Nob_String_Builder baseline = {0};
+    bool has_baseline = !save && LoadBaseline(RUNTIME_BASELINE, &baseline);
+    Nob_String_Builder saved = {0};
+
+    printf("%-12s %-4s %20s %10s %12s %12s %14s %5s %8s %8s\n", "kernel", "opt", "result", "ms", "min ms", "tsc", 
+           "cycles", "ipc", "time", "cycles");
+    bool ok = true;
+    for (size_t k = 0; k < kernels.count && ok; k++)
+	{
+        Nob_String_View name = nob_sv_from_cstr(kernels.items[k]);
+        if (!nob_sv_end_with(name, ".jai"))
+            continue;
+        name.count -= 4;
+        const char *kernel = nob_temp_sprintf("%s/%s", KERNEL_DIR, kernels.items[k]);
+
+        int64_t expected = 0;
+        for (size_t l = 0; l < sizeof(bench_levels) / sizeof(bench_levels[0]) && ok; l++)
+		{
+            Bench_Sample samples[BENCH_SAMPLES];
+            ok = RunKernel(kernel, bench_levels[l], samples);
+            if (!ok)
+                break;
+
+            // Every level has to agree with the first one on the result
+            if (l == 0)
+                expected = samples[0].result;
+            for (int i = 0; i < BENCH_SAMPLES; i++)
+			{
+                if (samples[i].result != expected)
+				{
+                    nob_log(NOB_ERROR, SV_Fmt " %s returned %" PRId64 ", expected %" PRId64, SV_Arg(name), 
+                            bench_levels[l], samples[i].result, expected);
+                    ok = false;
+                    break;
+                }
+            }
+
+            uint64_t nanos = Median(samples, offsetof(Bench_Sample, nanos));
+            uint64_t min_nanos = nanos;
+            for (int i = 0; i < BENCH_SAMPLES; i++)
+                if (samples[i].nanos < min_nanos)
+                    min_nanos = samples[i].nanos;
+            uint64_t ticks = Median(samples, offsetof(Bench_Sample, ticks));
+            bool counters = samples[0].cycles >= 0 && samples[0].instructions >= 0;
+            int64_t cycles = counters ? (int64_t)Median(samples, offsetof(Bench_Sample, cycles)) : -1;
+            int64_t instructions = counters ? (int64_t)Median(samples, offsetof(Bench_Sample, instructions)) : -1;
+
+            printf("%-12.*s %-4s %20" PRId64 " %10.3f %12.3f %12" PRIu64, (int)name.count, name.data, bench_levels[l], 
+                   expected, nanos / 1e6, min_nanos / 1e6, ticks);
+            if (counters)
+                printf(" %14" PRId64 " %5.2f", cycles, (double)instructions / (double)cycles);
+            else
+                printf(" %14s %5s", "-", "-");
+
+            const char *key = nob_temp_sprintf(SV_Fmt "%s", SV_Arg(name), bench_levels[l]);
+            const char *base = has_baseline ? baseline.items : NULL;
+            PrintChange((double)nanos, BaselineValue(base, key, "nanos"));
+            PrintChange((double)cycles, counters ? BaselineValue(base, key, "cycles") : 0);
+            printf("\n");
+
+            nob_sb_appendf(&saved, "%s nanos %" PRIu64 "\n%s ticks %" PRIu64 "\n", key, nanos, key, ticks);
+            if (counters)
+                nob_sb_appendf(&saved, "%s cycles %" PRId64 "\n%s instructions %" PRId64 "\n", key, cycles, key, instructions);
+        }
+    }
+
+    if (ok && save)
+	{
+        ok = nob_write_entire_file(RUNTIME_BASELINE, saved.items, saved.count);
+        if (ok)
+            nob_log(NOB_INFO, "Saved baseline to %s", RUNTIME_BASELINE);
+    }
+    nob_sb_free(baseline);
+    nob_sb_free(saved);
+    nob_da_free(kernels);
+    return ok;
+}
+
+// Differential test: main.jai and every program in the test directories
+// run in out/cmpl's VM with --run, then through --jit at each level, and
+// every run has to return what the VM did. --jit always lowers to flat
+// instructions, so when fasm is around the -O0 macro build is assembled and
+// its exit status checked too. main.jai also has to return the total its
+// last line expects
+#define TEST_OUTPUT "out/test/result.txt"
+#define TEST_LOG "out/test/result.log"
+#define TEST_EXE "out/test/program"
+
+static const char *test_dirs[] = { "tests", KERNEL_DIR };
+
+static const char *test_modes[][2] = {
+    { "-O0", NULL },
+    { "-O1", NULL },
+    { "-O2", NULL },
+    { "-O2", "-mavx2" },
+};
+
+static bool RunProgram(const char *program, const char *level, const char *flag, const char *mode, int64_t *result)
+{
+    Nob_Cmd cmd = {0};
+    nob_cmd_append(&cmd, "out/cmpl", level);
+    if (flag)
+        nob_cmd_append(&cmd, flag);
+    nob_cmd_append(&cmd, mode, program);
+
+    // The exit status is the low byte of the result, only the output line
+    // tells a run that finished from one that didn't, so nob stays quiet
+    Nob_Log_Level level_before = nob_minimal_log_level;
+    nob_minimal_log_level = NOB_NO_LOGS;
+    nob_cmd_run(&cmd, .stdout_path = TEST_OUTPUT, .stderr_path = TEST_LOG);
+    nob_minimal_log_level = level_before;
+    Nob_String_Builder out = {0};
+    bool ok = nob_read_entire_file(TEST_OUTPUT, &out);
+    nob_sb_append_null(&out);
+    const char *line = ok ? strstr(out.items, "main returned ") : NULL;
+    ok = line && sscanf(line, "main returned %" SCNd64, result) == 1;
+    nob_sb_free(out);
+    if (!ok)
+        nob_log(NOB_ERROR, "%s %s%s%s %s failed, see %s", program, level, flag ? " " : "", flag ? flag : "", mode, TEST_LOG);
+    return ok;
+}
+
+// Builds program the default way and runs it, the exit status is the low
+// byte of what main returned
+static bool RunNative(const char *program, int64_t *status)
+{
+    Nob_Cmd cmd = {0};
+    nob_cmd_append(&cmd, "out/cmpl", "-O0", program, TEST_EXE);
+    Nob_Log_Level level_before = nob_minimal_log_level;
+    nob_minimal_log_level = NOB_NO_LOGS;
+    remove(TEST_EXE);
+    bool ok = nob_cmd_run(&cmd, .stdout_path = TEST_LOG, .stderr_path = TEST_LOG) && nob_file_exists(TEST_EXE) == 1;
+    if (ok)
+	{
+        nob_cmd_append(&cmd, "sh", "-c", TEST_EXE "; echo \"main returned $?\"");
+        nob_cmd_run(&cmd, .stdout_path = TEST_OUTPUT, .stderr_path = TEST_LOG);
+    }
+    nob_minimal_log_level = level_before;
+    nob_cmd_free(cmd);
+
+    Nob_String_Builder out = {0};
+    ok = ok && nob_read_entire_file(TEST_OUTPUT, &out);
+    nob_sb_append_null(&out);
+    const char *line = ok ? strstr(out.items, "main returned ") : NULL;
+    ok = line && sscanf(line, "main returned %" SCNd64, status) == 1;
+    nob_sb_free(out);
+    if (!ok)
+        nob_log(NOB_ERROR, "%s -O0 native build failed, see %s", program, TEST_LOG);
+    return ok;
+}
+
+static bool HasFasm(void)
+{
+    Nob_Cmd cmd = {0};
+    nob_cmd_append(&cmd, "sh", "-c", "command -v fasm");
+    Nob_Log_Level level_before = nob_minimal_log_level;
+    nob_minimal_log_level = NOB_NO_LOGS;
+    bool ok = nob_cmd_run(&cmd, .stdout_path = TEST_LOG);
+    nob_minimal_log_level = level_before;
+    return ok;
+}
+
+// The number after "Expected:" in the file, main.jai's return line has it
+static bool ExpectedResult(const char *program, int64_t *expected)
+{
+    Nob_String_Builder sb = {0};
+    if (!nob_read_entire_file(program, &sb))
+        return false;
+    nob_sb_append_null(&sb);
+    const char *at = strstr(sb.items, "Expected:");
+    bool ok = at && sscanf(at, "Expected: %" SCNd64, expected) == 1;
+    nob_sb_free(sb);
+    return ok;
+}
+
+static bool TestProgram(const char *program, bool native)
+{
+    int64_t reference, result;
+    if (!RunProgram(program, "-O0", NULL, "--run", &reference))
+        return false;
+
+    bool ok = true;
+    for (size_t m = 0; m < sizeof(test_modes) / sizeof(test_modes[0]); m++)
+	{
+        const char *level = test_modes[m][0], *flag = test_modes[m][1];
+        if (!RunProgram(program, level, flag, "--jit", &result))
+            ok = false;
+        else if (result != reference)
+		{
+            nob_log(NOB_ERROR, "%s %s%s%s --jit returned %" PRId64 ", --run returned %" PRId64, program, level, 
+                    flag ? " " : "", flag ? flag : "", result, reference);
+            ok = false;
+        }
+    }
+    if (native)
+	{
+        if (!RunNative(program, &result))
+            ok = false;
+        else if (result != (uint8_t)reference)
+		{
+            nob_log(NOB_ERROR, "%s -O0 exited with %" PRId64 ", --run returned %" PRId64 " (low byte %d)", program, 
+                    result, reference, (uint8_t)reference);
+            ok = false;
+        }
+    }
+    if (ok)
+        nob_log(NOB_INFO, "%s: %" PRId64, program, reference);
+    return ok;
+}
+
+static bool RunTests(void)
+{
+    if (!BuildAll() || !nob_mkdir_if_not_exists("out/test"))
+        return false;
+
+    bool native = HasFasm();
+    if (!native)
+        nob_log(NOB_WARNING, "fasm not found, the -O0 macro build is not tested");
+
+    int64_t expected, result;
+    bool ok = ExpectedResult("main.jai", &expected) && TestProgram("main.jai", native) && 
+              RunProgram("main.jai", "-O0", NULL, "--run", &result);
+    if (ok && result != expected)
+	{
+        nob_log(NOB_ERROR, "main.jai returned %" PRId64 ", expected %" PRId64, result, expected);
+        ok = false;
+    }
+
+    for (size_t d = 0; d < sizeof(test_dirs) / sizeof(test_dirs[0]); d++)
+	{
+        Nob_File_Paths programs = {0};
+        if (!nob_read_entire_dir(test_dirs[d], &programs))
+            return false;
+        qsort(programs.items, programs.count, sizeof(programs.items[0]), CompareNames);
+        for (size_t i = 0; i < programs.count; i++)
+            if (nob_sv_end_with(nob_sv_from_cstr(programs.items[i]), ".jai"))
+                ok &= TestProgram(nob_temp_sprintf("%s/%s", test_dirs[d], programs.items[i]), native);
+        nob_da_free(programs);
+    }
+    return ok;
+}
+
 int main(int argc, char **argv) 
 {
     NOB_GO_REBUILD_URSELF(argc, argv);
@@ -38,6 +652,12 @@ int main(int argc, char **argv)
         success &= BuildAll();
         return !(success);
     } 
+	else if (strcmp(command, "bench") == 0)
+        return !BenchRuntime(argc - 2, argv + 2);
+	else if (strcmp(command, "bench-compiler") == 0)
+        return !BenchCompiler(argc - 2, argv + 2);
+	else if (strcmp(command, "test") == 0)
+        return !RunTests();
 	else 
 	{
         nob_log(NOB_ERROR, "Unknown command: %s", command);
@@ -51,10 +51,52 @@ macro _EndWhile
     restore while_label_end
 }
 
+; Flat control flow used by the TAC lowering, labels are local to the procedure
+macro _Jump target
+{
+    jmp target
+}
+
+macro _JumpIfNot condition, target
+{
+    common
+    condition
+    test rax, rax
+    jz target
+}
+
+macro _JumpIf condition, target
+{
+    common
+    condition
+    test rax, rax
+    jnz target
+}
+
+; Fused compare and branch, cond is a condition code suffix (l, ge, ne, ...)
+macro _CmpJump left, right, cond, target
+{
+    common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cmp rax, rcx
+    j#cond target
+}
+
+macro _DecJnz counter, target
+{
+    dec counter
+    jnz target
+}
+
 macro _Return expr 
 {
     common
     expr
+    _RestoreCalleeSaved
     mov rsp, rbp
     pop rbp
     ret
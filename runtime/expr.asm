@@ -13,15 +13,20 @@ macro _Var name
     _LoadVar rax, name
 }
 
+macro _Reg reg
+{
+    mov rax, reg
+}
+
 macro _Add left, right 
 {
 	common
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
     pop rax
-    add rax, rbx
+    add rax, rcx
 }
 
 macro _Sub left, right 
@@ -30,9 +35,9 @@ macro _Sub left, right
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
     pop rax
-    sub rax, rbx
+    sub rax, rcx
 }
 
 macro _Mul left, right 
@@ -41,9 +46,154 @@ macro _Mul left, right
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
+    pop rax
+    imul rax, rcx
+}
+
+; Signed, the remainder is left in rdx
+macro _Div left, right
+{
+	common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cqo
+    idiv rcx
+}
+
+macro _Mod left, right
+{
+	common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cqo
+    idiv rcx
+    mov rax, rdx
+}
+
+macro _And left, right
+{
+	common
+    left
+    push rax
+    right
+    mov rcx, rax
     pop rax
-    imul rax, rbx
+    and rax, rcx
+}
+
+; Fixed array elements, the array's first element sits at [rbp - name_offset]
+macro _Index array, index
+{
+	common
+    index
+    mov rax, [rbp - array#_offset + rax*8]
+}
+
+macro _StoreIndex array, index, value
+{
+	common
+    value
+    push rax
+    index
+    mov rcx, rax
+    pop rax
+    mov [rbp - array#_offset + rcx*8], rax
+}
+
+; Slices hold the address of their first element at offset 0 and the
+; element count at offset 8
+macro _SliceIndex slice, index
+{
+	common
+    index
+    mov rcx, [rbp - slice#_offset]
+    mov rax, [rcx + rax*8]
+}
+
+macro _StoreSliceIndex slice, index, value
+{
+	common
+    index
+    mov rcx, [rbp - slice#_offset]
+    lea rcx, [rcx + rax*8]
+    push rcx
+    value
+    pop rcx
+    mov [rcx], rax
+}
+
+macro _Address var_name
+{
+    lea rax, [rbp - var_name#_offset]
+}
+
+; Sized access to a field address, narrow fields are zero extended on load
+; and truncated on store
+macro _LoadSized size, address
+{
+    if size = 8
+        mov rax, qword address
+    else if size = 4
+        mov eax, dword address
+    else if size = 2
+        movzx rax, word address
+    else
+        movzx rax, byte address
+    end if
+}
+
+macro _StoreSized size, address
+{
+    if size = 8
+        mov qword address, rax
+    else if size = 4
+        mov dword address, eax
+    else if size = 2
+        mov word address, ax
+    else
+        mov byte address, al
+    end if
+}
+
+; Struct fields sit at a fixed byte offset from [rbp - base_offset]
+macro _Field base, offset, size
+{
+    _LoadSized size, [rbp - base#_offset + offset]
+}
+
+macro _StoreField base, offset, size, value
+{
+	common
+    value
+    _StoreSized size, [rbp - base#_offset + offset]
+}
+
+; Fields of struct array elements are stride bytes apart, the struct size
+; or the field size for #soa arrays
+macro _ElementField base, offset, size, stride, index
+{
+	common
+    index
+    imul rax, rax, stride
+    _LoadSized size, [rbp - base#_offset + offset + rax]
+}
+
+macro _StoreElementField base, offset, size, stride, index, value
+{
+	common
+    value
+    push rax
+    index
+    imul rcx, rax, stride
+    pop rax
+    _StoreSized size, [rbp - base#_offset + offset + rcx]
 }
 
 macro _Assign var_name, expr 
@@ -53,6 +203,13 @@ macro _Assign var_name, expr
     _StoreVar var_name, rax
 }
 
+macro _AssignReg reg, expr
+{
+	common
+    expr
+    mov reg, rax
+}
+
 macro _TempAssign name, expr
 {
 	expr
@@ -65,9 +222,9 @@ macro _Equal left, right
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
     pop rax
-    cmp rax, rbx
+    cmp rax, rcx
     mov rax, 0
     sete al
 }
@@ -78,9 +235,9 @@ macro _Less left, right
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
     pop rax
-    cmp rax, rbx
+    cmp rax, rcx
     mov rax, 0
     setl al
 }
@@ -91,10 +248,49 @@ macro _Greater left, right
     left
     push rax
     right
-    mov rbx, rax
+    mov rcx, rax
     pop rax
-    cmp rax, rbx
+    cmp rax, rcx
     mov rax, 0
     setg al
 }
 
+
+macro _NotEqual left, right
+{
+    common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cmp rax, rcx
+    mov rax, 0
+    setne al
+}
+
+macro _LessEq left, right
+{
+    common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cmp rax, rcx
+    mov rax, 0
+    setle al
+}
+
+macro _GreaterEq left, right
+{
+    common
+    left
+    push rax
+    right
+    mov rcx, rax
+    pop rax
+    cmp rax, rcx
+    mov rax, 0
+    setge al
+}
@@ -0,0 +1,102 @@
+; asmsyntax=fasm
+
+; Macros every generated unit uses, the program and the units of a split
+; build include them once each
+
+include 'runtime/expr.asm'
+include 'runtime/ctrl_flow.asm'
+include 'runtime/simd.asm'
+
+macro _SysExit code
+{
+	mov rax, 60
+	mov rdi, code
+	syscall
+}
+
+macro _FuncBegin name
+{
+	name:
+	    push rbp
+	    mov rbp, rsp
+}
+
+; Redefined by procedures that keep values in r12-r15, purged after them
+macro _RestoreCalleeSaved
+{
+}
+
+; Reached only when the procedure falls off its end, which returns 0
+macro _FuncEnd
+{
+	xor eax, eax
+	_RestoreCalleeSaved
+	mov rsp, rbp
+	pop rbp
+	ret
+}
+
+current_stack_offset = 0
+
+macro _DeclareVar name, size 
+{
+    current_stack_offset = current_stack_offset + size
+    name#_offset = current_stack_offset
+}
+
+macro _LoadVar dest, var_name 
+{
+    mov dest, [rbp - var_name#_offset]
+}
+
+macro _StoreVar var_name, src 
+{
+    mov [rbp - var_name#_offset], src
+}
+
+macro _TailCall target
+{
+	_RestoreCalleeSaved
+	mov rsp, rbp
+	pop rbp
+	jmp target
+}
+
+macro _Arg dest, expr
+{
+	common
+	expr
+	mov dest, rax
+}
+
+macro _FuncBeginWithLocals name, locals_size 
+{
+    name:
+    push rbp
+    mov rbp, rsp
+    if locals_size > 0
+        sub rsp, locals_size
+    end if
+    current_stack_offset = 0
+}
+
+; Instrumented programs define PROFILE and their counters, which are
+; written to _profile_path before exiting
+macro _DumpProfile
+{
+	mov rax, 2
+	mov rdi, _profile_path
+	mov rsi, 0x241
+	mov rdx, 0644o
+	syscall
+	test rax, rax
+	js .no_profile
+	mov rdi, rax
+	mov rax, 1
+	mov rsi, _profile_header
+	mov rdx, _profile_size
+	syscall
+	mov rax, 3
+	syscall
+.no_profile:
+}
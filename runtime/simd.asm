@@ -0,0 +1,86 @@
+; asmsyntax=fasm
+
+; Packed 64-bit integer lanes for vectorized loops. Registers are passed by
+; number, _Vec* work on SSE2 xmm registers and _Avx* on AVX2 ymm registers.
+; Elements are addressed the same way _Index does
+macro _VecSplat reg, expr
+{
+    common
+    expr
+    movq xmm#reg, rax
+    punpcklqdq xmm#reg, xmm#reg
+}
+
+; The loop prologue aligns the index to the lane count, aligned moves are safe
+macro _VecLoad reg, array, offset, index
+{
+    common
+    index
+    movdqa xmm#reg, [rbp - array#_offset + offset + rax*8]
+}
+
+macro _VecStore array, offset, index, reg
+{
+    common
+    index
+    movdqa [rbp - array#_offset + offset + rax*8], xmm#reg
+}
+
+macro _VecAdd dest, left, right
+{
+    if dest <> left
+        movdqa xmm#dest, xmm#left
+    end if
+    paddq xmm#dest, xmm#right
+}
+
+macro _VecSub dest, left, right
+{
+    if dest <> left
+        movdqa xmm#dest, xmm#left
+    end if
+    psubq xmm#dest, xmm#right
+}
+
+macro _VecEnd
+{
+}
+
+macro _AvxSplat reg, expr
+{
+    common
+    expr
+    vmovq xmm#reg, rax
+    vpbroadcastq ymm#reg, xmm#reg
+}
+
+; The frame only guarantees 16 byte alignment, ymm moves stay unaligned
+macro _AvxLoad reg, array, offset, index
+{
+    common
+    index
+    vmovdqu ymm#reg, [rbp - array#_offset + offset + rax*8]
+}
+
+macro _AvxStore array, offset, index, reg
+{
+    common
+    index
+    vmovdqu [rbp - array#_offset + offset + rax*8], ymm#reg
+}
+
+macro _AvxAdd dest, left, right
+{
+    vpaddq ymm#dest, ymm#left, ymm#right
+}
+
+macro _AvxSub dest, left, right
+{
+    vpsubq ymm#dest, ymm#left, ymm#right
+}
+
+; Dirty upper halves slow down every later SSE instruction
+macro _AvxEnd
+{
+    vzeroupper
+}
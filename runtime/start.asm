@@ -0,0 +1,26 @@
+; asmsyntax=fasm
+
+; The program's entry and the target of failed bounds checks. Split builds
+; assemble them as a unit of their own
+
+_start:
+    call func_main
+	mov rdi, rax
+if defined PROFILE
+	push rdi
+	_DumpProfile
+	pop rdi
+end if
+	_SysExit rdi
+
+; Failed bounds checks jump here, the program ends with status 101
+_bounds_fail:
+	mov rax, 1
+	mov rdi, 2
+	mov rsi, _bounds_message
+	mov rdx, _bounds_message_length
+	syscall
+	_SysExit 101
+
+_bounds_message db 'index out of bounds', 10
+_bounds_message_length = $ - _bounds_message
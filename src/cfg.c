@@ -0,0 +1,246 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool EndsBlock(TAC_Inst *inst)
+{
+    return inst->type == TAC_JUMP || inst->type == TAC_JUMP_IF || inst->type == TAC_JUMP_IF_NOT ||
+           inst->type == TAC_DEC_JUMP_NZ || inst->type == TAC_RETURN || inst->type == TAC_TAIL_CALL;
+}
+
+// Labels come from NewLabel as ".L<n>", the number doubles as a table index
+static int LabelIndex(const char *label)
+	{ return atoi(label + 2); }
+
+static void AddEdge(CFG *cfg, size_t from, size_t to)
+{
+    nob_da_append(&cfg->items[from].succs, to);
+    nob_da_append(&cfg->items[to].preds, from);
+}
+
+static void ComputeReachable(CFG *cfg)
+{
+    size_t *stack = malloc(cfg->count * sizeof(size_t));
+    size_t top = 0;
+
+    cfg->items[0].reachable = true;
+    stack[top++] = 0;
+    while (top > 0)
+	{
+        Basic_Block *block = &cfg->items[stack[--top]];
+        for (size_t i = 0; i < block->succs.count; i++)
+		{
+            Basic_Block *succ = &cfg->items[block->succs.items[i]];
+            if (!succ->reachable)
+			{
+                succ->reachable = true;
+                stack[top++] = block->succs.items[i];
+            }
+        }
+    }
+
+    free(stack);
+}
+
+// Iterative dataflow over bitsets, dom(b) = {b} + intersection of dom(p) over preds
+static void ComputeDominators(CFG *cfg)
+{
+    size_t words = (cfg->count + 63) / 64;
+    cfg->dom_words = words;
+    cfg->dom = malloc(cfg->count * words * sizeof(uint64_t));
+
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        uint64_t *set = &cfg->dom[b * words];
+        memset(set, b == 0 ? 0x00 : 0xff, words * sizeof(uint64_t));
+    }
+    cfg->dom[0] |= 1;
+
+    uint64_t *tmp = malloc(words * sizeof(uint64_t));
+    bool changed = true;
+    while (changed)
+	{
+        changed = false;
+        for (size_t b = 1; b < cfg->count; b++)
+		{
+            Basic_Block *block = &cfg->items[b];
+            if (!block->reachable)
+                continue;
+
+            memset(tmp, 0xff, words * sizeof(uint64_t));
+            for (size_t i = 0; i < block->preds.count; i++)
+			{
+                size_t p = block->preds.items[i];
+                if (!cfg->items[p].reachable)
+                    continue;
+                for (size_t w = 0; w < words; w++)
+                    tmp[w] &= cfg->dom[p * words + w];
+            }
+            tmp[b / 64] |= 1ull << (b % 64);
+
+            if (memcmp(tmp, &cfg->dom[b * words], words * sizeof(uint64_t)) != 0)
+			{
+                memcpy(&cfg->dom[b * words], tmp, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+
+    free(tmp);
+}
+
+void CFGBuild(CFG *cfg, TAC_List *tac)
+{
+    *cfg = (CFG){ .tac = tac };
+    if (tac->count == 0)
+        return;
+
+    // Split into blocks at labels and after every control transfer
+    int max_label = -1;
+    size_t begin = 0;
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        TAC_Inst *inst = &tac->items[i];
+        if (inst->type == TAC_LABEL)
+		{
+            if (i > begin)
+			{
+                Basic_Block block = { .begin = begin, .end = i };
+                nob_da_append(cfg, block);
+                begin = i;
+            }
+            if (LabelIndex(inst->dest) > max_label)
+                max_label = LabelIndex(inst->dest);
+        }
+
+        if (EndsBlock(inst))
+		{
+            Basic_Block block = { .begin = begin, .end = i + 1 };
+            nob_da_append(cfg, block);
+            begin = i + 1;
+        }
+    }
+    if (tac->count > begin)
+	{
+        Basic_Block block = { .begin = begin, .end = tac->count };
+        nob_da_append(cfg, block);
+    }
+
+    size_t *label_block = malloc((max_label + 1) * sizeof(size_t));
+    for (size_t b = 0; b < cfg->count; b++)
+        if (tac->items[cfg->items[b].begin].type == TAC_LABEL)
+            label_block[LabelIndex(tac->items[cfg->items[b].begin].dest)] = b;
+
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        TAC_Inst *last = &tac->items[cfg->items[b].end - 1];
+        switch (last->type)
+		{
+            case TAC_JUMP:
+                AddEdge(cfg, b, label_block[LabelIndex(last->dest)]);
+                break;
+
+            case TAC_JUMP_IF:
+            case TAC_JUMP_IF_NOT:
+            case TAC_DEC_JUMP_NZ:
+                AddEdge(cfg, b, label_block[LabelIndex(last->dest)]);
+                if (b + 1 < cfg->count)
+                    AddEdge(cfg, b, b + 1);
+                break;
+
+            case TAC_RETURN:
+            case TAC_TAIL_CALL:
+                break;
+
+            default:
+                if (b + 1 < cfg->count)
+                    AddEdge(cfg, b, b + 1);
+                break;
+        }
+    }
+    free(label_block);
+
+    ComputeReachable(cfg);
+    ComputeDominators(cfg);
+}
+
+bool CFGDominates(CFG *cfg, size_t d, size_t b)
+	{ return (cfg->dom[b * cfg->dom_words + d / 64] >> (d % 64)) & 1; }
+
+// Every edge b -> h where h dominates b closes a natural loop, the body is
+// everything that reaches b backwards without passing through h
+void CFGFindLoops(CFG *cfg)
+{
+    size_t *stack = malloc((cfg->count + 1) * sizeof(size_t));
+
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        Basic_Block *block = &cfg->items[b];
+        if (!block->reachable)
+            continue;
+
+        for (size_t i = 0; i < block->succs.count; i++)
+		{
+            size_t h = block->succs.items[i];
+            if (!CFGDominates(cfg, h, b))
+                continue;
+
+            Natural_Loop *loop = NULL;
+            for (size_t l = 0; l < cfg->loops.count; l++)
+                if (cfg->loops.items[l].header == h)
+                    loop = &cfg->loops.items[l];
+            if (!loop)
+			{
+                Natural_Loop fresh = {
+                    .header = h,
+                    .blocks = calloc(cfg->count, sizeof(bool)),
+                    .size = 1,
+                };
+                fresh.blocks[h] = true;
+                nob_da_append(&cfg->loops, fresh);
+                loop = &cfg->loops.items[cfg->loops.count - 1];
+            }
+
+            size_t top = 0;
+            if (!loop->blocks[b])
+			{
+                loop->blocks[b] = true;
+                loop->size++;
+                stack[top++] = b;
+            }
+            while (top > 0)
+			{
+                Basic_Block *member = &cfg->items[stack[--top]];
+                for (size_t p = 0; p < member->preds.count; p++)
+				{
+                    size_t pred = member->preds.items[p];
+                    if (!loop->blocks[pred] && cfg->items[pred].reachable)
+					{
+                        loop->blocks[pred] = true;
+                        loop->size++;
+                        stack[top++] = pred;
+                    }
+                }
+            }
+        }
+    }
+
+    free(stack);
+}
+
+void CFGFree(CFG *cfg)
+{
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        nob_da_free(cfg->items[b].succs);
+        nob_da_free(cfg->items[b].preds);
+    }
+    for (size_t l = 0; l < cfg->loops.count; l++)
+        free(cfg->loops.items[l].blocks);
+    nob_da_free(cfg->loops);
+    nob_da_free(*cfg);
+    free(cfg->dom);
+    *cfg = (CFG){0};
+}
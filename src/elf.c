@@ -0,0 +1,582 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// -g builds skip fasm and write the executable straight from the encoded
+// code, with the section headers a fasm executable has none of: a .symtab
+// naming every procedure and a DWARF .debug_line table mapping the code
+// back to the source lines. The file loads at ELF_BASE:
+//
+//     headers, procedures, runtime stubs and strings    R X
+//     profile header and counters, when instrumented    R W
+//     DWARF sections, .symtab, .strtab, .shstrtab, section headers
+//
+// -c writes a relocatable object with .text, .rela.text and the symbols,
+// no _start and no line info
+
+#define ELF_BASE 0x400000
+#define ELF_PAGE 0x1000
+#define PROFILE_HEADER_SIZE (3 * sizeof(uint64_t))
+
+#define DW_TAG_compile_unit 0x11
+#define DW_AT_name 0x03
+#define DW_AT_stmt_list 0x10
+#define DW_AT_low_pc 0x11
+#define DW_AT_high_pc 0x12
+#define DW_AT_producer 0x25
+#define DW_FORM_addr 0x01
+#define DW_FORM_data4 0x06
+#define DW_FORM_string 0x08
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+
+typedef struct {
+    const char *name;
+    Elf64_Shdr header;
+} Elf_Section;
+
+typedef struct {
+    Elf_Section *items;
+    size_t count, capacity;
+} Elf_Sections;
+
+// The text segment maps the file from its start, so the code sits at the
+// same offset in the file and from ELF_BASE. Data goes on the next page
+typedef struct {
+    int phnum;
+    size_t text_offset, data_offset, data_size;
+    uint64_t text_addr, data_addr;
+} Elf_Layout;
+
+static X86_Operand Reg(X86_Reg reg)
+	{ return (X86_Operand){ .kind = X86_OPND_REG, .reg = reg }; }
+
+static X86_Operand Imm(int64_t value)
+	{ return (X86_Operand){ .kind = X86_OPND_IMM, .imm = value }; }
+
+static X86_Operand MemLabel(const char *label)
+	{ return (X86_Operand){ .kind = X86_OPND_MEM, .label = label }; }
+
+static X86_Operand Label(const char *name)
+	{ return (X86_Operand){ .kind = X86_OPND_LABEL, .label = name }; }
+
+static X86_Operand None(void)
+	{ return (X86_Operand){ .kind = X86_OPND_NONE }; }
+
+static void Emit(X86_List *out, X86_Op op, X86_Operand dst, X86_Operand src)
+{
+    X86_Inst inst = { .op = op, .dst = dst, .src = src };
+    nob_da_append(out, inst);
+}
+
+static void EmitSyscall(X86_List *out, int64_t number)
+{
+    Emit(out, X86_MOV, Reg(X86_RAX), Imm(number));
+    Emit(out, X86_SYSCALL, None(), None());
+}
+
+static size_t AlignUp(size_t value, size_t align)
+	{ return (value + align - 1) / align * align; }
+
+static Elf_Layout Layout(X86_Code *code)
+{
+    Elf_Layout layout = { .phnum = code->counters > 0 ? 2 : 1 };
+    layout.text_offset = AlignUp(sizeof(Elf64_Ehdr) + layout.phnum * sizeof(Elf64_Phdr), 16);
+    layout.text_addr = ELF_BASE + layout.text_offset;
+    layout.data_offset = AlignUp(layout.text_offset + code->bytes.count, 8);
+    layout.data_addr = AlignUp(ELF_BASE + layout.data_offset, ELF_PAGE) + layout.data_offset % ELF_PAGE;
+    layout.data_size = PROFILE_HEADER_SIZE + code->counters * sizeof(uint64_t);
+    return layout;
+}
+
+static void AddSymbol(X86_Code *code, const char *name)
+{
+    X86_Symbol symbol = { .name = name, .offset = code->bytes.count };
+    nob_da_append(&code->symbols, symbol);
+}
+
+// What runtime/core.asm gives the fasm build: _start exits with the result
+// of main, dumping the profile first when instrumented, and _bounds_fail.
+// Objects only get _bounds_fail. The strings follow the code, data_start
+// is where they begin
+static bool AddRuntime(X86_Code *code, const Compile_Options *opts, bool start, Arena *arena, size_t *data_start)
+{
+    static const char bounds_message[] = "index out of bounds\n";
+    X86_List list = {0};
+    if (start)
+	{
+        Emit(&list, X86_LABEL, Label("_start"), None());
+        Emit(&list, X86_CALL, Label("func_main"), None());
+        Emit(&list, X86_MOV, Reg(X86_RDI), Reg(X86_RAX));
+    }
+    if (start && code->counters > 0)
+	{
+        Emit(&list, X86_PUSH, Reg(X86_RDI), None());
+        Emit(&list, X86_LEA, Reg(X86_RDI), MemLabel("_profile_path"));
+        Emit(&list, X86_MOV, Reg(X86_RSI), Imm(0x241));
+        Emit(&list, X86_MOV, Reg(X86_RDX), Imm(0644));
+        EmitSyscall(&list, 2);
+        Emit(&list, X86_TEST, Reg(X86_RAX), Reg(X86_RAX));
+        X86_Inst skip = { .op = X86_JCC, .cc = X86_CC_L, .dst = Label(".no_profile") };
+        nob_da_append(&list, skip);
+        Emit(&list, X86_MOV, Reg(X86_RDI), Reg(X86_RAX));
+        Emit(&list, X86_LEA, Reg(X86_RSI), MemLabel("_profile_header"));
+        Emit(&list, X86_MOV, Reg(X86_RDX), Imm((int64_t)(PROFILE_HEADER_SIZE + code->counters * sizeof(uint64_t))));
+        EmitSyscall(&list, 1);
+        EmitSyscall(&list, 3);
+        Emit(&list, X86_LABEL, Label(".no_profile"), None());
+        Emit(&list, X86_POP, Reg(X86_RDI), None());
+    }
+    if (start)
+        EmitSyscall(&list, 60);
+
+    Emit(&list, X86_LABEL, Label("_bounds_fail"), None());
+    Emit(&list, X86_MOV, Reg(X86_RDI), Imm(2));
+    Emit(&list, X86_LEA, Reg(X86_RSI), MemLabel("_bounds_message"));
+    Emit(&list, X86_MOV, Reg(X86_RDX), Imm(sizeof(bounds_message) - 1));
+    EmitSyscall(&list, 1);
+    Emit(&list, X86_MOV, Reg(X86_RDI), Imm(101));
+    EmitSyscall(&list, 60);
+
+    bool ok = X86Encode(code, &list, arena);
+    nob_da_free(list);
+
+    *data_start = code->bytes.count;
+    AddSymbol(code, "_bounds_message");
+    nob_da_append_many(&code->bytes, bounds_message, sizeof(bounds_message) - 1);
+    if (code->counters > 0)
+	{
+        AddSymbol(code, "_profile_path");
+        nob_da_append_many(&code->bytes, opts->instrument_path, strlen(opts->instrument_path) + 1);
+    }
+    return ok;
+}
+
+static void Uleb(Nob_String_Builder *sb, uint64_t value)
+{
+    while (value >= 0x80)
+	{
+        nob_da_append(sb, (char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    nob_da_append(sb, (char)value);
+}
+
+static void Sleb(Nob_String_Builder *sb, int64_t value)
+{
+    while (value < -0x40 || value >= 0x40)
+	{
+        nob_da_append(sb, (char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    nob_da_append(sb, (char)(value & 0x7f));
+}
+
+static void Append(Nob_String_Builder *sb, uint64_t value, int count)
+{
+    for (int i = 0; i < count; i++)
+        nob_da_append(sb, (char)(value >> (i * 8)));
+}
+
+static void Patch32(Nob_String_Builder *sb, size_t at, size_t value)
+{
+    uint32_t value32 = (uint32_t)value;
+    memcpy(sb->items + at, &value32, sizeof(value32));
+}
+
+// A DWARF 3 line program with one sequence over the procedures. Rows only
+// use the standard opcodes, line info is small next to the code
+static void DebugLine(Nob_String_Builder *sb, X86_Code *code, const char *file, uint64_t address, size_t end)
+{
+    static const uint8_t opcode_lengths[] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+    size_t unit = sb->count;
+    Append(sb, 0, 4);
+    Append(sb, 3, 2);
+    size_t header = sb->count;
+    Append(sb, 0, 4);
+    Append(sb, 1, 1);                                   // minimum_instruction_length
+    Append(sb, 1, 1);                                   // default_is_stmt
+    Append(sb, (uint8_t)-5, 1);                         // line_base
+    Append(sb, 14, 1);                                  // line_range
+    Append(sb, sizeof(opcode_lengths) + 1, 1);          // opcode_base
+    nob_da_append_many(sb, opcode_lengths, sizeof(opcode_lengths));
+    Append(sb, 0, 1);                                   // no include_directories
+    nob_da_append_many(sb, file, strlen(file) + 1);
+    Append(sb, 0, 3);                                   // directory, mtime, length
+    Append(sb, 0, 1);
+    Patch32(sb, header, sb->count - header - 4);
+
+    Append(sb, 0, 1);
+    Uleb(sb, 1 + sizeof(uint64_t));
+    Append(sb, DW_LNE_set_address, 1);
+    Append(sb, address, sizeof(uint64_t));
+    size_t offset = 0;
+    uint32_t line = 1;
+    for (size_t i = 0; i < code->lines.count && code->lines.items[i].offset < end; i++)
+	{
+        X86_Line *row = &code->lines.items[i];
+        if (row->offset > offset)
+		{
+            Append(sb, DW_LNS_advance_pc, 1);
+            Uleb(sb, row->offset - offset);
+        }
+        if (row->line != line)
+		{
+            Append(sb, DW_LNS_advance_line, 1);
+            Sleb(sb, (int64_t)row->line - line);
+        }
+        Append(sb, DW_LNS_copy, 1);
+        offset = row->offset;
+        line = row->line;
+    }
+    Append(sb, DW_LNS_advance_pc, 1);
+    Uleb(sb, end - offset);
+    Append(sb, 0, 1);
+    Uleb(sb, 1);
+    Append(sb, DW_LNE_end_sequence, 1);
+    Patch32(sb, unit, sb->count - unit - 4);
+}
+
+// Debuggers find line tables through a compile unit, a single one without
+// children covers all procedures
+static void DebugInfo(Nob_String_Builder *info, Nob_String_Builder *abbrev, const char *file, uint64_t low_pc, uint64_t high_pc)
+{
+    static const uint8_t attributes[] = {
+        DW_AT_name, DW_FORM_string,
+        DW_AT_producer, DW_FORM_string,
+        DW_AT_stmt_list, DW_FORM_data4,
+        DW_AT_low_pc, DW_FORM_addr,
+        DW_AT_high_pc, DW_FORM_addr,
+        0, 0,
+    };
+    Uleb(abbrev, 1);
+    Uleb(abbrev, DW_TAG_compile_unit);
+    Append(abbrev, 0, 1);
+    nob_da_append_many(abbrev, attributes, sizeof(attributes));
+    Append(abbrev, 0, 1);
+
+    size_t unit = info->count;
+    Append(info, 0, 4);
+    Append(info, 3, 2);
+    Append(info, 0, 4);
+    Append(info, sizeof(uint64_t), 1);
+    Uleb(info, 1);
+    nob_da_append_many(info, file, strlen(file) + 1);
+    nob_da_append_many(info, "cmpl", sizeof("cmpl"));
+    Append(info, 0, 4);
+    Append(info, low_pc, sizeof(uint64_t));
+    Append(info, high_pc, sizeof(uint64_t));
+    Patch32(info, unit, info->count - unit - 4);
+}
+
+// Appends the contents of a section to the file at its alignment, NOBITS
+// sections take no room
+static size_t AddSection(Elf_Sections *sections, Nob_String_Builder *file, const char *name, Elf64_Shdr header, const void *data)
+{
+    while (header.sh_addralign > 1 && file->count % header.sh_addralign != 0)
+        nob_da_append(file, 0);
+    header.sh_offset = file->count;
+    if (header.sh_type != SHT_NOBITS)
+        nob_da_append_many(file, data, header.sh_size);
+    Elf_Section section = { .name = name, .header = header };
+    nob_da_append(sections, section);
+    return sections->count - 1;
+}
+
+// .shstrtab goes last, the section headers after it
+static void FinishSections(Elf_Sections *sections, Nob_String_Builder *file, Elf64_Ehdr *ehdr)
+{
+    Nob_String_Builder names = {0};
+    nob_da_append(&names, 0);
+    for (size_t i = 1; i < sections->count; i++)
+	{
+        sections->items[i].header.sh_name = (uint32_t)names.count;
+        nob_da_append_many(&names, sections->items[i].name, strlen(sections->items[i].name) + 1);
+    }
+    Elf64_Shdr header = { .sh_name = (uint32_t)names.count, .sh_type = SHT_STRTAB, .sh_addralign = 1 };
+    nob_da_append_many(&names, ".shstrtab", sizeof(".shstrtab"));
+    header.sh_size = names.count;
+    ehdr->e_shstrndx = (uint16_t)AddSection(sections, file, ".shstrtab", header, names.items);
+    nob_sb_free(names);
+
+    while (file->count % 8 != 0)
+        nob_da_append(file, 0);
+    ehdr->e_shoff = file->count;
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = (uint16_t)sections->count;
+    for (size_t i = 0; i < sections->count; i++)
+        nob_da_append_many(file, &sections->items[i].header, sizeof(Elf64_Shdr));
+}
+
+static Elf64_Ehdr ElfHeader(uint16_t type)
+{
+    Elf64_Ehdr ehdr = {
+        .e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV },
+        .e_type = type,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+    };
+    return ehdr;
+}
+
+// Procedures and stubs are functions, the strings and profile data objects.
+// Procedures are global, the file symbol and the runtime local, and what
+// the code calls without defining it undefined. Locals have to come first,
+// the index of the first global is returned. fixup_symbols gets the symbol
+// of every remaining fixup
+static uint32_t SymbolTable(X86_Code *code, const char *file, uint64_t text_addr, size_t data_start, size_t sections[3],
+                            Nob_String_Builder *symtab, Nob_String_Builder *strtab, uint32_t *fixup_symbols)
+{
+    Elf64_Sym null_symbol = {0};
+    nob_da_append_many(symtab, &null_symbol, sizeof(null_symbol));
+    nob_da_append(strtab, 0);
+
+    Elf64_Sym file_symbol = { .st_name = (uint32_t)strtab->count, .st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE), .st_shndx = SHN_ABS };
+    nob_da_append_many(strtab, file, strlen(file) + 1);
+    nob_da_append_many(symtab, &file_symbol, sizeof(file_symbol));
+
+    uint32_t first_global = 0;
+    for (int bind = STB_LOCAL; bind <= STB_GLOBAL; bind++)
+	{
+        if (bind == STB_GLOBAL)
+            first_global = (uint32_t)(symtab->count / sizeof(Elf64_Sym));
+        for (size_t i = 0; i < code->symbols.count; i++)
+		{
+            X86_Symbol *symbol = &code->symbols.items[i];
+            if ((strncmp(symbol->name, "func_", 5) == 0) != (bind == STB_GLOBAL))
+                continue;
+            Elf64_Sym sym = {
+                .st_name = (uint32_t)strtab->count,
+                .st_info = ELF64_ST_INFO(bind, symbol->offset < data_start ? STT_FUNC : STT_OBJECT),
+                .st_shndx = (uint16_t)sections[0],
+                .st_value = text_addr + symbol->offset,
+                .st_size = X86SymbolSize(code, i),
+            };
+            if (symbol->offset >= code->bytes.count)
+			{
+                bool header = strcmp(symbol->name, "_profile_header") == 0;
+                sym.st_shndx = (uint16_t)sections[header ? 1 : 2];
+                sym.st_size = header ? PROFILE_HEADER_SIZE : code->counters * sizeof(uint64_t);
+            }
+            nob_da_append_many(strtab, symbol->name, strlen(symbol->name) + 1);
+            nob_da_append_many(symtab, &sym, sizeof(sym));
+        }
+    }
+
+    for (size_t i = 0; i < code->fixups.count; i++)
+	{
+        size_t seen = 0;
+        while (seen < i && strcmp(code->fixups.items[seen].name, code->fixups.items[i].name) != 0)
+            seen++;
+        if (seen < i)
+		{
+            fixup_symbols[i] = fixup_symbols[seen];
+            continue;
+        }
+        fixup_symbols[i] = (uint32_t)(symtab->count / sizeof(Elf64_Sym));
+        Elf64_Sym sym = { .st_name = (uint32_t)strtab->count, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), .st_shndx = SHN_UNDEF };
+        nob_da_append_many(strtab, code->fixups.items[i].name, strlen(code->fixups.items[i].name) + 1);
+        nob_da_append_many(symtab, &sym, sizeof(sym));
+    }
+    return first_global;
+}
+
+// .strtab goes right after .symtab
+static void AddSymbolTable(Elf_Sections *sections, Nob_String_Builder *file, Nob_String_Builder *symtab, Nob_String_Builder *strtab, uint32_t first_global)
+{
+    Elf64_Shdr symtab_header = { .sh_type = SHT_SYMTAB, .sh_link = (uint32_t)sections->count + 1, .sh_info = first_global,
+                                 .sh_size = symtab->count, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym) };
+    AddSection(sections, file, ".symtab", symtab_header, symtab->items);
+    Elf64_Shdr strtab_header = { .sh_type = SHT_STRTAB, .sh_size = strtab->count, .sh_addralign = 1 };
+    AddSection(sections, file, ".strtab", strtab_header, strtab->items);
+}
+
+static bool WriteExecutable(X86_Code *code, const char *source_path, const char *output_path, size_t program_end, size_t data_start)
+{
+    Elf_Layout layout = Layout(code);
+    Nob_String_Builder file = {0};
+    Elf_Sections sections = {0};
+    nob_da_append(&sections, (Elf_Section){0});
+    while (file.count < layout.text_offset)
+        nob_da_append(&file, 0);
+
+    size_t section_of[3] = {0};
+    Elf64_Shdr text = { .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_addr = layout.text_addr, .sh_size = code->bytes.count, .sh_addralign = 16 };
+    section_of[0] = AddSection(&sections, &file, ".text", text, code->bytes.items);
+    if (code->counters > 0)
+	{
+        uint64_t profile_header[3] = { PROFILE_MAGIC, code->profile_hash, code->counters };
+        Elf64_Shdr data = { .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_addr = layout.data_addr, .sh_size = PROFILE_HEADER_SIZE, .sh_addralign = 8 };
+        section_of[1] = AddSection(&sections, &file, ".data", data, profile_header);
+        Elf64_Shdr bss = { .sh_type = SHT_NOBITS, .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_addr = layout.data_addr + PROFILE_HEADER_SIZE,
+                           .sh_size = layout.data_size - PROFILE_HEADER_SIZE, .sh_addralign = 8 };
+        section_of[2] = AddSection(&sections, &file, ".bss", bss, NULL);
+    }
+
+    char *full_path = realpath(source_path, NULL);
+    const char *source = full_path ? full_path : source_path;
+    Nob_String_Builder debug_info = {0}, debug_abbrev = {0}, debug_line = {0}, symtab = {0}, strtab = {0};
+    DebugInfo(&debug_info, &debug_abbrev, source, layout.text_addr, layout.text_addr + program_end);
+    DebugLine(&debug_line, code, source, layout.text_addr, program_end);
+    uint32_t first_global = SymbolTable(code, source, layout.text_addr, data_start, section_of, &symtab, &strtab, NULL);
+    free(full_path);
+
+    Elf64_Shdr info_header = { .sh_type = SHT_PROGBITS, .sh_size = debug_info.count, .sh_addralign = 1 };
+    AddSection(&sections, &file, ".debug_info", info_header, debug_info.items);
+    Elf64_Shdr abbrev_header = { .sh_type = SHT_PROGBITS, .sh_size = debug_abbrev.count, .sh_addralign = 1 };
+    AddSection(&sections, &file, ".debug_abbrev", abbrev_header, debug_abbrev.items);
+    Elf64_Shdr line_header = { .sh_type = SHT_PROGBITS, .sh_size = debug_line.count, .sh_addralign = 1 };
+    AddSection(&sections, &file, ".debug_line", line_header, debug_line.items);
+    AddSymbolTable(&sections, &file, &symtab, &strtab, first_global);
+    nob_sb_free(debug_info);
+    nob_sb_free(debug_abbrev);
+    nob_sb_free(debug_line);
+    nob_sb_free(symtab);
+    nob_sb_free(strtab);
+
+    Elf64_Ehdr ehdr = ElfHeader(ET_EXEC);
+    X86_Symbol *start = X86FindSymbol(code, "_start");
+    ehdr.e_entry = layout.text_addr + start->offset;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = (uint16_t)layout.phnum;
+    FinishSections(&sections, &file, &ehdr);
+
+    Elf64_Phdr phdrs[2] = {
+        { .p_type = PT_LOAD, .p_flags = PF_R | PF_X, .p_offset = 0, .p_vaddr = ELF_BASE, .p_paddr = ELF_BASE,
+          .p_filesz = layout.text_offset + code->bytes.count, .p_memsz = layout.text_offset + code->bytes.count, .p_align = ELF_PAGE },
+        { .p_type = PT_LOAD, .p_flags = PF_R | PF_W, .p_offset = layout.data_offset, .p_vaddr = layout.data_addr, .p_paddr = layout.data_addr,
+          .p_filesz = PROFILE_HEADER_SIZE, .p_memsz = layout.data_size, .p_align = ELF_PAGE },
+    };
+    memcpy(file.items, &ehdr, sizeof(ehdr));
+    memcpy(file.items + sizeof(ehdr), phdrs, layout.phnum * sizeof(Elf64_Phdr));
+
+    bool ok = nob_write_entire_file(output_path, file.items, file.count);
+    if (ok && chmod(output_path, 0755) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not make %s executable", output_path);
+        ok = false;
+    }
+    nob_sb_free(file);
+    nob_da_free(sections);
+    return ok;
+}
+
+// The profile data sits on its own writable page past the code, its
+// symbols are offsets from the start of the code like all others
+bool GenerateElf(AST_Node *ast, const char *source_path, const char *output_path, const Compile_Options *opts, Arena *arena)
+{
+    X86_Code code = {0};
+    size_t program_end = 0, data_start = 0;
+    bool ok = GenerateCode(ast, opts, arena, &code, NULL);
+    if (ok)
+	{
+        program_end = code.bytes.count;
+        ok = AddRuntime(&code, opts, true, arena, &data_start);
+    }
+
+    if (ok && code.counters > 0)
+	{
+        Elf_Layout layout = Layout(&code);
+        X86_Symbol header = { .name = "_profile_header", .offset = layout.data_addr - layout.text_addr };
+        X86_Symbol counters = { .name = "_profile_counters", .offset = header.offset + PROFILE_HEADER_SIZE };
+        nob_da_append(&code.symbols, header);
+        nob_da_append(&code.symbols, counters);
+    }
+    ok = ok && X86Link(&code);
+    if (ok && !X86FindSymbol(&code, "func_main"))
+	{
+        nob_log(NOB_ERROR, "There is no procedure 'main' to run");
+        ok = false;
+    }
+
+    if (ok)
+	{
+        nob_log(NOB_INFO, "Writing %zu bytes of machine code to %s", code.bytes.count, output_path);
+        ok = WriteExecutable(&code, source_path, output_path, program_end, data_start);
+    }
+    X86CodeFree(&code);
+    return ok;
+}
+
+// Relocatable objects keep calls to procedures other modules define as
+// relocations against undefined symbols. The addend goes into the entry,
+// the field in the code is left zero
+static bool WriteObject(X86_Code *code, const char *source_path, const char *output_path, size_t data_start)
+{
+    Nob_String_Builder file = {0};
+    Elf_Sections sections = {0};
+    nob_da_append(&sections, (Elf_Section){0});
+    while (file.count < sizeof(Elf64_Ehdr))
+        nob_da_append(&file, 0);
+
+    // .text comes first
+    size_t section_of[3] = { 1 };
+    char *full_path = realpath(source_path, NULL);
+    Nob_String_Builder symtab = {0}, strtab = {0}, rela = {0};
+    uint32_t *fixup_symbols = malloc((code->fixups.count + 1) * sizeof(uint32_t));
+    uint32_t first_global = SymbolTable(code, full_path ? full_path : source_path, 0, data_start, section_of, &symtab, &strtab, fixup_symbols);
+    free(full_path);
+
+    for (size_t i = 0; i < code->fixups.count; i++)
+	{
+        X86_Symbol *fixup = &code->fixups.items[i];
+        int32_t addend;
+        memcpy(&addend, &code->bytes.items[fixup->offset], sizeof(addend));
+        memset(&code->bytes.items[fixup->offset], 0, sizeof(addend));
+        Elf64_Rela entry = {
+            .r_offset = fixup->offset,
+            .r_info = ELF64_R_INFO(fixup_symbols[i], R_X86_64_PLT32),
+            .r_addend = (int64_t)addend - 4,
+        };
+        nob_da_append_many(&rela, &entry, sizeof(entry));
+    }
+    free(fixup_symbols);
+
+    Elf64_Shdr text = { .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_size = code->bytes.count, .sh_addralign = 16 };
+    AddSection(&sections, &file, ".text", text, code->bytes.items);
+    Elf64_Shdr rela_header = { .sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK, .sh_link = (uint32_t)sections.count + 1, .sh_info = (uint32_t)section_of[0],
+                               .sh_size = rela.count, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Rela) };
+    AddSection(&sections, &file, ".rela.text", rela_header, rela.items);
+    AddSymbolTable(&sections, &file, &symtab, &strtab, first_global);
+    // An empty .note.GNU-stack keeps the linker from making the stack executable
+    Elf64_Shdr note = { .sh_type = SHT_PROGBITS, .sh_addralign = 1 };
+    AddSection(&sections, &file, ".note.GNU-stack", note, NULL);
+    nob_sb_free(rela);
+    nob_sb_free(symtab);
+    nob_sb_free(strtab);
+
+    Elf64_Ehdr ehdr = ElfHeader(ET_REL);
+    FinishSections(&sections, &file, &ehdr);
+    memcpy(file.items, &ehdr, sizeof(ehdr));
+
+    bool ok = nob_write_entire_file(output_path, file.items, file.count);
+    nob_sb_free(file);
+    nob_da_free(sections);
+    return ok;
+}
+
+// -c compiles one module. Calls between its own procedures are resolved,
+// the rest are left for the linker
+bool GenerateObject(AST_Node *ast, const char *source_path, const char *output_path, const Compile_Options *opts, Arena *arena)
+{
+    X86_Code code = {0};
+    size_t data_start = 0;
+    bool ok = GenerateCode(ast, opts, arena, &code, NULL) && AddRuntime(&code, opts, false, arena, &data_start);
+    if (ok)
+	{
+        X86Resolve(&code);
+        nob_log(NOB_INFO, "Writing %zu bytes of machine code to %s", code.bytes.count, output_path);
+        ok = WriteObject(&code, source_path, output_path, data_start);
+    }
+    X86CodeFree(&code);
+    return ok;
+}
@@ -0,0 +1,182 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Assembly text is appended a fragment at a time: literals with their
+// length known at compile time, names, and integers formatted by hand. The
+// buffer grows by doubling, so nothing goes through printf on the hot path
+// and nothing is truncated
+
+void EmitBuf(Nob_String_Builder *sb, const char *buf, size_t count)
+{
+    nob_da_reserve(sb, sb->count + count);
+    memcpy(sb->items + sb->count, buf, count);
+    sb->count += count;
+}
+
+void EmitStr(Nob_String_Builder *sb, const char *str)
+	{ EmitBuf(sb, str, strlen(str)); }
+
+void EmitChar(Nob_String_Builder *sb, char c)
+	{ nob_da_append(sb, c); }
+
+void EmitInt(Nob_String_Builder *sb, int64_t value)
+{
+    // Digits are written backwards from the end, the magnitude is unsigned
+    // so INT64_MIN doesn't overflow
+    char digits[24];
+    char *at = digits + sizeof(digits);
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do
+	{
+        *--at = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+        *--at = '-';
+    EmitBuf(sb, at, digits + sizeof(digits) - at);
+}
+
+// For the cold paths that want a format string. It prints straight into the
+// spare capacity and only formats twice when that is too small
+void EmitFmt(Nob_String_Builder *sb, const char *fmt, ...)
+{
+	va_list args, retry;
+	va_start(args, fmt);
+	va_copy(retry, args);
+
+    nob_da_reserve(sb, sb->count + 64);
+    size_t space = sb->capacity - sb->count;
+    int n = vsnprintf(sb->items + sb->count, space, fmt, args);
+    if (n >= 0 && (size_t)n >= space)
+	{
+        nob_da_reserve(sb, sb->count + n + 1);
+        vsnprintf(sb->items + sb->count, n + 1, fmt, retry);
+    }
+    if (n > 0)
+        sb->count += n;
+
+	va_end(retry);
+	va_end(args);
+}
+
+// The whole chunk or nothing, after the first failure the rest is dropped
+// and WriterClose reports it
+static void WriteChunk(Asm_Writer *w, Nob_String_Builder *chunk)
+{
+    const char *at = chunk->items;
+    size_t left = chunk->count;
+    while (left > 0 && !w->failed)
+	{
+        ssize_t n = write(w->fd, at, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            w->failed = true;
+        else
+		{
+            at += n;
+            left -= n;
+        }
+    }
+    chunk->count = 0;
+}
+
+static void* WriterThread(void *arg)
+{
+    Asm_Writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+	{
+        while (w->pending == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->pending == 0)
+            break;
+
+        // The producer never touches a pending slot
+        Nob_String_Builder *chunk = &w->slots[w->take];
+        pthread_mutex_unlock(&w->lock);
+        WriteChunk(w, chunk);
+        pthread_mutex_lock(&w->lock);
+        w->take = (w->take + 1) % WRITER_DEPTH;
+        w->pending--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+bool WriterOpen(Asm_Writer *w, const char *path, bool threaded)
+{
+    *w = (Asm_Writer){ .path = path, .threaded = threaded };
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+	{
+        nob_log(NOB_ERROR, "Could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (w->threaded && pthread_create(&w->thread, NULL, WriterThread, w) != 0)
+        w->threaded = false;
+    return true;
+}
+
+// sb goes to the queue and an empty slot, which keeps its capacity, comes
+// back in its place. Waits while the queue is full
+static void WriterHand(Asm_Writer *w, Nob_String_Builder *sb)
+{
+    if (!w->threaded)
+	{
+        WriteChunk(w, sb);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (w->pending == WRITER_DEPTH)
+        pthread_cond_wait(&w->cond, &w->lock);
+    Nob_String_Builder full = *sb;
+    *sb = w->slots[w->put];
+    w->slots[w->put] = full;
+    w->put = (w->put + 1) % WRITER_DEPTH;
+    w->pending++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Called between procedures, sb only goes out once it holds a full chunk
+void WriterPut(Asm_Writer *w, Nob_String_Builder *sb)
+{
+    if (sb->count >= WRITER_CHUNK)
+        WriterHand(w, sb);
+}
+
+// Writes what's left in sb and waits for the queue to drain
+bool WriterClose(Asm_Writer *w, Nob_String_Builder *sb)
+{
+    if (sb->count > 0)
+        WriterHand(w, sb);
+    if (w->threaded)
+	{
+        pthread_mutex_lock(&w->lock);
+        w->closing = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    }
+    for (size_t i = 0; i < WRITER_DEPTH; i++)
+        nob_sb_free(w->slots[i]);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+
+    if (close(w->fd) < 0)
+        w->failed = true;
+    if (w->failed)
+        nob_log(NOB_ERROR, "Could not write %s", w->path);
+    return !w->failed;
+}
@@ -0,0 +1,494 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <string.h>
+
+// x86-64 machine code for the instruction list, the same shapes X86Print
+// writes for fasm. Jumps and calls always take a rel32, local labels are
+// scoped to the global label before them the way fasm scopes them
+
+typedef struct {
+    X86_Code *code;
+    Arena *arena;
+    const char *scope;
+    struct {
+        X86_Symbol *items;
+        size_t count, capacity;
+    } labels, refs;
+    bool had_err;
+} Encoder;
+
+static void Byte(Encoder *e, uint8_t byte)
+	{ nob_da_append(&e->code->bytes, byte); }
+
+static void Bytes(Encoder *e, int64_t value, int count)
+{
+    for (int i = 0; i < count; i++)
+        Byte(e, (uint8_t)(value >> (i * 8)));
+}
+
+static bool FitsInt8(int64_t value)
+	{ return value >= INT8_MIN && value <= INT8_MAX; }
+
+static bool FitsInt32(int64_t value)
+	{ return value >= INT32_MIN && value <= INT32_MAX; }
+
+static bool IsMem(X86_Operand *opnd)
+	{ return opnd->kind == X86_OPND_MEM; }
+
+static bool IsGpr(X86_Operand *opnd)
+	{ return opnd->kind >= X86_OPND_REG && opnd->kind <= X86_OPND_REG8; }
+
+static bool IsRM(X86_Operand *opnd)
+	{ return IsGpr(opnd) || IsMem(opnd); }
+
+// Access width in bytes of a register or memory operand
+static int OperandSize(X86_Operand *opnd)
+{
+    switch (opnd->kind)
+	{
+        case X86_OPND_REG32: return 4;
+        case X86_OPND_REG16: return 2;
+        case X86_OPND_REG8:  return 1;
+        case X86_OPND_MEM:   return opnd->size ? opnd->size : 8;
+        default:             return 8;
+    }
+}
+
+static const char* Qualify(Encoder *e, const char *label)
+	{ return label[0] == '.' && e->scope ? arena_sprintf(e->arena, "%s%s", e->scope, label) : label; }
+
+// spl, bpl, sil and dil only exist with a REX prefix
+static bool NeedsRex(X86_Operand *opnd)
+	{ return opnd->kind == X86_OPND_REG8 && opnd->reg >= X86_RSP && opnd->reg <= X86_RDI; }
+
+// The addend waits in the field until the reference is patched
+static void Rel32(Encoder *e, const char *label, int32_t addend)
+{
+    X86_Symbol ref = { .name = Qualify(e, label), .offset = e->code->bytes.count };
+    nob_da_append(&e->refs, ref);
+    Bytes(e, addend, 4);
+}
+
+// ModRM, SIB and displacement for reg and a register or memory operand.
+// Labels are addressed rip relative, the displacement comes last in every
+// instruction that takes one
+static void ModRM(Encoder *e, int reg, X86_Operand *rm)
+{
+    if (!IsMem(rm))
+	{
+        Byte(e, 0xC0 | (reg & 7) << 3 | (rm->reg & 7));
+        return;
+    }
+    if (rm->label)
+	{
+        Byte(e, (reg & 7) << 3 | 5);
+        Rel32(e, rm->label, rm->disp);
+        return;
+    }
+
+    // rsp and r12 as base need a SIB, rbp and r13 can't go without a displacement
+    bool sib = rm->scale || (rm->reg & 7) == X86_RSP;
+    int mod = rm->disp == 0 && (rm->reg & 7) != X86_RBP ? 0 : FitsInt8(rm->disp) ? 1 : 2;
+    Byte(e, mod << 6 | (reg & 7) << 3 | (sib ? 4 : rm->reg & 7));
+    if (sib)
+	{
+        int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        int index = rm->scale ? rm->index : X86_RSP;
+        Byte(e, scale << 6 | (index & 7) << 3 | (rm->reg & 7));
+    }
+    if (mod == 1)
+        Bytes(e, rm->disp, 1);
+    else if (mod == 2)
+        Bytes(e, rm->disp, 4);
+}
+
+// [66] [REX] opcode ModRM for a legacy encoded instruction, size picks the
+// operand size prefix and REX.W. reg is a register number or /digit
+static void Legacy(Encoder *e, uint8_t prefix, int size, const uint8_t *opcode, int length, int reg, X86_Operand *rm, bool force_rex)
+{
+    if (size == 2)
+        Byte(e, 0x66);
+    if (prefix)
+        Byte(e, prefix);
+    int index = IsMem(rm) && rm->scale ? rm->index : 0;
+    uint8_t rex = 0x40 | (size == 8) << 3 | (reg >> 3 & 1) << 2 | (index >> 3 & 1) << 1 | (rm->reg >> 3 & 1);
+    if (rex != 0x40 || force_rex || NeedsRex(rm))
+        Byte(e, rex);
+    for (int i = 0; i < length; i++)
+        Byte(e, opcode[i]);
+    ModRM(e, reg, rm);
+}
+
+// Three byte VEX prefix, map 1 is 0F and map 2 is 0F38. pp selects the
+// implied 66/F3 prefix, vvvv the extra source register
+static void Vex(Encoder *e, int pp, int map, bool w, bool l, int vvvv, uint8_t opcode, int reg, X86_Operand *rm)
+{
+    int index = IsMem(rm) && rm->scale ? rm->index : 0;
+    Byte(e, 0xC4);
+    Byte(e, (~reg >> 3 & 1) << 7 | (~index >> 3 & 1) << 6 | (~rm->reg >> 3 & 1) << 5 | map);
+    Byte(e, w << 7 | (~vvvv & 15) << 3 | l << 2 | pp);
+    Byte(e, opcode);
+    ModRM(e, reg, rm);
+}
+
+static void Op1(Encoder *e, int size, uint8_t opcode, int reg, X86_Operand *rm)
+	{ Legacy(e, 0, size, &opcode, 1, reg, rm, false); }
+
+static void Op2(Encoder *e, uint8_t prefix, int size, uint8_t opcode, int reg, X86_Operand *rm)
+{
+    uint8_t bytes[] = { 0x0F, opcode };
+    Legacy(e, prefix, size, bytes, 2, reg, rm, false);
+}
+
+static bool Unsupported(Encoder *e, X86_Inst *inst)
+{
+    Nob_String_Builder sb = {0};
+    X86_List single = { .items = inst, .count = 1 };
+    X86Print(&sb, &single);
+    nob_log(NOB_ERROR, "Can't encode instruction: %.*s", (int)sb.count - 1, sb.items);
+    nob_sb_free(sb);
+    e->had_err = true;
+    return false;
+}
+
+static bool EncodeMov(Encoder *e, X86_Inst *inst)
+{
+    X86_Operand *dst = &inst->dst, *src = &inst->src;
+    int size = OperandSize(IsGpr(src) ? src : dst);
+    uint8_t byte_form = size == 1 ? 1 : 0;
+    if (IsGpr(src) && IsRM(dst))
+	{
+        Legacy(e, 0, size, (uint8_t[]){ 0x89 - byte_form }, 1, src->reg, dst, NeedsRex(src));
+        return true;
+    }
+    if (IsGpr(dst) && IsMem(src))
+	{
+        Legacy(e, 0, size, (uint8_t[]){ 0x8B - byte_form }, 1, dst->reg, src, NeedsRex(dst));
+        return true;
+    }
+    if (src->kind != X86_OPND_IMM)
+        return Unsupported(e, inst);
+
+    // A 32-bit mov zero extends, wider values need the full imm64 form
+    if (IsGpr(dst) && size >= 4 && (uint64_t)src->imm <= UINT32_MAX)
+	{
+        if (dst->reg >= X86_R8)
+            Byte(e, 0x41);
+        Byte(e, 0xB8 + (dst->reg & 7));
+        Bytes(e, src->imm, 4);
+    }
+    else if (IsGpr(dst) && size == 8 && !FitsInt32(src->imm))
+	{
+        Byte(e, 0x48 | (dst->reg >> 3 & 1));
+        Byte(e, 0xB8 + (dst->reg & 7));
+        Bytes(e, src->imm, 8);
+    }
+    else if (FitsInt32(src->imm))
+	{
+        Legacy(e, 0, size, (uint8_t[]){ 0xC7 - byte_form }, 1, 0, dst, NeedsRex(dst));
+        Bytes(e, src->imm, size < 4 ? size : 4);
+    }
+    else
+        return Unsupported(e, inst);
+    return true;
+}
+
+// add, sub, and, xor and cmp share one layout, /digit selects the operation
+static bool EncodeAlu(Encoder *e, X86_Inst *inst, uint8_t base, int digit)
+{
+    X86_Operand *dst = &inst->dst, *src = &inst->src;
+    int size = OperandSize(IsGpr(src) ? src : dst);
+    uint8_t wide = size == 1 ? 0 : 1;
+    if (IsGpr(src) && IsRM(dst))
+        Op1(e, size, base + wide, src->reg, dst);
+    else if (IsGpr(dst) && IsMem(src))
+        Op1(e, size, base + 2 + wide, dst->reg, src);
+    else if (src->kind == X86_OPND_IMM && IsRM(dst) && (size == 1 || FitsInt8(src->imm)))
+	{
+        Op1(e, size, size == 1 ? 0x80 : 0x83, digit, dst);
+        Bytes(e, src->imm, 1);
+    }
+    else if (src->kind == X86_OPND_IMM && IsRM(dst) && FitsInt32(src->imm))
+	{
+        Op1(e, size, 0x81, digit, dst);
+        Bytes(e, src->imm, 4);
+    }
+    else
+        return Unsupported(e, inst);
+    return true;
+}
+
+static bool EncodeInst(Encoder *e, X86_Inst *inst)
+{
+    X86_Operand *dst = &inst->dst, *src = &inst->src;
+    switch (inst->op)
+	{
+        case X86_LABEL:
+		{
+            const char *name = Qualify(e, dst->label);
+            X86_Symbol label = { .name = name, .offset = e->code->bytes.count };
+            nob_da_append(&e->labels, label);
+            if (dst->label[0] != '.')
+			{
+                e->scope = name;
+                nob_da_append(&e->code->symbols, label);
+            }
+            return true;
+        }
+
+        case X86_MOV: return EncodeMov(e, inst);
+        case X86_ADD: return EncodeAlu(e, inst, 0x00, 0);
+        case X86_AND: return EncodeAlu(e, inst, 0x20, 4);
+        case X86_SUB: return EncodeAlu(e, inst, 0x28, 5);
+        case X86_XOR: return EncodeAlu(e, inst, 0x30, 6);
+        case X86_CMP: return EncodeAlu(e, inst, 0x38, 7);
+
+        case X86_MOVZX:
+            if (!IsGpr(dst) || !IsRM(src) || OperandSize(src) > 2)
+                return Unsupported(e, inst);
+            Legacy(e, 0, OperandSize(dst), (uint8_t[]){ 0x0F, OperandSize(src) == 1 ? 0xB6 : 0xB7 }, 2, dst->reg, src, NeedsRex(src));
+            return true;
+
+        case X86_LEA:
+            if (!IsGpr(dst) || !IsMem(src))
+                return Unsupported(e, inst);
+            Op1(e, OperandSize(dst), 0x8D, dst->reg, src);
+            return true;
+
+        case X86_TEST:
+            if (!IsGpr(src) || !IsRM(dst))
+                return Unsupported(e, inst);
+            Op1(e, OperandSize(src), 0x85, src->reg, dst);
+            return true;
+
+        // The immediate form multiplies dst by itself, the way X86Print spells it
+        case X86_IMUL:
+            if (!IsGpr(dst))
+                return Unsupported(e, inst);
+            if (IsRM(src))
+                Op2(e, 0, OperandSize(dst), 0xAF, dst->reg, src);
+            else if (src->kind == X86_OPND_IMM && FitsInt8(src->imm))
+			{
+                Op1(e, OperandSize(dst), 0x6B, dst->reg, dst);
+                Bytes(e, src->imm, 1);
+            }
+            else if (src->kind == X86_OPND_IMM && FitsInt32(src->imm))
+			{
+                Op1(e, OperandSize(dst), 0x69, dst->reg, dst);
+                Bytes(e, src->imm, 4);
+            }
+            else
+                return Unsupported(e, inst);
+            return true;
+
+        case X86_SHL:
+            if (!IsRM(dst) || src->kind != X86_OPND_IMM)
+                return Unsupported(e, inst);
+            Op1(e, OperandSize(dst), 0xC1, 4, dst);
+            Bytes(e, src->imm, 1);
+            return true;
+
+        case X86_INC:
+        case X86_DEC:
+            if (!IsRM(dst))
+                return Unsupported(e, inst);
+            Legacy(e, 0, OperandSize(dst), (uint8_t[]){ OperandSize(dst) == 1 ? 0xFE : 0xFF }, 1, inst->op == X86_DEC, dst, NeedsRex(dst));
+            return true;
+
+        case X86_NEG:
+        case X86_IDIV:
+            if (!IsRM(dst))
+                return Unsupported(e, inst);
+            Op1(e, OperandSize(dst), 0xF7, inst->op == X86_NEG ? 3 : 7, dst);
+            return true;
+
+        case X86_CQO:
+            Bytes(e, 0x9948, 2);
+            return true;
+
+        case X86_SETCC:
+            Legacy(e, 0, 1, (uint8_t[]){ 0x0F, 0x90 | inst->cc }, 2, 0, dst, false);
+            return true;
+
+        case X86_JCC:
+            Byte(e, 0x0F);
+            Byte(e, 0x80 | inst->cc);
+            Rel32(e, dst->label, 0);
+            return true;
+
+        // Indirect forms are FF /4 and FF /2
+        case X86_JMP:
+        case X86_CALL:
+            if (dst->kind == X86_OPND_LABEL)
+			{
+                Byte(e, inst->op == X86_JMP ? 0xE9 : 0xE8);
+                Rel32(e, dst->label, 0);
+            }
+            else if (IsRM(dst))
+                Op1(e, 4, 0xFF, inst->op == X86_JMP ? 4 : 2, dst);
+            else
+                return Unsupported(e, inst);
+            return true;
+
+        case X86_RET:
+            Byte(e, 0xC3);
+            return true;
+
+        case X86_SYSCALL:
+            Bytes(e, 0x050F, 2);
+            return true;
+
+        case X86_PUSH:
+        case X86_POP:
+            if (dst->kind != X86_OPND_REG)
+                return Unsupported(e, inst);
+            if (dst->reg >= X86_R8)
+                Byte(e, 0x41);
+            Byte(e, (inst->op == X86_PUSH ? 0x50 : 0x58) + (dst->reg & 7));
+            return true;
+
+        case X86_MOVQ:
+            Op2(e, 0x66, 8, 0x6E, dst->reg, src);
+            return true;
+        case X86_PUNPCKLQDQ:
+            Op2(e, 0x66, 4, 0x6C, dst->reg, src);
+            return true;
+        case X86_PADDQ:
+            Op2(e, 0x66, 4, 0xD4, dst->reg, src);
+            return true;
+        case X86_PSUBQ:
+            Op2(e, 0x66, 4, 0xFB, dst->reg, src);
+            return true;
+        case X86_MOVDQA:
+            if (IsMem(dst))
+                Op2(e, 0x66, 4, 0x7F, src->reg, dst);
+            else
+                Op2(e, 0x66, 4, 0x6F, dst->reg, src);
+            return true;
+
+        case X86_VMOVQ:
+            Vex(e, 1, 1, true, false, 0, 0x6E, dst->reg, src);
+            return true;
+        case X86_VPBROADCASTQ:
+            Vex(e, 1, 2, false, true, 0, 0x59, dst->reg, src);
+            return true;
+        case X86_VMOVDQU:
+            if (IsMem(dst))
+                Vex(e, 2, 1, false, true, 0, 0x7F, src->reg, dst);
+            else
+                Vex(e, 2, 1, false, true, 0, 0x6F, dst->reg, src);
+            return true;
+        case X86_VPADDQ:
+        case X86_VPSUBQ:
+            Vex(e, 1, 1, false, true, src->reg, inst->op == X86_VPADDQ ? 0xD4 : 0xFB, dst->reg, &inst->src2);
+            return true;
+        case X86_VZEROUPPER:
+            Bytes(e, 0x77F8C5, 3);
+            return true;
+
+        default:
+            return Unsupported(e, inst);
+    }
+}
+
+static X86_Symbol* FindSymbol(X86_Symbol *items, size_t count, const char *name)
+{
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(items[i].name, name) == 0)
+            return &items[i];
+    return NULL;
+}
+
+static void PatchRel32(X86_Code *code, size_t at, size_t target)
+{
+    int32_t addend;
+    memcpy(&addend, &code->bytes.items[at], sizeof(addend));
+    int32_t rel = (int32_t)((int64_t)target + addend - (int64_t)(at + 4));
+    memcpy(&code->bytes.items[at], &rel, sizeof(rel));
+}
+
+// Appends the machine code for list to code. References to labels the list
+// defines are patched right away, the rest become fixups
+bool X86Encode(X86_Code *code, X86_List *list, Arena *arena)
+{
+    Encoder e = { .code = code, .arena = arena };
+    for (size_t i = 0; i < list->count; i++)
+	{
+        X86_Inst *inst = &list->items[i];
+        X86_Line *last = code->lines.count > 0 ? &code->lines.items[code->lines.count - 1] : NULL;
+        if (inst->line && (!last || last->line != inst->line))
+		{
+            if (last && last->offset == code->bytes.count)
+                last->line = inst->line;
+            else
+                nob_da_append(&code->lines, ((X86_Line){ code->bytes.count, inst->line }));
+        }
+        EncodeInst(&e, inst);
+    }
+
+    for (size_t i = 0; i < e.refs.count; i++)
+	{
+        X86_Symbol *ref = &e.refs.items[i];
+        X86_Symbol *label = FindSymbol(e.labels.items, e.labels.count, ref->name);
+        if (label)
+            PatchRel32(code, ref->offset, label->offset);
+        else
+            nob_da_append(&code->fixups, *ref);
+    }
+    nob_da_free(e.labels);
+    nob_da_free(e.refs);
+    return !e.had_err;
+}
+
+// Resolves the fixups code has a symbol for, the ones it doesn't are kept
+void X86Resolve(X86_Code *code)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < code->fixups.count; i++)
+	{
+        X86_Symbol *fixup = &code->fixups.items[i];
+        X86_Symbol *symbol = FindSymbol(code->symbols.items, code->symbols.count, fixup->name);
+        if (symbol)
+            PatchRel32(code, fixup->offset, symbol->offset);
+        else
+            code->fixups.items[kept++] = *fixup;
+    }
+    code->fixups.count = kept;
+}
+
+// Resolves the remaining fixups against the symbols of code
+bool X86Link(X86_Code *code)
+{
+    X86Resolve(code);
+    for (size_t i = 0; i < code->fixups.count; i++)
+        nob_log(NOB_ERROR, "Undefined symbol '%s'", code->fixups.items[i].name);
+    return code->fixups.count == 0;
+}
+
+X86_Symbol* X86FindSymbol(X86_Code *code, const char *name)
+	{ return FindSymbol(code->symbols.items, code->symbols.count, name); }
+
+// Symbols are in code order, each one runs up to the next
+size_t X86SymbolSize(X86_Code *code, size_t i)
+{
+    size_t offset = code->symbols.items[i].offset, end = code->bytes.count;
+    for (size_t j = i + 1; j < code->symbols.count; j++)
+	{
+        if (code->symbols.items[j].offset > offset)
+		{
+            if (code->symbols.items[j].offset < end)
+                end = code->symbols.items[j].offset;
+            break;
+        }
+    }
+    return offset < end ? end - offset : 0;
+}
+
+void X86CodeFree(X86_Code *code)
+{
+    nob_da_free(code->bytes);
+    nob_da_free(code->symbols);
+    nob_da_free(code->fixups);
+    nob_da_free(code->lines);
+}
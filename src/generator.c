@@ -3,67 +3,122 @@
 #include <nob.h>
 #include <cmpl.h>
 
-static void GenInit(Generator *g, Arena *a)
+static void GenInit(Generator *g, const Compile_Options *opts, Arena *a)
 {
 	*g = (Generator){
 		.sb = (Nob_String_Builder){0},
 		.arena = a,
+		.opts = opts,
 		.local_offset = 0,
-		.temp_count = 0,
+		.frame_size = 0,
+		.proc_name = NULL,
+		.self_tail = false,
+		.had_err = false,
 		.types = {0},
+		.program = NULL,
+		.code = NULL,
+		.only = NULL,
+		.profile = NULL,
+		.counter_base = 0,
+		.split = NULL,
+		.profile_hash = 0,
 	};
+	LayoutInit(&g->types, a);
 }
 
-static void RegisterType(Generator *g, const char *name, int size) 
+static size_t AlignUp(size_t value, size_t align)
+	{ return (value + align - 1) & ~(align - 1); }
+
+static TypeInfo* DeclType(Generator *g, AST_Node *type)
 {
-    TypeInfo info = { 
-		.name = name, 
-		.size = size 
-	};
-    arena_da_append(g->arena, &g->types, info);
+    TypeInfo *info = LayoutFindType(&g->types, type->name);
+    if (!info)
+	{
+        nob_log(NOB_ERROR, "%s: unknown type '%s'", g->proc_name, type->name);
+        g->had_err = true;
+    }
+    return info;
 }
 
-static TypeInfo* FindType(Generator *g, const char *name)
+// Formatted output for the cold paths, the per instruction code below
+// appends its fragments directly
+#define GenEmit(g, ...) EmitFmt(&(g)->sb, __VA_ARGS__)
+
+// System V AMD64: integer arguments in rdi, rsi, rdx, rcx, r8, r9, the rest
+// on the stack, result in rax. The runtime macros only scratch rax and rcx,
+// loop iterators may live in the callee-saved r12-r15
+static const char *arg_regs[ARG_REG_COUNT] = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+static const char *iter_regs[] = { "r12", "r13", "r14", "r15" };
+#define ITER_REG_COUNT 4
+
+static bool IsNumOperand(const char *src)
+	{ return src && ((src[0] >= '0' && src[0] <= '9') || src[0] == '-'); }
+
+static const char* FindRegVar(Generator *g, const char *name)
 {
-    for (size_t i = 0; i < g->types.count; i++) 
-        if (strcmp(g->types.items[i].name, name) == 0) 
-            return &g->types.items[i];
-    return NULL;
+	for (size_t i = 0; i < g->reg_vars.count; i++)
+		if (strcmp(g->reg_vars.items[i].name, name) == 0)
+			return g->reg_vars.items[i].reg;
+	return NULL;
 }
 
-static int GetTypeSize(Generator *g, const char *type_name)
+// Unary ops have no left operand, it reads as 0 the way the VM has it
+static void GenOperand(Generator *g, const char *src)
 {
-    TypeInfo *info = FindType(g, type_name);
-    return info ? info->size : 8;
+	if (!src)
+	{
+		EmitLit(&g->sb, "_Num 0");
+		return;
+	}
+	const char *reg = FindRegVar(g, src);
+	if (IsNumOperand(src))
+	{
+		EmitLit(&g->sb, "_Num ");
+		EmitStr(&g->sb, src);
+	}
+	else
+	{
+		EmitStr(&g->sb, reg ? "<_Reg " : "<_Var ");
+		EmitStr(&g->sb, reg ? reg : src);
+		EmitChar(&g->sb, '>');
+	}
 }
 
-static const char* JaiToFasmType(const char *jai_type)
+static void GenAssignTo(Generator *g, const char *dest)
 {
-    if (strcmp(jai_type, "int") == 0) 
-		return "dq";
-    if (strcmp(jai_type, "s64") == 0) 
-		return "dq";
-    if (strcmp(jai_type, "u32") == 0) 
-		return "dd";
-    if (strcmp(jai_type, "u16") == 0) 
-		return "dw";
-    if (strcmp(jai_type, "u8") == 0) 
-		return "db";
-    return NULL;  // It's a struct type
+	const char *reg = FindRegVar(g, dest);
+	EmitStr(&g->sb, reg ? "    _AssignReg " : "    _Assign ");
+	EmitStr(&g->sb, reg ? reg : dest);
+	EmitLit(&g->sb, ", ");
 }
 
-static void GenEmit(Generator *g, const char *fmt, ...)
+// Condition codes for fused compare-and-branch, the second column is the
+// inverted condition used by TAC_JUMP_IF_NOT
+static const char *cmp_ops[][3] = {
+	{ "<",  "l",  "ge" },
+	{ "<=", "le", "g"  },
+	{ ">",  "g",  "le" },
+	{ ">=", "ge", "l"  },
+	{ "==", "e",  "ne" },
+	{ "!=", "ne", "e"  },
+};
+
+static const char* CondCode(const char *op, bool negate)
 {
-	va_list args;
-	va_start(args, fmt);
-	
-	char buffer[4096];
-	vsnprintf(buffer, sizeof(buffer), fmt, args);
-	
-	nob_sb_append_cstr(&g->sb, buffer);
-	va_end(args);
+	for (size_t i = 0; i < sizeof(cmp_ops) / sizeof(cmp_ops[0]); i++)
+		if (strcmp(cmp_ops[i][0], op) == 0)
+			return cmp_ops[i][negate ? 2 : 1];
+	return NULL;
 }
 
+// Vector temps are named after the register they live in, _v3 is xmm3 or
+// ymm3 depending on the lane count of the instruction
+static int VecRegIndex(const char *name)
+	{ return atoi(name + 2); }
+
+static const char* VecPrefix(TAC_Inst *inst)
+	{ return inst->num == 4 ? "_Avx" : "_Vec"; }
+
 static void EmitTACInst(Generator *g, TAC_Inst *inst) 
 {
     switch (inst->type) 
@@ -73,410 +128,888 @@ static void EmitTACInst(Generator *g, TAC_Inst *inst)
             if (strcmp(inst->op, "+") == 0) macro = "_Add";
             else if (strcmp(inst->op, "-") == 0) macro = "_Sub";
             else if (strcmp(inst->op, "*") == 0) macro = "_Mul";
+            else if (strcmp(inst->op, "/") == 0) macro = "_Div";
+            else if (strcmp(inst->op, "%") == 0) macro = "_Mod";
+            // !x is 0 == x
+            else if (strcmp(inst->op, "!") == 0) macro = "_Equal";
             else if (strcmp(inst->op, "==") == 0) macro = "_Equal";
+            else if (strcmp(inst->op, "!=") == 0) macro = "_NotEqual";
             else if (strcmp(inst->op, "<") == 0) macro = "_Less";
+            else if (strcmp(inst->op, "<=") == 0) macro = "_LessEq";
             else if (strcmp(inst->op, ">") == 0) macro = "_Greater";
+            else if (strcmp(inst->op, ">=") == 0) macro = "_GreaterEq";
+            else if (strcmp(inst->op, "&") == 0) macro = "_And";
             
             if (macro) 
 			{
-                bool src1_is_num = (inst->src1 && ((inst->src1[0] >= '0' && inst->src1[0] <= '9') || inst->src1[0] == '-'));
-                bool src2_is_num = (inst->src2 && ((inst->src2[0] >= '0' && inst->src2[0] <= '9') || inst->src2[0] == '-'));
-                
-                GenEmit(g, "    _Assign %s, <%s ", inst->dest, macro);
-                
-                if (src1_is_num) 
-                    GenEmit(g, "_Num %s", inst->src1);
-				else
-                    GenEmit(g, "<_Var %s>", inst->src1);
-                
-                GenEmit(g, ", ");
-                
-                if (src2_is_num) 
-                    GenEmit(g, "_Num %s", inst->src2);
-                else
-                    GenEmit(g, "<_Var %s>", inst->src2);
-                
-                GenEmit(g, ">\n");
+                GenAssignTo(g, inst->dest);
+                EmitChar(&g->sb, '<');
+                EmitStr(&g->sb, macro);
+                EmitChar(&g->sb, ' ');
+                GenOperand(g, inst->src1);
+                EmitLit(&g->sb, ", ");
+                GenOperand(g, inst->src2);
+                EmitLit(&g->sb, ">\n");
+            }
+            else
+			{
+                nob_log(NOB_ERROR, "%s: operator '%s' is not supported", g->proc_name, inst->op);
+                g->had_err = true;
             }
             break;
         }
         
-        case TAC_COPY: {
-            // MOVED INSIDE: only check src1
-            bool src1_is_num = (inst->src1 && ((inst->src1[0] >= '0' && inst->src1[0] <= '9') || inst->src1[0] == '-'));
-            
-            if (src1_is_num)
-                GenEmit(g, "    _Assign %s, _Num %s\n", inst->dest, inst->src1);
+        case TAC_COPY:
+            GenAssignTo(g, inst->dest);
+            GenOperand(g, inst->src1);
+            EmitChar(&g->sb, '\n');
+            break;
+
+        case TAC_LOAD:
+            GenAssignTo(g, inst->dest);
+            GenEmit(g, "<%s %s, ", inst->flags & TAC_FLAG_SLICE ? "_SliceIndex" : "_Index", inst->src1);
+            GenOperand(g, inst->src2);
+            GenEmit(g, ">\n");
+            break;
+
+        case TAC_STORE:
+            GenEmit(g, "    %s %s, ", inst->flags & TAC_FLAG_SLICE ? "_StoreSliceIndex" : "_StoreIndex", inst->dest);
+            GenOperand(g, inst->src1);
+            GenEmit(g, ", ");
+            GenOperand(g, inst->src2);
+            GenEmit(g, "\n");
+            break;
+
+        case TAC_LOAD_FIELD:
+            GenAssignTo(g, inst->dest);
+            if (inst->src2)
+			{
+                GenEmit(g, "<_ElementField %s, %ld, %u, %u, ", inst->src1, inst->offset, inst->size, inst->stride);
+                GenOperand(g, inst->src2);
+                GenEmit(g, ">\n");
+            }
             else
-                GenEmit(g, "    _Assign %s, <_Var %s>\n", inst->dest, inst->src1);
+                GenEmit(g, "<_Field %s, %ld, %u>\n", inst->src1, inst->offset, inst->size);
+            break;
+
+        case TAC_STORE_FIELD:
+            if (inst->src1)
+			{
+                GenEmit(g, "    _StoreElementField %s, %ld, %u, %u, ", inst->dest, inst->offset, inst->size, inst->stride);
+                GenOperand(g, inst->src1);
+                GenEmit(g, ", ");
+            }
+            else
+                GenEmit(g, "    _StoreField %s, %ld, %u, ", inst->dest, inst->offset, inst->size);
+            GenOperand(g, inst->src2);
+            GenEmit(g, "\n");
+            break;
+
+        case TAC_ADDR:
+            GenAssignTo(g, inst->dest);
+            GenEmit(g, "<_Address %s>\n", inst->src1);
+            break;
+
+        // Unsigned, negative indices wrap around and fail as well
+        case TAC_BOUNDS_CHECK:
+            EmitLit(&g->sb, "    _CmpJump ");
+            GenOperand(g, inst->src1);
+            EmitLit(&g->sb, ", ");
+            GenOperand(g, inst->src2);
+            EmitLit(&g->sb, ", ae, _bounds_fail\n");
+            break;
+
+        case TAC_VEC_SPLAT:
+            GenEmit(g, "    %sSplat %d, ", VecPrefix(inst), VecRegIndex(inst->dest));
+            GenOperand(g, inst->src1);
+            GenEmit(g, "\n");
+            break;
+
+        case TAC_VEC_LOAD:
+            GenEmit(g, "    %sLoad %d, %s, %ld, ", VecPrefix(inst), VecRegIndex(inst->dest), inst->src1, inst->offset);
+            GenOperand(g, inst->src2);
+            GenEmit(g, "\n");
+            break;
+
+        case TAC_VEC_STORE:
+            GenEmit(g, "    %sStore %s, %ld, ", VecPrefix(inst), inst->dest, inst->offset);
+            GenOperand(g, inst->src1);
+            GenEmit(g, ", %d\n", VecRegIndex(inst->src2));
+            break;
+
+        case TAC_VEC_BINOP:
+            GenEmit(g, "    %s%s %d, %d, %d\n", VecPrefix(inst), strcmp(inst->op, "+") == 0 ? "Add" : "Sub",
+                    VecRegIndex(inst->dest), VecRegIndex(inst->src1), VecRegIndex(inst->src2));
+            break;
+
+        case TAC_VEC_END:
+            GenEmit(g, "    %sEnd\n", VecPrefix(inst));
+            break;
+
+        case TAC_PARAM:
+            if (inst->num < ARG_REG_COUNT)
+                GenEmit(g, "    _Arg %s, ", arg_regs[inst->num]);
+            else
+			{
+                // Stack arguments go to the outgoing area at the bottom of the frame
+                GenEmit(g, "    _Arg qword [rsp + %d], ", ((int)inst->num - ARG_REG_COUNT) * 8);
+            }
+            GenOperand(g, inst->src1);
+            EmitChar(&g->sb, '\n');
             break;
-        }
         
+        case TAC_TAIL_CALL:
+            // Self recursion reuses the frame and re-enters at the parameter
+            // spills, anything else tears the frame down and jumps
+            if (strcmp(inst->src1, g->proc_name) == 0)
+                GenEmit(g, "    jmp func_%s.entry\n", inst->src1);
+            else
+                GenEmit(g, "    _TailCall func_%s\n", inst->src1);
+            break;
+
         case TAC_CALL: 
-            GenEmit(g, "    call func_%s\n", inst->src1);
-            GenEmit(g, "    _StoreVar %s, rax\n", inst->dest);
+            EmitLit(&g->sb, "    call func_");
+            EmitStr(&g->sb, inst->src1);
+            EmitLit(&g->sb, "\n    _StoreVar ");
+            EmitStr(&g->sb, inst->dest);
+            EmitLit(&g->sb, ", rax\n");
             break;
         
-        case TAC_RETURN: {
-            // MOVED INSIDE: only check src1
-            bool src1_is_num = (inst->src1 && ((inst->src1[0] >= '0' && inst->src1[0] <= '9') || inst->src1[0] == '-'));
-            
-            if (src1_is_num) 
-                GenEmit(g, "    _Return _Num %s\n", inst->src1);
+        case TAC_LABEL:
+            EmitStr(&g->sb, inst->dest);
+            EmitLit(&g->sb, ":\n");
+            break;
+
+        case TAC_JUMP:
+            EmitLit(&g->sb, "    _Jump ");
+            EmitStr(&g->sb, inst->dest);
+            EmitChar(&g->sb, '\n');
+            break;
+
+        case TAC_JUMP_IF:
+        case TAC_JUMP_IF_NOT:
+            if (inst->op)
+			{
+                EmitLit(&g->sb, "    _CmpJump ");
+                GenOperand(g, inst->src1);
+                EmitLit(&g->sb, ", ");
+                GenOperand(g, inst->src2);
+                EmitLit(&g->sb, ", ");
+                EmitStr(&g->sb, CondCode(inst->op, inst->type == TAC_JUMP_IF_NOT));
+            }
+            else
+			{
+                EmitStr(&g->sb, inst->type == TAC_JUMP_IF ? "    _JumpIf " : "    _JumpIfNot ");
+                GenOperand(g, inst->src1);
+            }
+            EmitLit(&g->sb, ", ");
+            EmitStr(&g->sb, inst->dest);
+            EmitChar(&g->sb, '\n');
+            break;
+
+        case TAC_DEC_JUMP_NZ:
+		{
+            const char *reg = FindRegVar(g, inst->src1);
+            if (reg)
+                GenEmit(g, "    _DecJnz %s, %s\n", reg, inst->dest);
             else
-                GenEmit(g, "    _Return <_Var %s>\n", inst->src1);
+                GenEmit(g, "    _DecJnz qword [rbp - %s_offset], %s\n", inst->src1, inst->dest);
             break;
         }
+
+        case TAC_RETURN:
+            EmitLit(&g->sb, "    _Return ");
+            GenOperand(g, inst->src1);
+            EmitChar(&g->sb, '\n');
+            break;
+
+        case TAC_COUNT:
+            EmitLit(&g->sb, "    inc qword [_profile_counters + ");
+            EmitInt(&g->sb, inst->num * 8);
+            EmitLit(&g->sb, "]\n");
+            break;
         
         default:
             break;
     }
 }
 
-static void GenBinOp(Generator *g, AST_Node *node)
+static void EmitTACList(Generator *g, TAC_List *tac)
 {
-    const char *op = node->name;
-    
-    if (strcmp(op, "+") == 0) 
-	{
-        GenEmit(g, "<_Add ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    } 
-	else if (strcmp(op, "-") == 0) 
-	{
-        GenEmit(g, "<_Sub ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    } 
-	else if (strcmp(op, "*") == 0) 
-	{
-        GenEmit(g, "<_Mul ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    } 
-	else if (strcmp(op, "==") == 0) 
-	{
-        GenEmit(g, "<_Equal ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    } 
-	else if (strcmp(op, "<") == 0) 
-	{
-        GenEmit(g, "<_Less ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    } 
-	else if (strcmp(op, ">") == 0) 
-	{
-        GenEmit(g, "<_Greater ");
-        GenExpr(g, node->left);
-        GenEmit(g, ", ");
-        GenExpr(g, node->right);
-        GenEmit(g, ">");
-    }
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++) 
+        EmitTACInst(g, inst);
 }
 
-static void GenExpr(Generator *g, AST_Node *node) 
+// The layout is published as equates, Name.field is the byte offset
+static void GenStruct(Generator *g, AST_Node *node) 
 {
-    if (!node) 
-		return;
+    if (!LayoutStruct(&g->types, node, g->arena))
+	{
+        g->had_err = true;
+        return;
+    }
     
-    switch (node->type) 
+    TypeInfo *info = LayoutFindType(&g->types, node->name);
+    GenEmit(g, "; struct %s, %zu bytes, %zu byte aligned%s\n", info->name, info->size, info->align, 
+            info->soa ? ", arrays of it hold one array per field" : "");
+    for (size_t i = 0; i < info->fields.count; i++) 
 	{
-        case AST_NUM:
-            GenEmit(g, "_Num %lld", node->num);
-            break;
-            
-        case AST_ID:
-            GenEmit(g, "<_Var %s>", node->name);
-            break;
-            
-        case AST_BIN_OP:
-            GenBinOp(g, node);
-            break;
-
-		case AST_CALL:
-			if (node->left && node->left->type == AST_ID) 
-				GenEmit(g, "call label_%s", node->left->name);
-			break;
-            
-        default:
-            nob_log(NOB_ERROR, "Unsupported expression type: %d", node->type);
-            break;
+        Field_Info *field = &info->fields.items[i];
+        GenEmit(g, "%s.%s = %zu ; %s\n", info->name, field->name, field->offset, field->type);
     }
+    GenEmit(g, "sizeof.%s = %zu\n\n", info->name, info->size);
+}
+
+typedef struct {
+    const char **items;
+    size_t count, capacity;
+} Name_List;
+
+static bool HasVar(AST_Array *vars, Name_List *extra, const char *name)
+{
+    for (size_t i = 0; i < vars->used; i++)
+        if (strcmp(vars->data[i]->name, name) == 0)
+            return true;
+    for (size_t i = 0; i < extra->count; i++)
+        if (strcmp(extra->items[i], name) == 0)
+            return true;
+    return false;
 }
 
-static void GenAssign(Generator *g, AST_Node *node) 
+static uint64_t VarWeight(Proc_Unit *unit, const char *name)
 {
-    if (node->right && node->right->type == AST_CALL) 
+    for (size_t i = 0; i < unit->var_weights.count; i++)
+        if (strcmp(unit->var_weights.items[i].name, name) == 0)
+            return unit->var_weights.items[i].weight;
+    return 0;
+}
+
+// Iterators of the innermost loops get r12-r15, they are the hottest values
+// in the procedure and survive calls in the loop body for free. With a
+// profile the iterators that are touched most often win instead
+static void AssignIteratorRegs(Generator *g, Proc_Unit *unit)
+{
+    TAC_List *tac = &unit->tac;
+    g->reg_vars.count = 0;
+    if (unit->var_weights.count > 0)
 	{
-        AST_Node *call = node->right;
-        if (call->left && call->left->type == AST_ID) 
+        while (g->reg_vars.count < ITER_REG_COUNT)
 		{
-            GenEmit(g, "    call label_%s\n", call->left->name);
-            GenEmit(g, "    _StoreVar %s, rax\n", node->name);
+            const char *best = NULL;
+            uint64_t best_weight = 0;
+            for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++)
+			{
+                if (!(inst->flags & TAC_FLAG_ITERATOR) || FindRegVar(g, inst->dest))
+                    continue;
+                uint64_t weight = VarWeight(unit, inst->dest);
+                if (!best || weight > best_weight)
+				{
+                    best = inst->dest;
+                    best_weight = weight;
+                }
+            }
+            if (!best || best_weight == 0)
+                break;
+            Reg_Var rv = { .name = best, .reg = iter_regs[g->reg_vars.count] };
+            arena_da_append(g->arena, &g->reg_vars, rv);
         }
         return;
     }
-    
-    GenEmit(g, "    _Assign %s, ", node->name);
-    GenExpr(g, node->right);
-    GenEmit(g, "\n");
-}
 
-static void GenIf(Generator *g, AST_Node *node) 
-{
-    TAC_Builder tb;
-    TACInit(&tb, g->arena);
-    char *cond_result = ExprToTAC(&tb, node->left);
-    
-    for (TAC_Inst *inst = tb.head; inst != NULL; inst = inst->next) 
-        EmitTACInst(g, inst);
-    
-    GenEmit(g, "    _BeginIf <_Var %s>\n", cond_result);
-    
-    if (node->body) 
+    for (int depth = 64; depth >= 0 && g->reg_vars.count < ITER_REG_COUNT; depth--) 
 	{
-        TAC_Inst *body_tac = FuncBodyToTAC(node->body, g->arena);
-        for (TAC_Inst *inst = body_tac; inst != NULL; inst = inst->next) 
-            EmitTACInst(g, inst);
-    }
-    
-    if (node->right) 
-	{
-        GenEmit(g, "    _Else\n");
-        TAC_Inst *else_tac = FuncBodyToTAC(node->right, g->arena);
-        for (TAC_Inst *inst = else_tac; inst != NULL; inst = inst->next) 
-            EmitTACInst(g, inst);
+        for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++) 
+		{
+            if (!(inst->flags & TAC_FLAG_ITERATOR) || inst->num != depth || FindRegVar(g, inst->dest))
+                continue;
+            if (g->reg_vars.count == ITER_REG_COUNT)
+                break;
+            Reg_Var rv = { .name = inst->dest, .reg = iter_regs[g->reg_vars.count] };
+            arena_da_append(g->arena, &g->reg_vars, rv);
+        }
     }
-    
-    GenEmit(g, "    _EndIf\n");
 }
 
-static void GenWhile(Generator *g, AST_Node *node) 
+static void AddWeight(Generator *g, Proc_Unit *unit, const char *name, uint64_t count)
 {
-    TAC_Builder tb;
-    TACInit(&tb, g->arena);
-    char *cond_result = ExprToTAC(&tb, node->left);
-    
-    for (TAC_Inst *inst = tb.head; inst != NULL; inst = inst->next) 
-        EmitTACInst(g, inst);
-    GenEmit(g, "    _BeginWhile <_Var %s>\n", cond_result);
-    
-    if (node->body) 
+    if (!name || IsNumOperand(name))
+        return;
+    for (size_t i = 0; i < unit->var_weights.count; i++)
 	{
-        TAC_Inst *body_tac = FuncBodyToTAC(node->body, g->arena);
-        for (TAC_Inst *inst = body_tac; inst != NULL; inst = inst->next) 
-            EmitTACInst(g, inst);
+        if (strcmp(unit->var_weights.items[i].name, name) == 0)
+		{
+            unit->var_weights.items[i].weight += count;
+            return;
+        }
     }
-    GenEmit(g, "    _EndWhile\n");
+    Var_Weight weight = { .name = name, .weight = count };
+    arena_da_append(g->arena, &unit->var_weights, weight);
 }
 
-static void GenStruct(Generator *g, AST_Node *node) 
+// The final TAC of the procedure is where counters go in and where a
+// profile's counts are read back, one per basic block. Every use of a
+// variable weighs as much as its block ran. Returns the counts of the
+// blocks when there is a profile
+static uint64_t* ProfileProc(Generator *g, Proc_Unit *unit)
 {
-    if (!node->name) 
+    if (!g->opts->instrument_path && !g->profile)
+        return NULL;
+
+    CFG cfg;
+    CFGBuild(&cfg, &unit->tac);
+    uint64_t *counts = NULL;
+    if (g->profile && g->counter_base + cfg.count <= g->profile->count)
 	{
-        nob_log(NOB_ERROR, "Struct missing name");
-        return;
+        counts = &g->profile->counts[g->counter_base];
+        for (size_t b = 0; b < cfg.count; b++)
+		{
+            for (size_t i = cfg.items[b].begin; i < cfg.items[b].end; i++)
+			{
+                TAC_Inst *inst = &unit->tac.items[i];
+                AddWeight(g, unit, inst->dest, counts[b]);
+                AddWeight(g, unit, inst->src1, counts[b]);
+                AddWeight(g, unit, inst->src2, counts[b]);
+            }
+        }
     }
-    
-    int total_size = 0;
-    for (size_t i = 0; i < node->children.used; i++) 
+    if (g->opts->instrument_path)
+        ProfileInstrument(&unit->tac, &cfg, g->counter_base, g->arena);
+    g->counter_base += cfg.count;
+    CFGFree(&cfg);
+    return counts;
+}
+
+static void AddSlot(Generator *g, const char *name, int size, int align, int *offset)
+{
+    *offset = (int)AlignUp(*offset + size, align);
+    Frame_Slot slot = { .name = name, .offset = *offset, .size = size };
+    arena_da_append(g->arena, &g->frame, slot);
+}
+
+// Named variables, loop-only values, temps and callee-saved register slots,
+// in that order below rbp. The outgoing stack argument area sits at rsp
+static void LayoutFrame(Generator *g, AST_Array *vars, size_t param_count, Name_List *extra, TAC_List *tac)
+{
+    g->frame.count = 0;
+    int offset = 0;
+    int regs = 0, stack = 0;
+
+    for (size_t i = 0; i < vars->used; i++)
 	{
-        AST_Node *field = node->children.data[i];
-        if (field->type == AST_FIELD && field->right) 
-            total_size += GetTypeSize(g, field->right->name);
+        AST_Node *var = vars->data[i];
+        AST_Node *type = var->right && var->right->type == AST_TYPE ? var->right : NULL;
+        TypeInfo *info = type ? DeclType(g, type) : NULL;
+        bool slice = type && (type->flags & AST_FLAG_SLICE);
+        if (slice && info && (info->size != 8 || info->fields.count > 0))
+		{
+            nob_log(NOB_ERROR, "%s: slice '%s' must have 8 byte scalar elements", g->proc_name, var->name);
+            g->had_err = true;
+        }
+        if (i < param_count && info && !slice && (info->fields.count > 0 || type->num > 0))
+		{
+            nob_log(NOB_ERROR, "%s: parameter '%s' must be a scalar or a slice", g->proc_name, var->name);
+            g->had_err = true;
+        }
+
+        if (i < param_count)
+		{
+            int pos = LayoutArgPosition(&regs, &stack, LayoutParamWords(var));
+            if (pos >= ARG_REG_COUNT)
+			{
+                // Above the saved rbp and return address
+                Frame_Slot slot = { .name = var->name, .offset = -16 - (pos - ARG_REG_COUNT) * 8 };
+                arena_da_append(g->arena, &g->frame, slot);
+                continue;
+            }
+        }
+
+        if (slice)
+            AddSlot(g, var->name, SLICE_SIZE, 8, &offset);
+        else if (i >= param_count && info && info->fields.count > 0 && type->num > 0)
+            AddSlot(g, var->name, (int)LayoutArraySize(info, type->num), 16, &offset);
+        else if (i >= param_count && info && type->num > 0)
+		{
+            // Element access scales the index by 8 and packed loads want the
+            // first element on a 16 byte boundary
+            if (info->size != 8)
+			{
+                nob_log(NOB_ERROR, "%s: array '%s' must have 8 byte elements", g->proc_name, var->name);
+                g->had_err = true;
+            }
+            AddSlot(g, var->name, (int)(info->size * type->num), 16, &offset);
+        }
+        else if (i >= param_count && info && info->fields.count > 0)
+            AddSlot(g, var->name, (int)info->size, (int)info->align, &offset);
+        else
+            // Scalars are always moved as whole qwords
+            AddSlot(g, var->name, 8, 8, &offset);
+
+        if (i >= param_count && type)
+            g->frame.items[g->frame.count - 1].zero = true;
     }
-    
-    RegisterType(g, node->name, total_size);
-    
-    GenEmit(g, "struc %s\n{\n", node->name);
-    
-    for (size_t i = 0; i < node->children.used; i++) 
+
+    for (size_t i = 0; i < extra->count; i++)
+        if (!FindRegVar(g, extra->items[i]))
+            AddSlot(g, extra->items[i], 8, 8, &offset);
+
+    int temp_count = TACGetMaxTemp(tac) + 1;
+    for (int i = 0; i < temp_count; i++)
+        AddSlot(g, arena_sprintf(g->arena, "_t%d", i), 8, 8, &offset);
+
+    for (size_t i = 0; i < g->reg_vars.count; i++)
+        AddSlot(g, arena_sprintf(g->arena, "_save_%s", g->reg_vars.items[i].reg), 8, 8, &offset);
+
+    int stack_args = 0;
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++)
+        if (inst->type == TAC_PARAM && (int)inst->num - ARG_REG_COUNT + 1 > stack_args)
+            stack_args = (int)inst->num - ARG_REG_COUNT + 1;
+
+    // Keep rsp 16-byte aligned at every call site
+    g->frame_size = (offset + stack_args * 8 + 15) & ~15;
+}
+
+// #tail calls the tail call pass could not place are errors, self tail calls
+// need the .entry label after the prologue
+static void CheckTailCalls(Generator *g, TAC_List *tac)
+{
+    g->self_tail = false;
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++)
 	{
-        AST_Node *field = node->children.data[i];
-        if (field->type == AST_FIELD && field->name && field->right) 
+        if (inst->type == TAC_CALL && (inst->flags & TAC_FLAG_MUST_TAIL))
 		{
-            const char *fasm_type = JaiToFasmType(field->right->name);
-            
-            if (fasm_type) 
-                GenEmit(g, "    .%s %s ?\n", field->name, fasm_type);
-            else
-                GenEmit(g, "    .%s %s\n", field->name, field->right->name);
+            nob_log(NOB_ERROR, "%s: #tail call to '%s' is not in tail position", 
+                    g->proc_name, inst->src1);
+            g->had_err = true;
         }
+        if (inst->type == TAC_TAIL_CALL && strcmp(inst->src1, g->proc_name) == 0)
+            g->self_tail = true;
     }
-    
-    GenEmit(g, "}\n\n");
 }
 
-static void GenStmt(Generator *g, AST_Node *node)
+// Arrays and slices pass as two argument words, a call only matches its
+// procedure when both sides agree on the word count
+static void CheckCallArgs(Generator *g, TAC_List *tac)
 {
-    if (!node) 
-		return;
-    
-    switch (node->type) 
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++)
 	{
-        case AST_ASSIGNMENT:
-			if (node->right && node->right->type == AST_TYPE)
-				break;
-            GenAssign(g, node);
-            break;
-            
-        case AST_IF:
-            GenIf(g, node);
-            break;
-            
-        case AST_WHILE:
-            GenWhile(g, node);
-            break;
-            
-        case AST_STRUCT:
-            GenStruct(g, node);
-            break;
-            
-        case AST_BLOCK:
-			TAC_Inst *tac = FuncBodyToTAC(node, g->arena);
-            for (TAC_Inst *inst = tac; inst != NULL; inst = inst->next) 
+        if (inst->type != TAC_CALL && inst->type != TAC_TAIL_CALL)
+            continue;
+        for (size_t i = 0; i < g->program->children.used; i++)
+		{
+            AST_Node *proc = g->program->children.data[i];
+            if (proc->type != AST_PROC || strcmp(proc->name, inst->src1) != 0)
+                continue;
+            int words = 0;
+            for (size_t p = 0; p < proc->children.used; p++)
+                words += LayoutParamWords(proc->children.data[p]);
+            if (words != inst->num)
 			{
-                if (inst->type == TAC_JUMP_IF || inst->type == TAC_JUMP_IF_NOT) 
-				{
-                    AST_Node *ctrl_node = (AST_Node*)inst->src1;
-                    GenStmt(g, ctrl_node);
-                } 
-				else
-                    EmitTACInst(g, inst);
+                nob_log(NOB_ERROR, "%s: arguments of the call to '%s' don't match its parameters", 
+                        g->proc_name, inst->src1);
+                g->had_err = true;
             }
-            break;
-            
-        default:
-            nob_log(NOB_WARNING, "Unsupported statement type: %d", node->type);
-            break;
+        }
+    }
+}
+
+// Everything up to the final TAC, procedures are placed before any of
+// them is emitted
+static bool BuildProc(Generator *g, AST_Node *node, Proc_Unit *unit)
+{
+    g->proc_name = node->name ? node->name : "anonymous";
+    *unit = (Proc_Unit){ .node = node };
+
+    bool tac_err = false;
+    unit->tac = FuncBodyToTAC(node, g->opts, &g->types, g->arena, &tac_err);
+    if (tac_err)
+	{
+        g->had_err = true;
+        return false;
+    }
+    if (g->opts->opt_level >= 1)
+	{
+        EliminateBoundsChecks(&unit->tac);
+        OptimizeLoops(&unit->tac, g->arena);
     }
+    uint64_t *counts = ProfileProc(g, unit);
+    if (g->opts->opt_level >= 1)
+        PlaceBlocks(unit, counts, g->arena);
+    return true;
 }
 
-static void GenProc(Generator *g, AST_Node *node) 
+static void GenProc(Generator *g, Proc_Unit *unit) 
 {
+    AST_Node *node = unit->node;
+    TAC_List *tac = &unit->tac;
     const char *func_name = node->name ? node->name : "anonymous";
+    g->proc_name = func_name;
     
-    TAC_Inst *tac = FuncBodyToTAC(node->body, g->arena);
-    
-    // Collect ALL variables from function body (including nested scopes)
+    // Parameters come first so CollectVariables doesn't redeclare them as locals
     AST_Array all_vars = {0};
     ASTArrayInit(&all_vars);
-    CollectVariables(node->body, &all_vars, g->arena);
+    for (size_t i = 0; i < node->children.used; i++) 
+        CollectVariables(node->children.data[i], &all_vars, g->arena);
+    size_t param_count = all_vars.used;
     
-    // Calculate locals size
-    int locals_size = 0;
+    // Collect ALL variables from function body (including nested scopes)
+    CollectVariables(node->body, &all_vars, g->arena);
     
-    // Count size of all variables
-    for (size_t i = 0; i < all_vars.used; i++) {
-        AST_Node *var = all_vars.data[i];
-        if (var->right && var->right->type == AST_TYPE) {
-            const char *type_name = var->right->name;
-            int type_size = GetTypeSize(g, type_name);
-            locals_size += type_size;
-        } else {
-            locals_size += 8;
-        }
+    // Loop iterators and counters only exist in the TAC
+    Name_List extra_vars = {0};
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++) 
+	{
+        bool is_temp = inst->dest && inst->dest[0] == '_' && inst->dest[1] == 't';
+        if ((inst->type == TAC_COPY || inst->type == TAC_BINOP) && !is_temp && 
+            !HasVar(&all_vars, &extra_vars, inst->dest))
+            nob_da_append(&extra_vars, inst->dest);
     }
-    
-    // Count temps from TAC
-    int temp_count = TACGetMaxTemp(tac) + 1;
-    if (temp_count > 0) {
-        locals_size += temp_count * 8;
+    AssignIteratorRegs(g, unit);
+    CheckTailCalls(g, tac);
+    CheckCallArgs(g, tac);
+    LayoutFrame(g, &all_vars, param_count, &extra_vars, tac);
+    nob_da_free(extra_vars);
+    
+    // Optimized builds go through the instruction list so the peephole pass
+    // can clean up after the naive per-TAC lowering, flat -O0 builds print
+    // the lowering as it is
+    if (g->opts->opt_level >= 1 || g->opts->flat_asm)
+	{
+        X86_List list = {0};
+        X86LowerProc(g, node, tac, &list);
+        if (g->opts->opt_level >= 1)
+            X86Peephole(&list);
+        if (g->code)
+            g->had_err |= !X86Encode(g->code, &list, g->arena);
+        else
+            X86Print(&g->sb, &list);
+        nob_da_free(list);
+        GenEmit(g, "\n");
+        return;
     }
     
-    GenEmit(g, "_FuncBeginWithLocals func_%s, %d\n", func_name, locals_size);
+    GenEmit(g, "_FuncBeginWithLocals func_%s, %d\n", func_name, g->frame_size);
     
-    // Declare all variables
-    int offset = 0;
-    for (size_t i = 0; i < all_vars.used; i++) {
-        AST_Node *var = all_vars.data[i];
-        if (var->right && var->right->type == AST_TYPE) {
-            const char *type_name = var->right->name;
-            int type_size = GetTypeSize(g, type_name);
-            offset += type_size;
-            GenEmit(g, "    _DeclareVar %s, %d\n", var->name, type_size);
-            GenEmit(g, "    %s_offset = %d\n", var->name, offset);
-        } else {
-            offset += 8;
-            GenEmit(g, "    _DeclareVar %s, 8\n", var->name);
-            GenEmit(g, "    %s_offset = %d\n", var->name, offset);
-        }
+    // Offsets come aligned from LayoutFrame, _DeclareVar's unaligned running
+    // total is left to hand-written macro code
+    for (size_t i = 0; i < g->frame.count; i++)
+        GenEmit(g, "    %s_offset = %d\n", g->frame.items[i].name, g->frame.items[i].offset);
+    
+    // Callee-saved registers get a slot each, every epilogue macro in this
+    // procedure restores them through _RestoreCalleeSaved
+    if (g->reg_vars.count > 0)
+	{
+        for (size_t i = 0; i < g->reg_vars.count; i++)
+            GenEmit(g, "    _StoreVar _save_%s, %s\n", g->reg_vars.items[i].reg, g->reg_vars.items[i].reg);
+        GenEmit(g, "macro _RestoreCalleeSaved\n{\n");
+        for (size_t i = 0; i < g->reg_vars.count; i++)
+            GenEmit(g, "    _LoadVar %s, _save_%s\n", g->reg_vars.items[i].reg, g->reg_vars.items[i].reg);
+        GenEmit(g, "}\n");
     }
     
-    // Declare temp variables
-    for (int i = 0; i < temp_count; i++) {
-        offset += 8;
-        GenEmit(g, "    _DeclareVar _t%d, 8\n", i);
-        GenEmit(g, "    _t%d_offset = %d\n", i, offset);
+    if (g->self_tail)
+        GenEmit(g, ".entry:\n");
+    int regs = 0, stack = 0;
+    for (size_t i = 0; i < param_count; i++)
+	{
+        AST_Node *param = all_vars.data[i];
+        int words = LayoutParamWords(param);
+        int pos = LayoutArgPosition(&regs, &stack, words);
+        if (pos >= ARG_REG_COUNT)
+            continue;
+        GenEmit(g, "    _StoreVar %s, %s\n", param->name, arg_regs[pos]);
+        if (words == 2)
+            GenEmit(g, "    mov [rbp - %s_offset + %d], %s\n", param->name, SLICE_COUNT_OFFSET, arg_regs[pos + 1]);
     }
+
+    X86_List zero = {0};
+    X86ZeroLocals(g, &zero);
+    X86Print(&g->sb, &zero);
+    nob_da_free(zero);
     
     GenEmit(g, "\n");
-    GenStmt(g, node->body);
-    GenEmit(g, "_FuncEnd\n\n");
+    EmitTACList(g, tac);
+    GenEmit(g, "_FuncEnd\n");
+    if (g->reg_vars.count > 0)
+        GenEmit(g, "purge _RestoreCalleeSaved\n");
+    GenEmit(g, "\n");
+}
+
+static bool HasName(const char **names, size_t count, const char *name)
+{
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(names[i], name) == 0)
+            return true;
+    return false;
+}
+
+// _start dumps header and counters in one write
+static void GenProfileData(Nob_String_Builder *sb, const Compile_Options *opts, uint64_t hash, size_t count)
+{
+    nob_sb_appendf(sb, "_profile_header dq 0x%llx, 0x%llx, %zu\n", PROFILE_MAGIC, (unsigned long long)hash, count);
+    nob_sb_appendf(sb, "_profile_counters rq %zu\n", count);
+    nob_sb_appendf(sb, "_profile_size = _profile_counters + %zu - _profile_header\n", count * 8);
+    nob_sb_appendf(sb, "_profile_path db '%s', 0\n", opts->instrument_path);
+}
+
+static const char* ProcName(Proc_Unit *unit)
+	{ return unit->node->name ? unit->node->name : "anonymous"; }
+
+// A fasm object of its own for the procedures in [first, last), the ones
+// they call from other units are external. The text goes out through a
+// writer while it's generated and fasm starts on the unit once it's closed
+static void GenSplitUnit(Generator *g, Proc_Unit *units, size_t first, size_t last, Nob_String_Builder *shared)
+{
+    Asm_Split *split = g->split;
+    const char *asm_path = arena_sprintf(g->arena, "%s.%zu.asm", split->exe, split->units);
+    const char *obj_path = arena_sprintf(g->arena, "%s.%zu.o", split->exe, split->units++);
+    Asm_Writer writer;
+    if (split->failed || !WriterOpen(&writer, asm_path, split->jobs > 1))
+	{
+        split->failed = true;
+        return;
+    }
+
+    EmitLit(&g->sb, "format ELF64\n");
+    if (g->opts->opt_level < 1 && !g->opts->flat_asm)
+        EmitLit(&g->sb, "include 'runtime/macros.asm'\n");
+    EmitBuf(&g->sb, shared->items, shared->count);
+    EmitLit(&g->sb, "section '.text' executable\n");
+
+    struct {
+        const char **items;
+        size_t count, capacity;
+    } externs = {0};
+    nob_da_append(&externs, "_bounds_fail");
+    if (g->opts->instrument_path)
+        nob_da_append(&externs, "_profile_counters");
+    for (size_t i = first; i < last; i++)
+	{
+        EmitLit(&g->sb, "public func_");
+        EmitStr(&g->sb, ProcName(&units[i]));
+        EmitChar(&g->sb, '\n');
+        for (size_t k = 0; k < units[i].tac.count; k++)
+		{
+            TAC_Inst *inst = &units[i].tac.items[k];
+            if (inst->type != TAC_CALL && inst->type != TAC_TAIL_CALL)
+                continue;
+            bool local = false;
+            for (size_t j = first; j < last && !local; j++)
+                local = strcmp(ProcName(&units[j]), inst->src1) == 0;
+            if (!local && !HasName(externs.items, externs.count, inst->src1))
+                nob_da_append(&externs, inst->src1);
+        }
+    }
+    for (size_t i = 0; i < externs.count; i++)
+	{
+        EmitStr(&g->sb, externs.items[i][0] == '_' ? "extrn " : "extrn func_");
+        EmitStr(&g->sb, externs.items[i]);
+        EmitChar(&g->sb, '\n');
+    }
+    EmitChar(&g->sb, '\n');
+    nob_da_free(externs);
+
+    for (size_t i = first; i < last; i++)
+	{
+        GenProc(g, &units[i]);
+        WriterPut(&writer, &g->sb);
+    }
+    if (!WriterClose(&writer, &g->sb) || g->had_err)
+	{
+        split->failed = true;
+        return;
+    }
+    nob_cmd_append(&split->cmd, "fasm", asm_path, obj_path);
+    if (!nob_cmd_run(&split->cmd, .async = &split->running, .max_procs = split->jobs))
+        split->failed = true;
+    nob_cmd_append(&split->link, obj_path);
+}
+
+// Units of about equal size, one per core at most, take the procedures in
+// placement order. The text doesn't exist before it's generated, so the
+// TAC instruction count stands in for its size. What g->sb holds so far is
+// the prelude all units share
+static void GenSplit(Generator *g, Proc_Unit *units, size_t count)
+{
+    Nob_String_Builder shared = g->sb;
+    g->sb = (Nob_String_Builder){0};
+
+    size_t *sizes = arena_alloc(g->arena, count * sizeof(size_t) + 1);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+	{
+        sizes[i] = units[i].tac.count;
+        total += sizes[i];
+    }
+    size_t unit_count = count < g->split->jobs ? count : g->split->jobs;
+    size_t target = unit_count > 0 ? total / unit_count + 1 : 0;
+
+    size_t first = 0, size = 0;
+    for (size_t i = 0; i < count; i++)
+	{
+        size += sizes[i];
+        if (size < target && i + 1 < count)
+            continue;
+        GenSplitUnit(g, units, first, i + 1, &shared);
+        first = i + 1;
+        size = 0;
+    }
+    nob_sb_free(shared);
 }
 
+// With split set the procedures are streamed to the units, which bring
+// their own headers
 static void GenProgram(Generator *g, AST_Node *node) 
 {
+    g->program = node;
     GenEmit(g, "; Generated by Jai compiler\n");
     GenEmit(g, "; asmsyntax=fasm\n");
-    GenEmit(g, "include 'runtime/core.asm'\n\n");
+    if (!g->split)
+	{
+        if (g->opts->instrument_path)
+            GenEmit(g, "PROFILE = 1\n");
+        GenEmit(g, "include 'runtime/core.asm'\n\n");
+    }
+
+    // A single procedure has no idea where its counters start
+    uint64_t hash = g->opts->profile || g->opts->instrument_path ? ProfileHash(node, g->opts) : 0;
+    if (g->opts->profile && !g->only)
+	{
+        if (g->opts->profile->hash == hash)
+            g->profile = g->opts->profile;
+        else
+            nob_log(NOB_WARNING, "The profile was taken from a different program or options, ignoring it");
+    }
     
 	for (size_t i = 0; i < node->children.used; ++i) 
 	{
 		AST_Node *decl = node->children.data[i];
 		if (decl->type == AST_STRUCT) 
-			GenProc(g, decl);
+			GenStruct(g, decl);
 	}
     
+    struct {
+        Proc_Unit *items;
+        size_t count, capacity;
+    } units = {0};
 	for (size_t i = 0; i < node->children.used; ++i) 
 	{
 		AST_Node *decl = node->children.data[i];
-		if (decl->type == AST_PROC) 
-			GenProc(g, decl);
+        Proc_Unit unit;
+		if (decl->type == AST_PROC && (!g->only || g->only == decl) && BuildProc(g, decl, &unit)) 
+			arena_da_append(g->arena, &units, unit);
 	}
+
+    if (g->opts->opt_level >= 1)
+        PlaceProcs(units.items, units.count);
+    if (g->split)
+        GenSplit(g, units.items, units.count);
+    else
+	{
+        for (size_t i = 0; i < units.count; i++)
+            GenProc(g, &units.items[i]);
+    }
+
+    if (g->profile && g->counter_base != g->profile->count)
+        nob_log(NOB_WARNING, "The profile has %zu counters, the program %zu", g->profile->count, g->counter_base);
+    g->profile_hash = hash;
+    if (g->code && g->opts->instrument_path)
+	{
+        g->code->counters = g->counter_base;
+        g->code->profile_hash = hash;
+    }
+    if (g->opts->instrument_path && !g->code && !g->split)
+        GenProfileData(&g->sb, g->opts, hash, g->counter_base);
+}
+
+// fasm source for the whole program, appended to out
+bool GenerateAsm(AST_Node *ast, const Compile_Options *opts, Arena *arena, Nob_String_Builder *out)
+{
+    Generator g;
+    GenInit(&g, opts, arena);
+    g.sb = *out;
+    
+    GenProgram(&g, ast);
+    *out = g.sb;
+    return !g.had_err;
 }
 
-bool Generate(AST_Node *ast, const char *output_path, Arena *arena)
+// _start, _bounds_fail and the profile data
+static bool WriteRuntimeUnit(const Compile_Options *opts, uint64_t hash, size_t counters, const char *path)
 {
+    Nob_String_Builder sb = {0};
+    nob_sb_append_cstr(&sb, "format ELF64\n");
+    if (opts->instrument_path)
+        nob_sb_append_cstr(&sb, "PROFILE = 1\n");
+    nob_sb_append_cstr(&sb, "include 'runtime/macros.asm'\n");
+    nob_sb_append_cstr(&sb, "section '.text' executable\n");
+    nob_sb_append_cstr(&sb, "public _start\npublic _bounds_fail\nextrn func_main\n");
+    nob_sb_append_cstr(&sb, "include 'runtime/start.asm'\n");
+    if (opts->instrument_path)
+	{
+        nob_sb_append_cstr(&sb, "section '.data' writeable\npublic _profile_counters\n");
+        GenProfileData(&sb, opts, hash, counters);
+    }
+    bool ok = nob_write_entire_file(path, sb.items, sb.count);
+    nob_sb_free(sb);
+    return ok;
+}
 
+// The program is split into fasm objects, one per core at most, assembled
+// in parallel and linked by ld. ld keeps the order of its inputs, so the
+// program's layout stays what PlaceProcs chose. The units are written next
+// to the executable as <exe>.<n>.asm and <exe>.rt.asm
+bool Generate(AST_Node *ast, const char *exe, const Compile_Options *opts, Arena *arena)
+{
     Generator g;
-    GenInit(&g, arena);
+    GenInit(&g, opts, arena);
+    Asm_Split split = { .exe = exe, .jobs = (size_t)nob_nprocs() };
+    g.split = &split;
+    nob_cmd_append(&split.link, "ld", "-z", "noexecstack", "-o", exe);
     
     nob_log(NOB_INFO, "Generating assembly code...");
     GenProgram(&g, ast);
+    bool ok = !g.had_err && !split.failed;
     
-    nob_sb_append_null(&g.sb);
-    
-    nob_log(NOB_INFO, "Writing assembly to %s", output_path);
-    if (!nob_write_entire_file(output_path, g.sb.items, g.sb.count - 1)) 
+    const char *runtime_asm = arena_sprintf(arena, "%s.rt.asm", exe);
+    const char *runtime_obj = arena_sprintf(arena, "%s.rt.o", exe);
+    ok = ok && WriteRuntimeUnit(opts, g.profile_hash, g.counter_base, runtime_asm);
+    if (ok)
 	{
-        nob_log(NOB_ERROR, "Failed to write assembly file");
-        return false;
+        nob_log(NOB_INFO, "Assembling %zu units with FASM...", split.units + 1);
+        nob_cmd_append(&split.cmd, "fasm", runtime_asm, runtime_obj);
+        ok = nob_cmd_run(&split.cmd, .async = &split.running, .max_procs = split.jobs);
+        nob_cmd_append(&split.link, runtime_obj);
     }
-    
-    nob_log(NOB_INFO, "Compiling with FASM...");
-    Nob_Cmd cmd = {0};
-    nob_cmd_append(&cmd, "fasm", output_path);
-    
-    if (!nob_cmd_run(&cmd)) 
+    if (!nob_procs_flush(&split.running) || !ok)
 	{
         nob_log(NOB_ERROR, "FASM compilation failed");
-        return false;
+        ok = false;
     }
+    ok = ok && nob_cmd_run(&split.link);
+    
+    nob_cmd_free(split.cmd);
+    nob_cmd_free(split.link);
+    nob_sb_free(g.sb);
+    if (ok)
+        nob_log(NOB_INFO, "Compilation successful!");
+    return ok;
+}
+
+// Machine code instead of fasm text, only the instruction list backend can
+// encode so -O0 is always flat. only limits it to a single procedure
+bool GenerateCode(AST_Node *ast, const Compile_Options *opts, Arena *arena, X86_Code *code, AST_Node *only)
+{
+    Compile_Options code_opts = *opts;
+    code_opts.flat_asm = true;
     
-    nob_log(NOB_INFO, "Compilation successful!");
-    return true;
+    Generator g;
+    GenInit(&g, &code_opts, arena);
+    g.code = code;
+    g.only = only;
+    
+    if (!only)
+        nob_log(NOB_INFO, "Generating machine code...");
+    GenProgram(&g, ast);
+    nob_sb_free(g.sb);
+    return !g.had_err;
 }
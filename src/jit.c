@@ -0,0 +1,479 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+// In-process execution of the native backend: the program is encoded into a
+// buffer, linked against itself and mapped executable, then func_main is
+// called like any C function. There's no runtime/core.asm around it, so
+// _bounds_fail is a stub calling back into the compiler. A JIT session keeps
+// the code around and swaps single procedures for --watch
+
+static void JITBoundsFail(void)
+{
+    fputs("index out of bounds\n", stderr);
+    _exit(101);
+}
+
+// A failing check can sit anywhere in a frame, realign before the call
+static bool AddBoundsFail(X86_Code *code, Arena *arena)
+{
+    X86_Operand rax = { .kind = X86_OPND_REG, .reg = X86_RAX };
+    X86_Operand rsp = { .kind = X86_OPND_REG, .reg = X86_RSP };
+    X86_Inst insts[] = {
+        { .op = X86_LABEL, .dst = { .kind = X86_OPND_LABEL, .label = "_bounds_fail" } },
+        { .op = X86_AND, .dst = rsp, .src = { .kind = X86_OPND_IMM, .imm = -16 } },
+        { .op = X86_MOV, .dst = rax, .src = { .kind = X86_OPND_IMM, .imm = (int64_t)(uintptr_t)JITBoundsFail } },
+        { .op = X86_CALL, .dst = rax },
+    };
+    X86_List list = { .items = insts, .count = sizeof(insts) / sizeof(insts[0]) };
+    return X86Encode(code, &list, arena);
+}
+
+// Hardware counter of the calling thread, user space only. -1 where the
+// kernel doesn't allow it
+static int OpenCounter(uint64_t config)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t ReadCounter(int fd)
+{
+    uint64_t value;
+    return fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value) ? (int64_t)value : -1;
+}
+
+static void Measure(int64_t (*main_proc)(void), const int counters[2], JIT_Sample *sample)
+{
+    for (int i = 0; i < 2; i++)
+	{
+        if (counters[i] < 0)
+            continue;
+        ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t start = nob_nanos_since_unspecified_epoch();
+    uint64_t ticks = __rdtsc();
+    sample->result = main_proc();
+    sample->ticks = __rdtsc() - ticks;
+    sample->nanos = nob_nanos_since_unspecified_epoch() - start;
+    for (int i = 0; i < 2; i++)
+        if (counters[i] >= 0)
+            ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+    sample->cycles = ReadCounter(counters[0]);
+    sample->instructions = ReadCounter(counters[1]);
+}
+
+static size_t PageSize(void)
+	{ return (size_t)sysconf(_SC_PAGESIZE); }
+
+static size_t AlignUp(size_t value, size_t align)
+	{ return (value + align - 1) / align * align; }
+
+// perf names samples in JIT code after /tmp/perf-<pid>.map, one
+// "start size name" line per symbol. Reloaded code appends its lines
+static void WritePerfMap(X86_Code *code, uint8_t *base)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE *f = fopen(path, "a");
+    if (!f)
+	{
+        nob_log(NOB_WARNING, "Could not write %s: %s", path, strerror(errno));
+        return;
+    }
+    for (size_t i = 0; i < code->symbols.count; i++)
+	{
+        X86_Symbol *symbol = &code->symbols.items[i];
+        size_t size = X86SymbolSize(code, i);
+        if (size > 0)
+            fprintf(f, "%lx %zx %s\n", (unsigned long)(uintptr_t)(base + symbol->offset), size, symbol->name);
+    }
+    fclose(f);
+}
+
+// Code is written while the mapping is RW and only then flipped to RX, the
+// profile counters of instrumented code stay writable on the pages after it.
+// Measured runs wrap every call of main in the counters
+static bool Execute(X86_Code *code, size_t entry, JIT_Sample *samples, int runs, bool measure, uint64_t *counts, bool perf_map)
+{
+    size_t text = AlignUp(code->bytes.count, PageSize());
+    size_t size = text + AlignUp(code->counters * sizeof(uint64_t), PageSize());
+    uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+	{
+        nob_log(NOB_ERROR, "Could not map memory for the code: %s", strerror(errno));
+        return false;
+    }
+
+    memcpy(memory, code->bytes.items, code->bytes.count);
+    if (mprotect(memory, text, PROT_READ | PROT_EXEC) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not make the code executable: %s", strerror(errno));
+        munmap(memory, size);
+        return false;
+    }
+    if (perf_map)
+        WritePerfMap(code, memory);
+
+    int counters[2] = { -1, -1 };
+    if (measure)
+	{
+        counters[0] = OpenCounter(PERF_COUNT_HW_CPU_CYCLES);
+        counters[1] = OpenCounter(PERF_COUNT_HW_INSTRUCTIONS);
+        if (counters[0] < 0 || counters[1] < 0)
+            nob_log(NOB_WARNING, "Hardware counters are unavailable (%s), timing only", strerror(errno));
+    }
+
+    nob_log(NOB_INFO, "Running %zu bytes of machine code...", code->bytes.count);
+    int64_t (*main_proc)(void) = (int64_t (*)(void))(memory + entry);
+    for (int i = 0; i < runs; i++)
+	{
+        if (measure)
+            Measure(main_proc, counters, &samples[i]);
+        else
+            samples[i].result = main_proc();
+    }
+
+    for (int i = 0; i < 2; i++)
+        if (counters[i] >= 0)
+            close(counters[i]);
+    if (counts)
+        memcpy(counts, memory + text, code->counters * sizeof(uint64_t));
+    munmap(memory, size);
+    return true;
+}
+
+static bool CompileAndExecute(AST_Node *program, const Compile_Options *opts, Arena *arena, JIT_Sample *samples, int runs, bool measure)
+{
+    X86_Code code = {0};
+    bool ok = GenerateCode(program, opts, arena, &code, NULL) && AddBoundsFail(&code, arena);
+    if (ok && code.counters > 0)
+	{
+        X86_Symbol counters = { .name = "_profile_counters", .offset = AlignUp(code.bytes.count, PageSize()) };
+        nob_da_append(&code.symbols, counters);
+    }
+    ok = ok && X86Link(&code);
+
+    X86_Symbol *main_symbol = ok ? X86FindSymbol(&code, "func_main") : NULL;
+    if (ok && !main_symbol)
+	{
+        nob_log(NOB_ERROR, "There is no procedure 'main' to run");
+        ok = false;
+    }
+
+    uint64_t *counts = ok && opts->instrument_path ? calloc(code.counters + 1, sizeof(uint64_t)) : NULL;
+    ok = ok && Execute(&code, main_symbol->offset, samples, runs, measure, counts, opts->debug_info);
+    if (ok && counts)
+	{
+        ok = ProfileWrite(opts->instrument_path, code.profile_hash, counts, code.counters);
+        if (ok)
+            nob_log(NOB_INFO, "Wrote %zu block counts to %s", code.counters, opts->instrument_path);
+    }
+    free(counts);
+    X86CodeFree(&code);
+    return ok;
+}
+
+bool JITRunMain(AST_Node *program, const Compile_Options *opts, Arena *arena, int64_t *result)
+{
+    JIT_Sample sample = {0};
+    bool ok = CompileAndExecute(program, opts, arena, &sample, 1, false);
+    *result = sample.result;
+    return ok;
+}
+
+// Calls main runs times, each call timed on its own
+bool JITBenchMain(AST_Node *program, const Compile_Options *opts, Arena *arena, JIT_Sample *samples, int runs)
+	{ return CompileAndExecute(program, opts, arena, samples, runs, true); }
+
+static JIT_Proc* FindProc(JIT_Session *s, const char *name)
+{
+    for (size_t i = 0; i < s->procs.count; i++)
+        if (strcmp(s->procs.items[i].name, name) == 0)
+            return &s->procs.items[i];
+    return NULL;
+}
+
+// Slots are handed out in the order names are first seen, a callee can get
+// its slot before its code exists
+static bool SlotFor(JIT_Session *s, const char *name, size_t *slot)
+{
+    JIT_Proc *proc = FindProc(s, name);
+    if (!proc)
+	{
+        if (s->procs.count == JIT_MAX_PROCS)
+		{
+            nob_log(NOB_ERROR, "More than %d procedures in the JIT table", JIT_MAX_PROCS);
+            return false;
+        }
+        JIT_Proc new_proc = { .name = arena_strdup(&s->arena, name) };
+        nob_da_append(&s->procs, new_proc);
+        proc = &s->procs.items[s->procs.count - 1];
+    }
+    *slot = (size_t)(proc - s->procs.items);
+    return true;
+}
+
+// Code goes on fresh pages past everything that may be running, references
+// to procedures are bound to their thunks. Patching the slots comes last
+static bool Install(JIT_Session *s, X86_Code *code)
+{
+    size_t size = AlignUp(code->bytes.count, PageSize());
+    if (s->next + size > s->region + JIT_REGION_SIZE)
+	{
+        nob_log(NOB_ERROR, "The JIT code region is full");
+        return false;
+    }
+
+    uint8_t *chunk = s->next;
+    for (size_t i = 0; i < code->fixups.count; i++)
+	{
+        X86_Symbol *fixup = &code->fixups.items[i];
+        size_t slot;
+        if (!SlotFor(s, fixup->name, &slot))
+            return false;
+        int32_t rel = (int32_t)(s->thunks + slot * JIT_THUNK_SIZE - (chunk + fixup->offset + 4));
+        memcpy(&code->bytes.items[fixup->offset], &rel, sizeof(rel));
+    }
+
+    if (mprotect(chunk, size, PROT_READ | PROT_WRITE) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not map memory for the code: %s", strerror(errno));
+        return false;
+    }
+    memcpy(chunk, code->bytes.items, code->bytes.count);
+    if (mprotect(chunk, size, PROT_READ | PROT_EXEC) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not make the code executable: %s", strerror(errno));
+        return false;
+    }
+    s->next += size;
+    if (s->opts.debug_info)
+        WritePerfMap(code, chunk);
+
+    for (size_t i = 0; i < code->symbols.count; i++)
+	{
+        size_t slot;
+        if (!SlotFor(s, code->symbols.items[i].name, &slot))
+            return false;
+        __atomic_store_n(&s->table[slot], chunk + code->symbols.items[i].offset, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// The region starts with the slot table, then one thunk per slot, then the
+// code of every version ever loaded. Thunks are jmp [rip + disp32] into
+// their slot, written once up front
+bool JITSessionInit(JIT_Session *s, const Compile_Options *opts)
+{
+    *s = (JIT_Session){ .opts = *opts };
+    s->region = mmap(NULL, JIT_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s->region == MAP_FAILED)
+	{
+        nob_log(NOB_ERROR, "Could not reserve the JIT code region: %s", strerror(errno));
+        return false;
+    }
+
+    size_t table_size = AlignUp(JIT_MAX_PROCS * sizeof(void*), PageSize());
+    size_t thunks_size = AlignUp(JIT_MAX_PROCS * JIT_THUNK_SIZE, PageSize());
+    s->table = (void**)s->region;
+    s->thunks = s->region + table_size;
+    s->next = s->thunks + thunks_size;
+    if (mprotect(s->region, table_size + thunks_size, PROT_READ | PROT_WRITE) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not map memory for the JIT table: %s", strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < JIT_MAX_PROCS; i++)
+	{
+        uint8_t *thunk = s->thunks + i * JIT_THUNK_SIZE;
+        int32_t rel = (int32_t)((uint8_t*)&s->table[i] - (thunk + 6));
+        memcpy(thunk, (uint8_t[]){ 0xFF, 0x25 }, 2);
+        memcpy(thunk + 2, &rel, sizeof(rel));
+        memset(thunk + 6, 0xCC, JIT_THUNK_SIZE - 6);
+    }
+    if (mprotect(s->thunks, thunks_size, PROT_READ | PROT_EXEC) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not make the JIT thunks executable: %s", strerror(errno));
+        return false;
+    }
+
+    X86_Code code = {0};
+    bool ok = AddBoundsFail(&code, &s->arena) && Install(s, &code);
+    X86CodeFree(&code);
+    return ok;
+}
+
+static bool IsProgramProc(AST_Node *program, const char *symbol)
+{
+    for (size_t i = 0; i < program->children.used; i++)
+	{
+        AST_Node *decl = program->children.data[i];
+        if (decl->type == AST_PROC && strncmp(symbol, "func_", 5) == 0 && strcmp(decl->name, symbol + 5) == 0)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t CalleeHash(AST_Node *program, AST_Node *node, uint64_t hash)
+{
+    if (!node)
+        return hash;
+    if (node->type == AST_CALL && node->left && node->left->type == AST_ID)
+	{
+        for (size_t i = 0; i < program->children.used; i++)
+		{
+            AST_Node *decl = program->children.data[i];
+            if (decl->type != AST_PROC || strcmp(decl->name, node->left->name) != 0)
+                continue;
+            for (size_t p = 0; p < decl->children.used; p++)
+                hash = ASTHash(decl->children.data[p], hash);
+        }
+    }
+    hash = CalleeHash(program, node->left, hash);
+    hash = CalleeHash(program, node->right, hash);
+    hash = CalleeHash(program, node->body, hash);
+    for (size_t i = 0; i < node->children.used; i++)
+        hash = CalleeHash(program, node->children.data[i], hash);
+    return hash;
+}
+
+// Besides its own AST a procedure's code depends on the struct layouts and
+// on the parameters of what it calls, argument passing follows them
+static uint64_t ProcHash(AST_Node *program, AST_Node *proc)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < program->children.used; i++)
+        if (program->children.data[i]->type == AST_STRUCT)
+            hash = ASTHash(program->children.data[i], hash);
+    return CalleeHash(program, proc->body, ASTHash(proc, hash));
+}
+
+// Generates the procedures whose hash changed and swaps them in. Nothing
+// goes live unless all of them compiled and linked
+bool JITSessionLoad(JIT_Session *s, AST_Node *program, Arena *arena)
+{
+    X86_Code code = {0};
+    struct {
+        JIT_Proc *items;
+        size_t count, capacity;
+    } changed = {0};
+
+    bool ok = true;
+    for (size_t i = 0; i < program->children.used; i++)
+	{
+        AST_Node *decl = program->children.data[i];
+        if (decl->type != AST_PROC)
+            continue;
+        JIT_Proc proc = { .name = arena_sprintf(arena, "func_%s", decl->name), .hash = ProcHash(program, decl) };
+        JIT_Proc *loaded = FindProc(s, proc.name);
+        if (loaded && loaded->hash == proc.hash)
+            continue;
+        ok &= GenerateCode(program, &s->opts, arena, &code, decl);
+        nob_da_append(&changed, proc);
+    }
+
+    for (size_t i = 0; i < code.fixups.count && ok; i++)
+	{
+        const char *name = code.fixups.items[i].name;
+        if (strcmp(name, "_bounds_fail") != 0 && !IsProgramProc(program, name))
+		{
+            nob_log(NOB_ERROR, "Undefined symbol '%s'", name);
+            ok = false;
+        }
+    }
+
+    if (ok && changed.count > 0)
+	{
+        ok = Install(s, &code);
+        for (size_t i = 0; i < changed.count && ok; i++)
+            FindProc(s, changed.items[i].name)->hash = changed.items[i].hash;
+        if (ok)
+            nob_log(NOB_INFO, "Loaded %zu procedure(s), %zu bytes", changed.count, code.bytes.count);
+    }
+    nob_da_free(changed);
+    X86CodeFree(&code);
+    return ok;
+}
+
+// main is entered through its thunk as well, a rerun picks up its newest version
+static void* RunMain(void *data)
+{
+    JIT_Session *s = data;
+    int64_t (*main_proc)(void) = (int64_t (*)(void))(s->thunks + s->main_slot * JIT_THUNK_SIZE);
+    s->result = main_proc();
+    __atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Runs main on its own thread unless it's still running. If it has returned
+// but wasn't polled yet, the rerun happens once the result is collected
+bool JITSessionStart(JIT_Session *s)
+{
+    if (s->running)
+	{
+        if (__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+            s->rerun = true;
+        return true;
+    }
+    JIT_Proc *main_proc = FindProc(s, "func_main");
+    if (!main_proc || !s->table[main_proc - s->procs.items])
+	{
+        nob_log(NOB_ERROR, "There is no procedure 'main' to run");
+        return false;
+    }
+
+    // Reloads append to procs while main runs, the slot is looked up here
+    s->main_slot = (size_t)(main_proc - s->procs.items);
+    s->done = false;
+    s->rerun = false;
+    if (pthread_create(&s->thread, NULL, RunMain, s) != 0)
+	{
+        nob_log(NOB_ERROR, "Could not start a thread for main");
+        return false;
+    }
+    s->running = true;
+    return true;
+}
+
+// True once when main has returned, with its result. A load that landed
+// after main returned starts it again from here
+bool JITSessionPoll(JIT_Session *s, int64_t *result)
+{
+    if (!s->running || !__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+        return false;
+    pthread_join(s->thread, NULL);
+    s->running = false;
+    *result = s->result;
+    if (s->rerun)
+        JITSessionStart(s);
+    return true;
+}
+
+void JITSessionFree(JIT_Session *s)
+{
+    if (s->running)
+        pthread_join(s->thread, NULL);
+    munmap(s->region, JIT_REGION_SIZE);
+    nob_da_free(s->procs);
+    arena_free(&s->arena);
+}
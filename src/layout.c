@@ -0,0 +1,184 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <string.h>
+
+// Struct layout: every field sits at a multiple of its natural alignment,
+// the struct aligns to its strictest field and its size is padded to a
+// multiple of that so arrays of it stay aligned. Arrays of #soa structs are
+// split into one array per field instead, each starting on a 16 byte
+// boundary so the vectorizer can stream them
+
+static const struct {
+    const char *name;
+    size_t size;
+} builtin_types[] = {
+    { "int", 8 },
+    { "s64", 8 },
+    { "u64", 8 },
+    { "u32", 4 },
+    { "u16", 2 },
+    { "u8",  1 },
+};
+
+static size_t AlignUp(size_t value, size_t align)
+	{ return (value + align - 1) & ~(align - 1); }
+
+void LayoutInit(Type_Table *types, Arena *arena)
+{
+    types->count = 0;
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++)
+	{
+        TypeInfo info = {
+            .name = builtin_types[i].name,
+            .size = builtin_types[i].size,
+            .align = builtin_types[i].size,
+        };
+        arena_da_append(arena, types, info);
+    }
+}
+
+TypeInfo* LayoutFindType(const Type_Table *types, const char *name)
+{
+    for (size_t i = 0; i < types->count; i++)
+        if (strcmp(types->items[i].name, name) == 0)
+            return &types->items[i];
+    return NULL;
+}
+
+Field_Info* LayoutFindField(const TypeInfo *type, const char *name)
+{
+    for (size_t i = 0; i < type->fields.count; i++)
+        if (strcmp(type->fields.items[i].name, name) == 0)
+            return &type->fields.items[i];
+    return NULL;
+}
+
+// With power of two alignments, strictest first leaves no padding between
+// fields. Stable, so equally aligned fields keep their declaration order
+static void ReorderFields(AST_Node **fields, TypeInfo **types, size_t count)
+{
+    for (size_t i = 1; i < count; i++)
+	{
+        AST_Node *field = fields[i];
+        TypeInfo *type = types[i];
+        size_t j = i;
+        for (; j > 0 && types[j - 1]->align < type->align; j--)
+		{
+            fields[j] = fields[j - 1];
+            types[j] = types[j - 1];
+        }
+        fields[j] = field;
+        types[j] = type;
+    }
+}
+
+bool LayoutStruct(Type_Table *types, AST_Node *node, Arena *arena)
+{
+    if (!node->name)
+	{
+        nob_log(NOB_ERROR, "Struct missing name");
+        return false;
+    }
+    if (LayoutFindType(types, node->name))
+	{
+        nob_log(NOB_ERROR, "Type '%s' is already defined", node->name);
+        return false;
+    }
+
+    size_t count = node->children.used;
+    AST_Node **fields = arena_alloc(arena, (count + 1) * sizeof(AST_Node*));
+    TypeInfo **field_types = arena_alloc(arena, (count + 1) * sizeof(TypeInfo*));
+    for (size_t i = 0; i < count; i++)
+	{
+        AST_Node *field = node->children.data[i];
+        if (!field->right || !field->right->name)
+		{
+            nob_log(NOB_ERROR, "%s.%s: field has no type", node->name, field->name);
+            return false;
+        }
+        // Fields can only use types declared before the struct
+        field_types[i] = LayoutFindType(types, field->right->name);
+        if (!field_types[i])
+		{
+            nob_log(NOB_ERROR, "%s.%s: unknown type '%s'", node->name, field->name, field->right->name);
+            return false;
+        }
+        for (size_t j = 0; j < i; j++)
+		{
+            if (strcmp(fields[j]->name, field->name) == 0)
+			{
+                nob_log(NOB_ERROR, "%s: duplicate field '%s'", node->name, field->name);
+                return false;
+            }
+        }
+        fields[i] = field;
+    }
+
+    if (node->flags & AST_FLAG_REORDER)
+        ReorderFields(fields, field_types, count);
+
+    TypeInfo info = { .name = node->name, .align = 1, .soa = (node->flags & AST_FLAG_SOA) != 0 };
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++)
+	{
+        offset = AlignUp(offset, field_types[i]->align);
+        Field_Info field = {
+            .name = fields[i]->name,
+            .type = field_types[i]->name,
+            .offset = offset,
+            .size = field_types[i]->size,
+        };
+        arena_da_append(arena, &info.fields, field);
+
+        offset += field_types[i]->size;
+        if (field_types[i]->align > info.align)
+            info.align = field_types[i]->align;
+    }
+    info.size = AlignUp(offset, info.align);
+
+    arena_da_append(arena, types, info);
+    return true;
+}
+
+size_t LayoutArrayField(const TypeInfo *type, const Field_Info *field, size_t length)
+{
+    if (!type->soa)
+        return field->offset;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < type->fields.count && &type->fields.items[i] != field; i++)
+        offset = AlignUp(offset + type->fields.items[i].size * length, 16);
+    return offset;
+}
+
+size_t LayoutArraySize(const TypeInfo *type, size_t length)
+{
+    if (!type->soa || type->fields.count == 0)
+        return type->size * length;
+
+    Field_Info *last = &type->fields.items[type->fields.count - 1];
+    return LayoutArrayField(type, last, length) + last->size * length;
+}
+
+// Argument positions are qword sized, a slice takes two
+int LayoutParamWords(AST_Node *param)
+{
+    AST_Node *type = param->right;
+    return type && type->type == AST_TYPE && (type->flags & AST_FLAG_SLICE) ? 2 : 1;
+}
+
+// System V passes a slice as two INTEGER eightbytes, when both don't fit the
+// remaining registers the whole argument goes to the stack while later
+// scalars may still take a register. Positions from ARG_REG_COUNT up are
+// stack slots
+int LayoutArgPosition(int *regs, int *stack, int words)
+{
+    if (*regs + words <= ARG_REG_COUNT)
+	{
+        *regs += words;
+        return *regs - words;
+    }
+    *stack += words;
+    return ARG_REG_COUNT + *stack - words;
+}
@@ -273,6 +273,13 @@ Token LexerNextToken(Lexer* lexer)
     
     if (c == '"')
         return LexerScanStr(lexer);
+
+	if (c == '#' && IsAlpha(LexerPeek(lexer)))
+	{
+		Token token = LexerScanIds(lexer);
+		token.type = TOKEN_DIRECTIVE;
+		return token;
+	}
     
     switch (c) 
 	{
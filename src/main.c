@@ -2,26 +2,31 @@
 #define NOB_IMPLEMENTATION
 #include <cmpl.h>
 
-void CompileJaiFile(const char *src, const char *out, Arena *arena)
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char* ReadJaiFile(const char *src, Arena *arena, size_t *size)
 {
-    printf("=== Compiling %s ===\n", src);
-    
     FILE *f = fopen(src, "r");
     if (!f) 
 	{
         fprintf(stderr, "Error: Could not open file %s\n", src);
-        return;
+        return NULL;
     }
     
     fseek(f, 0, SEEK_END);
-    long size = ftell(f);
+    *size = ftell(f);
     fseek(f, 0, SEEK_SET);
     
-    char *source = (char*)arena_alloc(arena, size + 1);
-    fread(source, 1, size, f);
-    source[size] = '\0';
+    char *source = (char*)arena_alloc(arena, *size + 1);
+    *size = fread(source, 1, *size, f);
+    source[*size] = '\0';
     fclose(f);
-    
+    return source;
+}
+
+static AST_Node* ParseSource(const char *source, Arena *arena)
+{
     Lexer *lexer = LexerCreate(source, arena);
     Parser *parser = ParserCreate(lexer, arena);
     AST_Node *ast = ParserParseProgram(parser);
@@ -29,12 +34,36 @@ void CompileJaiFile(const char *src, const char *out, Arena *arena)
     if (ParserHadError(parser)) 
 	{
         printf("Parser encountered errors!\n");
-        return;
+        return NULL;
     }
     
     if (!ast) 
 	{
         printf("Failed to parse program!\n");
+        return NULL;
+    }
+    return ast;
+}
+
+static AST_Node* ParseJaiFile(const char *src, Arena *arena)
+{
+    size_t size;
+    char *source = ReadJaiFile(src, arena, &size);
+    return source ? ParseSource(source, arena) : NULL;
+}
+
+void CompileJaiFile(const char *src, const char *out, const Compile_Options *opts, Arena *arena)
+{
+    printf("=== Compiling %s ===\n", src);
+    
+    AST_Node *ast = ParseJaiFile(src, arena);
+    if (!ast)
+        return;
+    
+    // Constants and #run directives leave plain numbers behind
+    if (!VMRunDirectives(ast, arena)) 
+	{
+        fprintf(stderr, "Compile-time execution failed!\n");
         return;
     }
     
@@ -42,22 +71,186 @@ void CompileJaiFile(const char *src, const char *out, Arena *arena)
     printf("\n=== AST ===\n");
     ASTPrintProgram(ast);
     
-    // Generate assembly
+    // -g writes the executable itself, with symbols and line info
     printf("\n=== Code Generation ===\n");
-    char asm_file[4096];
-    snprintf(asm_file, sizeof(asm_file), "%s.asm", out);
-    
-    if (!Generate(ast, asm_file, arena)) 
+    if (opts->debug_info)
+	{
+        if (!GenerateElf(ast, src, out, opts, arena))
+		{
+            fprintf(stderr, "Code generation failed!\n");
+            return;
+        }
+        printf("\n=== Success! ===\n");
+        printf("Executable: %s\n", out);
+        return;
+    }
+
+    // Generate assembly
+    if (!Generate(ast, out, opts, arena)) 
 	{
         fprintf(stderr, "Code generation failed!\n");
         return;
     }
     
     printf("\n=== Success! ===\n");
-    printf("Generated: %s\n", asm_file);
+    printf("Generated: %s.*.asm\n", out);
     printf("Executable: %s\n", out);
 }
 
+// -c writes a relocatable object instead of an executable, for the system
+// linker to combine with C code or other modules
+int ObjectJaiFile(const char *src, const char *out, const Compile_Options *opts, Arena *arena)
+{
+    AST_Node *ast = ParseJaiFile(src, arena);
+    if (!ast || !VMRunDirectives(ast, arena) || !GenerateObject(ast, src, out, opts, arena)) 
+	{
+        fprintf(stderr, "Compilation failed!\n");
+        return 1;
+    }
+    printf("Object: %s\n", out);
+    return 0;
+}
+
+static size_t CountNodes(AST_Node *node)
+{
+    if (!node)
+        return 0;
+    size_t count = 1 + CountNodes(node->left) + CountNodes(node->right) + CountNodes(node->body);
+    for (size_t i = 0; i < node->children.used; i++)
+        count += CountNodes(node->children.data[i]);
+    return count;
+}
+
+static void PrintPhase(const char *phase, uint64_t start, size_t count)
+{
+    double seconds = (double)(nob_nanos_since_unspecified_epoch() - start) / NOB_NANOS_PER_SEC;
+    printf("phase %s %.6f %zu\n", phase, seconds, count);
+}
+
+// --stats times each phase of a build in-process and prints it as
+// "phase <name> <seconds> <count>", the format ./nob bench-compiler reads.
+// Counts are bytes, tokens, AST nodes, fasm source bytes and machine code
+// bytes. Both backends start over from the AST, fasm isn't run
+int StatsJaiFile(const char *src, const Compile_Options *opts, Arena *arena)
+{
+    uint64_t start = nob_nanos_since_unspecified_epoch();
+    size_t size;
+    char *source = ReadJaiFile(src, arena, &size);
+    if (!source)
+        return 1;
+    PrintPhase("read", start, size);
+    
+    start = nob_nanos_since_unspecified_epoch();
+    Lexer *lexer = LexerCreate(source, arena);
+    size_t tokens = 0;
+    while (LexerNextToken(lexer).type != TOKEN_EOF)
+        tokens++;
+    PrintPhase("lex", start, tokens);
+    
+    start = nob_nanos_since_unspecified_epoch();
+    AST_Node *ast = ParseSource(source, arena);
+    if (!ast)
+        return 1;
+    PrintPhase("parse", start, CountNodes(ast));
+    
+    start = nob_nanos_since_unspecified_epoch();
+    if (!VMRunDirectives(ast, arena))
+        return 1;
+    PrintPhase("run", start, 0);
+    
+    start = nob_nanos_since_unspecified_epoch();
+    Nob_String_Builder sb = {0};
+    bool ok = GenerateAsm(ast, opts, arena, &sb);
+    PrintPhase("asm", start, sb.count);
+    nob_sb_free(sb);
+    
+    start = nob_nanos_since_unspecified_epoch();
+    X86_Code code = {0};
+    ok = ok && GenerateCode(ast, opts, arena, &code, NULL);
+    PrintPhase("code", start, code.bytes.count);
+    X86CodeFree(&code);
+    return ok ? 0 : 1;
+}
+
+// --run skips fasm entirely, main executes in the bytecode VM and its result
+// becomes the exit status the same way _start hands it to exit. --jit runs
+// the native code in-process instead
+int RunJaiFile(const char *src, const Compile_Options *opts, bool jit, Arena *arena)
+{
+    AST_Node *ast = ParseJaiFile(src, arena);
+    if (!ast)
+        return 1;
+    
+    int64_t result;
+    bool ok = jit ? VMRunDirectives(ast, arena) && JITRunMain(ast, opts, arena, &result) : 
+                    VMRunMain(ast, opts, arena, &result);
+    if (!ok) 
+	{
+        fprintf(stderr, "Execution failed!\n");
+        return 1;
+    }
+    
+    printf("main returned %ld\n", result);
+    return (int)(result & 0xff);
+}
+
+// --bench N calls main N times in the JIT and prints each call as
+// "sample <result> <nanos> <ticks> <cycles> <instructions>" for ./nob bench
+int BenchJaiFile(const char *src, const Compile_Options *opts, int runs, Arena *arena)
+{
+    AST_Node *ast = ParseJaiFile(src, arena);
+    if (!ast || !VMRunDirectives(ast, arena))
+        return 1;
+    
+    JIT_Sample *samples = arena_alloc(arena, runs * sizeof(JIT_Sample));
+    if (!JITBenchMain(ast, opts, arena, samples, runs)) 
+	{
+        fprintf(stderr, "Execution failed!\n");
+        return 1;
+    }
+    
+    for (int i = 0; i < runs; i++)
+        printf("sample %ld %lu %lu %ld %ld\n", samples[i].result, samples[i].nanos, samples[i].ticks, 
+               samples[i].cycles, samples[i].instructions);
+    return 0;
+}
+
+// --watch keeps a JIT session alive. main runs on its own thread, whenever
+// the file changes the procedures that changed are swapped in under it, and
+// main runs again if it had already returned
+int WatchJaiFile(const char *src, const Compile_Options *opts)
+{
+    JIT_Session session;
+    if (!JITSessionInit(&session, opts))
+        return 1;
+    
+    struct timespec seen = {0};
+    while (true) 
+	{
+        // Collect a finished run first so an edit that follows it reruns main
+        int64_t result;
+        if (JITSessionPoll(&session, &result)) 
+		{
+            printf("main returned %ld\n", result);
+            fflush(stdout);
+        }
+
+        struct stat st;
+        if (stat(src, &st) == 0 && (st.st_mtim.tv_sec != seen.tv_sec || st.st_mtim.tv_nsec != seen.tv_nsec)) 
+		{
+            seen = st.st_mtim;
+            Arena arena = {0};
+            AST_Node *ast = ParseJaiFile(src, &arena);
+            if (ast && VMRunDirectives(ast, &arena) && JITSessionLoad(&session, ast, &arena))
+                JITSessionStart(&session);
+            else
+                fprintf(stderr, "Reload failed, keeping the running version\n");
+            arena_free(&arena);
+        }
+        usleep(100 * 1000);
+    }
+}
+
 int main(int argc, char **argv) 
 {
     Arena arena = {0};
@@ -78,10 +271,106 @@ int main(int argc, char **argv)
     } 
 	else 
 	{
-        const char *input_file = argv[1];
-        const char *out = argc > 2 ? argv[2] : "out/out";
+        // Bounds checks stay on unless asked otherwise, -O1 and up remove
+        // the ones range loops make redundant
+        Compile_Options opts = { .opt_level = 0, .bounds_check = true };
+        const char *input_file = NULL;
+        const char *out = NULL;
+        bool run = false, jit = false, watch = false, stats = false, instrument = false, object = false;
+        const char *profile_path = NULL;
+        int bench_runs = 0;
+        
+        for (int i = 1; i < argc; i++) 
+		{
+            if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '2' && !argv[i][3])
+                opts.opt_level = argv[i][2] - '0';
+            else if (strcmp(argv[i], "--run") == 0)
+                run = true;
+            else if (strcmp(argv[i], "--jit") == 0)
+                jit = true;
+            else if (strcmp(argv[i], "--watch") == 0)
+                watch = true;
+            else if (strcmp(argv[i], "--stats") == 0)
+                stats = true;
+            else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+                bench_runs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--instrument") == 0)
+                instrument = true;
+            else if (strcmp(argv[i], "--profile-use") == 0 && i + 1 < argc)
+                profile_path = argv[++i];
+            else if (strcmp(argv[i], "-c") == 0)
+                object = true;
+            else if (strcmp(argv[i], "-g") == 0)
+                opts.debug_info = true;
+            else if (strcmp(argv[i], "-fflat-asm") == 0)
+                opts.flat_asm = true;
+            else if (strcmp(argv[i], "-mavx2") == 0)
+                opts.avx2 = true;
+            else if (strcmp(argv[i], "-fbounds-check") == 0 || strcmp(argv[i], "-fno-bounds-check") == 0)
+                opts.bounds_check = argv[i][2] == 'b';
+            else if (argv[i][0] == '-') 
+			{
+                fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+                return 1;
+            }
+            else if (!input_file)
+                input_file = argv[i];
+            else
+                out = argv[i];
+        }
+        if (!out)
+            out = object ? "out/out.o" : "out/out";
+        
+        if (!input_file) 
+		{
+            fprintf(stderr, "Usage: %s [-O0|-O1|-O2] [-c] [-g] [-mavx2] [-fno-bounds-check] [-fflat-asm] [--instrument] [--profile-use file] [--run|--jit|--watch|--stats|--bench N] <file.jai> [out]\n", argv[0]);
+            return 1;
+        }
+        
+        // Instrumented programs write out.profile when they exit, the
+        // bytecode VM and hot reloading don't count blocks, objects have
+        // no exit of their own
+        if (instrument)
+		{
+            if (run || watch || object)
+			{
+                fprintf(stderr, "Error: --instrument needs a native executable\n");
+                return 1;
+            }
+            opts.instrument_path = arena_sprintf(&arena, "%s.profile", out);
+        }
+        Profile profile = {0};
+        if (profile_path)
+		{
+            if (!ProfileLoad(&profile, profile_path))
+                return 1;
+            opts.profile = &profile;
+        }
         
-        CompileJaiFile(input_file, out, &arena);
+        if (watch)
+            return WatchJaiFile(input_file, &opts);
+        if (stats || bench_runs) 
+		{
+            int status = stats ? StatsJaiFile(input_file, &opts, &arena) : 
+                                 BenchJaiFile(input_file, &opts, bench_runs, &arena);
+            arena_free(&arena);
+            return status;
+        }
+        if (run || jit) 
+		{
+            int status = RunJaiFile(input_file, &opts, jit, &arena);
+            arena_free(&arena);
+            return status;
+        }
+        if (object) 
+		{
+            int status = ObjectJaiFile(input_file, out, &opts, &arena);
+            free(profile.counts);
+            arena_free(&arena);
+            return status;
+        }
+        CompileJaiFile(input_file, out, &opts, &arena);
+        free(profile.counts);
     }
     
     arena_free(&arena);
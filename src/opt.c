@@ -0,0 +1,631 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE SIZE_MAX
+
+typedef struct {
+    const char *name;
+    int count;
+} Def_Count;
+
+typedef struct {
+    TAC_Builder tb;
+    int base_temps;
+    int *temp_defs;
+    struct {
+        Def_Count *items;
+        size_t count, capacity;
+    } loop_defs;
+} Loop_Opt;
+
+static bool IsConst(const char *s)
+	{ return s && ((s[0] >= '0' && s[0] <= '9') || s[0] == '-'); }
+
+static bool IsTemp(const char *s)
+	{ return s && s[0] == '_' && s[1] == 't'; }
+
+static const char* InstDef(TAC_Inst *inst)
+{
+    switch (inst->type)
+	{
+        case TAC_BINOP:
+        case TAC_COPY:
+        case TAC_CALL:
+        case TAC_LOAD:
+        case TAC_LOAD_FIELD:
+        case TAC_ADDR:
+            return inst->dest;
+        case TAC_DEC_JUMP_NZ:
+            return inst->src1;
+        default:
+            return NULL;
+    }
+}
+
+static Def_Count* FindLoopDef(Loop_Opt *lo, const char *name)
+{
+    for (size_t i = 0; i < lo->loop_defs.count; i++)
+        if (strcmp(lo->loop_defs.items[i].name, name) == 0)
+            return &lo->loop_defs.items[i];
+    return NULL;
+}
+
+// Unary ops have no left operand, a missing operand never changes
+static bool IsInvariant(Loop_Opt *lo, const char *operand)
+{
+    if (!operand || IsConst(operand))
+        return true;
+    Def_Count *def = FindLoopDef(lo, operand);
+    return !def || def->count == 0;
+}
+
+static TAC_Inst NewInst(Loop_Opt *lo, TAC_Op type, char *dest, char *src1, const char *op, char *src2)
+{
+    TAC_Inst inst = {0};
+    inst.type = type;
+    inst.dest = dest;
+    inst.src1 = src1;
+    inst.src2 = src2;
+    inst.op = op ? arena_strdup(lo->tb.arena, op) : NULL;
+    return inst;
+}
+
+static char* NewTemp(Loop_Opt *lo)
+	{ return arena_sprintf(lo->tb.arena, "_t%d", lo->tb.temp_count++); }
+
+static void CountLoopDefs(Loop_Opt *lo, CFG *cfg, Natural_Loop *loop)
+{
+    lo->loop_defs.count = 0;
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        if (!loop->blocks[b])
+            continue;
+        for (size_t i = cfg->items[b].begin; i < cfg->items[b].end; i++)
+		{
+            const char *def = InstDef(&cfg->tac->items[i]);
+            if (def)
+			{
+                Def_Count *entry = FindLoopDef(lo, def);
+                if (entry)
+                    entry->count++;
+                else
+				{
+                    Def_Count fresh = { .name = def, .count = 1 };
+                    nob_da_append(&lo->loop_defs, fresh);
+                }
+            }
+        }
+    }
+}
+
+// A preheader exists when every entry into the header falls through from the
+// block laid out right before it. While loops are lowered that way, returns
+// the index to insert before, NONE if the loop doesn't qualify
+static size_t FindPreheader(CFG *cfg, Natural_Loop *loop)
+{
+    size_t h = loop->header;
+    if (h == 0)
+        return NONE;
+
+    TAC_Inst *before = &cfg->tac->items[cfg->items[h - 1].end - 1];
+    if (loop->blocks[h - 1] || before->type == TAC_JUMP || before->type == TAC_RETURN ||
+        before->type == TAC_TAIL_CALL)
+        return NONE;
+
+    Basic_Block *header = &cfg->items[h];
+    for (size_t i = 0; i < header->preds.count; i++)
+	{
+        size_t p = header->preds.items[i];
+        if (!loop->blocks[p] && p != h - 1)
+            return NONE;
+    }
+    return cfg->items[h - 1].end;
+}
+
+static Natural_Loop* LoopByHeader(CFG *cfg, const char *label)
+{
+    for (size_t l = 0; l < cfg->loops.count; l++)
+	{
+        TAC_Inst *head = &cfg->tac->items[cfg->items[cfg->loops.items[l].header].begin];
+        if (head->type == TAC_LABEL && strcmp(head->dest, label) == 0)
+            return &cfg->loops.items[l];
+    }
+    return NULL;
+}
+
+static bool IsHoistable(Loop_Opt *lo, TAC_Inst *inst)
+{
+    if (inst->type != TAC_BINOP && inst->type != TAC_COPY)
+        return false;
+
+    // Only single-definition temps can move, their uses all follow the def
+    if (!IsTemp(inst->dest))
+        return false;
+    int idx = atoi(inst->dest + 2);
+    if (idx >= lo->base_temps || lo->temp_defs[idx] != 1)
+        return false;
+
+    // Division can trap, it must not run on iterations that never happen
+    if (inst->type == TAC_BINOP &&
+        (strcmp(inst->op, "/") == 0 || strcmp(inst->op, "%") == 0))
+        return false;
+
+    return IsInvariant(lo, inst->src1) &&
+           (inst->type == TAC_COPY || IsInvariant(lo, inst->src2));
+}
+
+static bool HoistInvariants(Loop_Opt *lo, TAC_List *tac, CFG *cfg, Natural_Loop *loop)
+{
+    size_t preheader = FindPreheader(cfg, loop);
+    if (preheader == NONE)
+        return false;
+
+    CountLoopDefs(lo, cfg, loop);
+
+    TAC_Edit edit;
+    TACEditInit(&edit, tac);
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        if (!loop->blocks[b])
+            continue;
+        for (size_t i = cfg->items[b].begin; i < cfg->items[b].end; i++)
+		{
+            TAC_Inst *inst = &tac->items[i];
+            if (!IsHoistable(lo, inst))
+                continue;
+            TACEditDrop(&edit, i);
+            TACEditInsert(&edit, preheader, *inst);
+
+            // Dependent instructions later in the loop become invariant too
+            FindLoopDef(lo, inst->dest)->count--;
+        }
+    }
+
+    bool hoisted = edit.inserts.count > 0;
+    TACEditApply(&edit, tac, lo->tb.arena);
+    return hoisted;
+}
+
+// Basic induction variable: a named variable whose only definition in the
+// loop is i = t with t = i +/- step, step invariant. Every t' = i * k with k
+// invariant becomes a copy of a new variable s kept equal to i * k by adding
+// step * k right after each update of i
+static void ReduceInductionVars(Loop_Opt *lo, TAC_List *tac, CFG *cfg, Natural_Loop *loop)
+{
+    size_t preheader = FindPreheader(cfg, loop);
+    if (preheader == NONE)
+        return;
+
+    CountLoopDefs(lo, cfg, loop);
+
+    TAC_Edit edit;
+    TACEditInit(&edit, tac);
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        if (!loop->blocks[b])
+            continue;
+        for (size_t u = cfg->items[b].begin; u < cfg->items[b].end; u++)
+		{
+            TAC_Inst *update = &tac->items[u];
+            if (update->type == TAC_COPY && !IsTemp(update->dest) && IsTemp(update->src1) &&
+                FindLoopDef(lo, update->dest)->count == 1)
+			{
+                const char *iv = update->dest;
+
+                // The temp feeding the copy is defined earlier in the same loop
+                TAC_Inst *step_def = NULL;
+                for (size_t sb = 0; sb < cfg->count && !step_def; sb++)
+				{
+                    if (!loop->blocks[sb])
+                        continue;
+                    for (size_t i = cfg->items[sb].begin; i < cfg->items[sb].end && !step_def; i++)
+					{
+                        TAC_Inst *inst = &tac->items[i];
+                        if (inst->type == TAC_BINOP && strcmp(inst->dest, update->src1) == 0)
+                            step_def = inst;
+                    }
+                }
+
+                char *step = NULL;
+                bool negative = false;
+                if (step_def && !step_def->src1)
+                    step = NULL;
+                else if (step_def && strcmp(step_def->op, "+") == 0)
+				{
+                    if (strcmp(step_def->src1, iv) == 0 && IsInvariant(lo, step_def->src2))
+                        step = step_def->src2;
+                    else if (strcmp(step_def->src2, iv) == 0 && IsInvariant(lo, step_def->src1))
+                        step = step_def->src1;
+                }
+                else if (step_def && strcmp(step_def->op, "-") == 0 &&
+                         strcmp(step_def->src1, iv) == 0 && IsInvariant(lo, step_def->src2))
+				{
+                    step = step_def->src2;
+                    negative = true;
+                }
+
+                if (step)
+				{
+                    for (size_t db = 0; db < cfg->count; db++)
+					{
+                        if (!loop->blocks[db])
+                            continue;
+                        for (size_t m = cfg->items[db].begin; m < cfg->items[db].end; m++)
+						{
+                            TAC_Inst *mul = &tac->items[m];
+                            char *factor = NULL;
+                            if (mul->type == TAC_BINOP && strcmp(mul->op, "*") == 0 && IsTemp(mul->dest))
+							{
+                                if (strcmp(mul->src1, iv) == 0 && IsInvariant(lo, mul->src2))
+                                    factor = mul->src2;
+                                else if (strcmp(mul->src2, iv) == 0 && IsInvariant(lo, mul->src1))
+                                    factor = mul->src1;
+                            }
+
+                            if (factor)
+							{
+                                char *scaled = NewTemp(lo);
+                                char *inc;
+                                TACEditInsert(&edit, preheader, NewInst(lo, TAC_BINOP, scaled, (char*)iv, "*", factor));
+
+                                if (IsConst(step) && IsConst(factor))
+                                    inc = arena_sprintf(lo->tb.arena, "%lld",
+                                                        strtoll(step, NULL, 10) * strtoll(factor, NULL, 10));
+                                else
+								{
+                                    inc = NewTemp(lo);
+                                    TACEditInsert(&edit, preheader, NewInst(lo, TAC_BINOP, inc, factor, "*", step));
+                                }
+
+                                TACEditInsert(&edit, u + 1, NewInst(lo, TAC_BINOP, scaled, scaled, negative ? "-" : "+", inc));
+
+                                mul->type = TAC_COPY;
+                                mul->src1 = scaled;
+                                mul->src2 = NULL;
+                                mul->op = NULL;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    TACEditApply(&edit, tac, lo->tb.arena);
+}
+
+static int CompareLoopSize(const void *a, const void *b)
+{
+    const Natural_Loop *la = a, *lb = b;
+    return (la->size > lb->size) - (la->size < lb->size);
+}
+
+void OptimizeLoops(TAC_List *tac, Arena *arena)
+{
+    CFG cfg;
+    CFGBuild(&cfg, tac);
+    CFGFindLoops(&cfg);
+
+    if (cfg.loops.count == 0)
+	{
+        CFGFree(&cfg);
+        return;
+    }
+
+    // Inner loops first so their hoisted code gets another chance in the outer ones
+    qsort(cfg.loops.items, cfg.loops.count, sizeof(Natural_Loop), CompareLoopSize);
+    size_t header_count = cfg.loops.count;
+    const char **headers = arena_alloc(arena, header_count * sizeof(char*));
+    for (size_t l = 0; l < header_count; l++)
+	{
+        TAC_Inst *head = &tac->items[cfg.items[cfg.loops.items[l].header].begin];
+        headers[l] = head->type == TAC_LABEL ? head->dest : NULL;
+    }
+    CFGFree(&cfg);
+
+    Loop_Opt lo = {0};
+    TACInit(&lo.tb, arena);
+    lo.base_temps = TACGetMaxTemp(tac) + 1;
+    lo.tb.temp_count = lo.base_temps;
+    lo.temp_defs = calloc(lo.base_temps + 1, sizeof(int));
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        const char *def = InstDef(&tac->items[i]);
+        if (IsTemp(def))
+            lo.temp_defs[atoi(def + 2)]++;
+    }
+
+    for (size_t l = 0; l < header_count; l++)
+	{
+        if (!headers[l])
+            continue;
+
+        bool changed = true;
+        while (changed)
+		{
+            CFGBuild(&cfg, tac);
+            CFGFindLoops(&cfg);
+            Natural_Loop *loop = LoopByHeader(&cfg, headers[l]);
+            changed = loop && HoistInvariants(&lo, tac, &cfg, loop);
+            CFGFree(&cfg);
+        }
+
+        CFGBuild(&cfg, tac);
+        CFGFindLoops(&cfg);
+        Natural_Loop *loop = LoopByHeader(&cfg, headers[l]);
+        if (loop)
+            ReduceInductionVars(&lo, tac, &cfg, loop);
+        CFGFree(&cfg);
+    }
+
+    free(lo.temp_defs);
+    nob_da_free(lo.loop_defs);
+}
+
+// Bounds check elimination works on value ranges. A bound is a constant, or
+// the count of a slice plus a constant
+typedef struct {
+    const char *slice;
+    int64_t value;
+} Bound;
+
+static bool SameSlice(const char *a, const char *b)
+	{ return a == b || (a && b && strcmp(a, b) == 0); }
+
+static TAC_Inst* UniqueDef(TAC_List *tac, const char *name)
+{
+    TAC_Inst *found = NULL;
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        TAC_Inst *inst = &tac->items[i];
+        const char *def = InstDef(inst);
+        if (!def || strcmp(def, name) != 0)
+            continue;
+        if (found)
+            return NULL;
+        found = inst;
+    }
+    return found;
+}
+
+// A count read from a slice holds until the slice is assigned again. Lowering
+// is structured, anything that runs after the read and before a later use
+// of the value comes after the read in the list
+static bool CountStable(TAC_List *tac, TAC_Inst *load)
+{
+    for (TAC_Inst *inst = load + 1; inst < tac->items + tac->count; inst++)
+        if (inst->type == TAC_STORE_FIELD && strcmp(inst->dest, load->src1) == 0)
+            return false;
+    return true;
+}
+
+// Follows single-definition temps through copies, constant offsets and
+// slice count loads
+static bool EvalBound(TAC_List *tac, const char *operand, Bound *bound, int depth)
+{
+    if (IsConst(operand))
+	{
+        *bound = (Bound){ .value = strtoll(operand, NULL, 10) };
+        return true;
+    }
+    if (!IsTemp(operand) || depth > 8)
+        return false;
+
+    TAC_Inst *def = UniqueDef(tac, operand);
+    if (!def)
+        return false;
+
+    Bound left, right;
+    switch (def->type)
+	{
+        case TAC_COPY:
+            return EvalBound(tac, def->src1, bound, depth + 1);
+
+        case TAC_LOAD_FIELD:
+            if (!(def->flags & TAC_FLAG_COUNT) || !CountStable(tac, def))
+                return false;
+            *bound = (Bound){ .slice = def->src1 };
+            return true;
+
+        case TAC_BINOP:
+            if (!EvalBound(tac, def->src1, &left, depth + 1) || !EvalBound(tac, def->src2, &right, depth + 1))
+                return false;
+            if (strcmp(def->op, "+") == 0 && (!left.slice || !right.slice))
+                *bound = (Bound){ left.slice ? left.slice : right.slice, left.value + right.value };
+            else if (strcmp(def->op, "-") == 0 && !right.slice)
+                *bound = (Bound){ left.slice, left.value - right.value };
+            else
+                return false;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// a[i + 1] checks i + 1, the range analysis wants i and the offset
+static const char* SplitIndex(TAC_List *tac, const char *index, int64_t *offset)
+{
+    *offset = 0;
+    TAC_Inst *def = IsTemp(index) ? UniqueDef(tac, index) : NULL;
+    if (!def || def->type != TAC_BINOP || !def->src1 || !IsConst(def->src2))
+        return index;
+    if (strcmp(def->op, "+") == 0)
+        *offset = strtoll(def->src2, NULL, 10);
+    else if (strcmp(def->op, "-") == 0)
+        *offset = -strtoll(def->src2, NULL, 10);
+    else
+        return index;
+    return def->src1;
+}
+
+// The step of an update iter = t with t = iter +/- c, 0 for any other
+// definition
+static int64_t IteratorStep(TAC_List *tac, TAC_Inst *inst, const char *iter)
+{
+    if (inst->type != TAC_COPY || !IsTemp(inst->src1))
+        return 0;
+    TAC_Inst *def = UniqueDef(tac, inst->src1);
+    if (!def || def->type != TAC_BINOP || !def->src1 || strcmp(def->src1, iter) != 0 || !IsConst(def->src2))
+        return 0;
+    int64_t step = strtoll(def->src2, NULL, 10);
+    if (step <= 0)
+        return 0;
+    if (strcmp(def->op, "+") == 0)
+        return step;
+    return strcmp(def->op, "-") == 0 ? -step : 0;
+}
+
+// Range loops are rotated, a guard in front of the header and the bottom
+// test compare the iterator with the same limit. Every definition but the
+// initial copy steps it in the same direction, so the start bounds it on one
+// side. On the other it is within the limit at the header, plus whatever the
+// updates the body has run so far in this trip added, as long as none of
+// them repeats inside an inner loop. Unrolled copies and the prologue and
+// epilogue of vectorized loops qualify too
+static bool IteratorRange(TAC_List *tac, CFG *cfg, Natural_Loop *loop, const char *iter, size_t check, 
+                          Bound *lo, Bound *hi)
+{
+    size_t h = loop->header;
+    TAC_Inst *head = &tac->items[cfg->items[h].begin];
+    if (head->type != TAC_LABEL || FindPreheader(cfg, loop) == NONE)
+        return false;
+
+    TAC_Inst *init = NULL;
+    int direction = 0;
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        TAC_Inst *inst = &tac->items[i];
+        const char *def = InstDef(inst);
+        if (!def || strcmp(def, iter) != 0)
+            continue;
+        int64_t step = IteratorStep(tac, inst, iter);
+        if (step == 0)
+		{
+            if (init)
+                return false;
+            init = inst;
+        }
+        else if (direction == 0)
+            direction = step > 0 ? 1 : -1;
+        else if ((step > 0) != (direction > 0))
+            return false;
+    }
+    if (!init || init->type != TAC_COPY || direction == 0)
+        return false;
+
+    TAC_Inst *test = NULL;
+    for (size_t b = 0; b < cfg->count && !test; b++)
+	{
+        TAC_Inst *tail = &tac->items[cfg->items[b].end - 1];
+        if (loop->blocks[b] && tail->type == TAC_JUMP_IF && tail->op && strcmp(tail->dest, head->dest) == 0 && 
+            strcmp(tail->src1, iter) == 0)
+            test = tail;
+    }
+    TAC_Inst *guard = &tac->items[cfg->items[h - 1].end - 1];
+    if (!test || guard->type != TAC_JUMP_IF_NOT || !guard->op || strcmp(guard->src1, iter) != 0 ||
+        strcmp(guard->op, test->op) != 0 || strcmp(guard->src2, test->src2) != 0)
+        return false;
+
+    // Blocks are laid out in list order, b follows i along
+    if (check < cfg->items[h].begin)
+        return false;
+    int64_t ahead = 0;
+    size_t b = h;
+    for (size_t i = cfg->items[h].begin; i < check; i++)
+	{
+        TAC_Inst *inst = &tac->items[i];
+        const char *def = InstDef(inst);
+        if (def && strcmp(def, iter) == 0)
+		{
+            for (size_t l = 0; l < cfg->loops.count; l++)
+                if (cfg->loops.items[l].blocks[b] && !cfg->loops.items[l].blocks[h])
+                    return false;
+            ahead += IteratorStep(tac, inst, iter);
+        }
+        if (i + 1 == cfg->items[b].end)
+            b++;
+    }
+
+    Bound start, limit;
+    if (!EvalBound(tac, init->src1, &start, 0) || !EvalBound(tac, test->src2, &limit, 0))
+        return false;
+
+    int64_t exclusive = 0;
+    if (strcmp(test->op, direction > 0 ? "<" : ">") == 0)
+        exclusive = direction;
+    else if (strcmp(test->op, direction > 0 ? "<=" : ">=") != 0)
+        return false;
+
+    Bound reached = { limit.slice, limit.value - exclusive + ahead };
+    *lo = direction > 0 ? start : reached;
+    *hi = direction > 0 ? reached : start;
+    return true;
+}
+
+static bool CheckRedundant(TAC_List *tac, CFG *cfg, size_t block, size_t check)
+{
+    int64_t offset;
+    const char *iter = SplitIndex(tac, tac->items[check].src1, &offset);
+    Bound count;
+    if (IsConst(iter) || IsTemp(iter) || !EvalBound(tac, tac->items[check].src2, &count, 0))
+        return false;
+
+    for (size_t l = 0; l < cfg->loops.count; l++)
+	{
+        Natural_Loop *loop = &cfg->loops.items[l];
+        Bound lo, hi;
+        if (!loop->blocks[block] || !IteratorRange(tac, cfg, loop, iter, check, &lo, &hi))
+            continue;
+        return !lo.slice && lo.value + offset >= 0 && 
+               SameSlice(hi.slice, count.slice) && hi.value + offset < count.value;
+    }
+    return false;
+}
+
+// Checks inside range loops whose iterator provably stays within the count
+// are dropped, along with count loads nothing else reads
+void EliminateBoundsChecks(TAC_List *tac)
+{
+    CFG cfg;
+    CFGBuild(&cfg, tac);
+    CFGFindLoops(&cfg);
+
+    bool *dead = calloc(tac->count + 1, sizeof(bool));
+    for (size_t b = 0; b < cfg.count; b++)
+        for (size_t i = cfg.items[b].begin; i < cfg.items[b].end; i++)
+            if (tac->items[i].type == TAC_BOUNDS_CHECK && CheckRedundant(tac, &cfg, b, i))
+                dead[i] = true;
+    CFGFree(&cfg);
+
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        if (!dead[i] || tac->items[i].type != TAC_BOUNDS_CHECK)
+            continue;
+        const char *count = tac->items[i].src2;
+        TAC_Inst *def = IsTemp(count) ? UniqueDef(tac, count) : NULL;
+        if (!def || def->type != TAC_LOAD_FIELD)
+            continue;
+
+        bool used = false;
+        for (size_t k = 0; k < tac->count && !used; k++)
+		{
+            TAC_Inst *inst = &tac->items[k];
+            used = !dead[k] && ((inst->src1 && strcmp(inst->src1, count) == 0) || 
+                                (inst->src2 && strcmp(inst->src2, count) == 0));
+        }
+        if (!used)
+            dead[def - tac->items] = true;
+    }
+
+    // The survivors move down over the dropped instructions
+    size_t kept = 0;
+    for (size_t i = 0; i < tac->count; i++)
+        if (!dead[i])
+            tac->items[kept++] = tac->items[i];
+    tac->count = kept;
+    free(dead);
+}
@@ -48,6 +48,7 @@ void CollectVariables(AST_Node *node, AST_Array *vars, Arena *arena)
     if (!node) return;
     
     switch (node->type) {
+        case AST_VAR:
         case AST_ASSIGNMENT:
             // Add variable name to list if not already there
             if (node->name) {
@@ -76,6 +77,7 @@ void CollectVariables(AST_Node *node, AST_Array *vars, Arena *arena)
             break;
             
         case AST_WHILE:
+        case AST_FOR_RANGE:
             CollectVariables(node->body, vars, arena);
             break;
             
@@ -84,6 +86,60 @@ void CollectVariables(AST_Node *node, AST_Array *vars, Arena *arena)
     }
 }
 
+bool ASTReferences(AST_Node *node, const char *name) 
+{
+    if (!node) 
+		return false;
+    
+    if ((node->type == AST_ID || node->type == AST_ASSIGNMENT) && 
+        node->name && strcmp(node->name, name) == 0)
+        return true;
+    
+    if (ASTReferences(node->left, name) || ASTReferences(node->right, name) ||
+        ASTReferences(node->body, name))
+        return true;
+    
+    for (size_t i = 0; i < node->children.used; i++) 
+        if (ASTReferences(node->children.data[i], name))
+            return true;
+    
+    return false;
+}
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+// FNV-1a over the shape and contents of a subtree, positions are left out
+// so moving code around doesn't change its hash
+uint64_t ASTHash(AST_Node *node, uint64_t hash)
+{
+    if (!node)
+        return HashBytes(hash, "", 1);
+
+    hash = HashBytes(hash, &node->type, sizeof(node->type));
+    hash = HashBytes(hash, &node->num, sizeof(node->num));
+    hash = HashBytes(hash, &node->flags, sizeof(node->flags));
+    // Operators hash as their spelling, so profiles don't depend on the enum order
+    const char *name = node->type == AST_BIN_OP ? ASTOpName(node->op) : node->name;
+    if (name)
+        hash = HashBytes(hash, name, strlen(name) + 1);
+    if (node->str)
+        hash = HashBytes(hash, node->str, strlen(node->str) + 1);
+
+    hash = ASTHash(node->left, hash);
+    hash = ASTHash(node->right, hash);
+    hash = ASTHash(node->body, hash);
+    hash = HashBytes(hash, &node->children.used, sizeof(node->children.used));
+    for (size_t i = 0; i < node->children.used; i++)
+        hash = ASTHash(node->children.data[i], hash);
+    return hash;
+}
+
 static void ParserError(Parser *parser, const char *message) 
 {
     if (parser->panic_mode) 
@@ -179,6 +235,38 @@ static AST_Node *ParsePrimary(Parser *parser)
 {
     if (ParserMatch(parser, TOKEN_NUM)) 
         return ParseNumber(parser);
+
+	// Call modifiers: #tail forces a tail call, #no_tail keeps the frame.
+	// #run evaluates what follows at compile time
+	if (ParserMatch(parser, TOKEN_DIRECTIVE))
+	{
+		Token directive = parser->prev;
+		uint32_t flag = 0;
+		if (strcmp(directive.lexeme, "#run") == 0)
+		{
+			AST_Node *run = ASTNodeCreate(parser, AST_RUN);
+			run->right = ParsePrimary(parser);
+			return run;
+		}
+		else if (strcmp(directive.lexeme, "#tail") == 0)
+			flag = AST_FLAG_TAIL;
+		else if (strcmp(directive.lexeme, "#no_tail") == 0)
+			flag = AST_FLAG_NO_TAIL;
+		else
+		{
+			ParserError(parser, "Unknown directive in expression");
+			return NULL;
+		}
+
+		AST_Node *expr = ParsePrimary(parser);
+		if (!expr || expr->type != AST_CALL) 
+		{
+			ParserError(parser, "Expected procedure call after call modifier");
+			return expr;
+		}
+		expr->flags |= flag;
+		return expr;
+	}
     
 	if (ParserMatch(parser, TOKEN_ID))
 	{
@@ -226,102 +314,109 @@ static AST_Node *ParsePrimary(Parser *parser)
     return NULL;
 }
 
-static AST_Node *ParseUnary(Parser *parser) 
-{
+// Pratt parsing: an operand, then every infix operator that binds at least
+// as tightly as min_power. Binary operators are left associative, their
+// right operand only takes operators that bind tighter
+typedef struct {
+    AST_Op op;
+    int power;
+} Infix_Rule;
+
+static const Infix_Rule infix_rules[TOKEN_ERR + 1] = {
+    [TOKEN_EQ]         = { AST_OP_EQ,         1 },
+    [TOKEN_NOT_EQ]     = { AST_OP_NOT_EQ,     1 },
+    [TOKEN_LESS]       = { AST_OP_LESS,       2 },
+    [TOKEN_LESS_EQ]    = { AST_OP_LESS_EQ,    2 },
+    [TOKEN_GREATER]    = { AST_OP_GREATER,    2 },
+    [TOKEN_GREATER_EQ] = { AST_OP_GREATER_EQ, 2 },
+    [TOKEN_PLUS]       = { AST_OP_ADD,        3 },
+    [TOKEN_MINUS]      = { AST_OP_SUB,        3 },
+    [TOKEN_MUL]        = { AST_OP_MUL,        4 },
+    [TOKEN_DIV]        = { AST_OP_DIV,        4 },
+    [TOKEN_MOD]        = { AST_OP_MOD,        4 },
+};
+
+// Prefix operators bind tighter than any infix one
+#define PREFIX_POWER 5
+
+static const char *op_names[AST_OP_COUNT] = {
+    [AST_OP_ADD] = "+",
+    [AST_OP_SUB] = "-",
+    [AST_OP_MUL] = "*",
+    [AST_OP_DIV] = "/",
+    [AST_OP_MOD] = "%",
+    [AST_OP_EQ] = "==",
+    [AST_OP_NOT_EQ] = "!=",
+    [AST_OP_LESS] = "<",
+    [AST_OP_LESS_EQ] = "<=",
+    [AST_OP_GREATER] = ">",
+    [AST_OP_GREATER_EQ] = ">=",
+    [AST_OP_NEG] = "-",
+    [AST_OP_NOT] = "!",
+};
+
+// The TAC spelling of an operator
+const char* ASTOpName(AST_Op op)
+	{ return op_names[op]; }
+
+static AST_Node *ParseBinding(Parser *parser, int min_power) 
+{
+    AST_Node *expr;
     if (ParserMatch(parser, TOKEN_NOT) || ParserMatch(parser, TOKEN_MINUS)) 
 	{
-        Token operator = parser->prev;
-        AST_Node *right = ParseUnary(parser);
-        
-        AST_Node *node = ASTNodeCreate(parser, AST_BIN_OP);
-        node->name = arena_strdup(parser->arena, operator.lexeme);
-        node->left = NULL;
-        node->right = right;
-        return node;
+        expr = ASTNodeCreate(parser, AST_BIN_OP);
+        expr->op = parser->prev.type == TOKEN_NOT ? AST_OP_NOT : AST_OP_NEG;
+        expr->right = ParseBinding(parser, PREFIX_POWER);
     }
-    
-    return ParsePrimary(parser);
-}
+    else
+        expr = ParsePrimary(parser);
 
-static AST_Node *ParseFactor(Parser *parser) 
-{
-    AST_Node *expr = ParseUnary(parser);
-    
-    while (ParserMatch(parser, TOKEN_DIV) || ParserMatch(parser, TOKEN_MUL) || ParserMatch(parser, TOKEN_MOD)) 
+    while (true)
 	{
-        Token operator = parser->prev;
-        AST_Node *right = ParseUnary(parser);
-        
-        AST_Node *node = ASTNodeCreate(parser, AST_BIN_OP);
-        node->name = arena_strdup(parser->arena, operator.lexeme);
-        node->left = expr;
-        node->right = right;
-        expr = node;
-    }
-    
-    return expr;
-}
+        const Infix_Rule *rule = &infix_rules[parser->curr.type];
+        if (rule->op == AST_OP_NONE || rule->power < min_power)
+            break;
+        ParserAdvance(parser);
 
-static AST_Node *ParseTerm(Parser *parser) 
-{
-    AST_Node *expr = ParseFactor(parser);
-    
-    while (ParserMatch(parser, TOKEN_MINUS) || ParserMatch(parser, TOKEN_PLUS)) 
-	{
-        Token operator = parser->prev;
-        AST_Node *right = ParseFactor(parser);
-        
         AST_Node *node = ASTNodeCreate(parser, AST_BIN_OP);
-        node->name = arena_strdup(parser->arena, operator.lexeme);
+        node->op = rule->op;
         node->left = expr;
-        node->right = right;
+        node->right = ParseBinding(parser, rule->power + 1);
         expr = node;
     }
-    
     return expr;
 }
 
-static AST_Node *ParseComparison(Parser *parser) 
-{
-    AST_Node *expr = ParseTerm(parser);
-    
-    while (ParserMatch(parser, TOKEN_GREATER) || ParserMatch(parser, TOKEN_GREATER_EQ) ||
-           ParserMatch(parser, TOKEN_LESS) || ParserMatch(parser, TOKEN_LESS_EQ)) 
-	{
-        Token operator = parser->prev;
-        AST_Node *right = ParseTerm(parser);
-        
-        AST_Node *node = ASTNodeCreate(parser, AST_BIN_OP);
-        node->name = arena_strdup(parser->arena, operator.lexeme);
-        node->left = expr;
-        node->right = right;
-        expr = node;
-    }
-    
-    return expr;
-}
+static AST_Node *ParseExpression(Parser *parser) 
+	{ return ParseBinding(parser, 0); }
 
-static AST_Node *ParseEquality(Parser *parser) 
+// Type, [N]Type for fixed arrays or []Type for slices. NULL when no type
+// starts here
+static AST_Node *ParseType(Parser *parser)
 {
-    AST_Node *expr = ParseComparison(parser);
-    
-    while (ParserMatch(parser, TOKEN_NOT_EQ) || ParserMatch(parser, TOKEN_EQ)) 
+    int64_t length = 0;
+    uint32_t flags = 0;
+    if (ParserMatch(parser, TOKEN_L_BRACKET))
 	{
-        Token operator = parser->prev;
-        AST_Node *right = ParseComparison(parser);
-        
-        AST_Node *node = ASTNodeCreate(parser, AST_BIN_OP);
-        node->name = arena_strdup(parser->arena, operator.lexeme);
-        node->left = expr;
-        node->right = right;
-        expr = node;
+        if (ParserMatch(parser, TOKEN_R_BRACKET))
+            flags |= AST_FLAG_SLICE;
+        else
+		{
+            ParserConsume(parser, TOKEN_NUM, "Expected array length");
+            length = parser->prev.value.num;
+            ParserConsume(parser, TOKEN_R_BRACKET, "Expected ']' after array length");
+        }
+        ParserConsume(parser, TOKEN_ID, "Expected element type");
     }
-    
-    return expr;
-}
+    else if (!ParserMatch(parser, TOKEN_ID))
+        return NULL;
 
-static AST_Node *ParseExpression(Parser *parser) 
-	{ return ParseEquality(parser); }
+    AST_Node *type_node = ASTNodeCreate(parser, AST_TYPE);
+    type_node->name = arena_strdup(parser->arena, parser->prev.lexeme);
+    type_node->num = length;
+    type_node->flags = flags;
+    return type_node;
+}
 
 static AST_Node *ParseVariableAssignment(Parser *parser) 
 {
@@ -381,16 +476,13 @@ static AST_Node *ParseStatement(Parser *parser)
             Token var_name = parser->prev;
             ParserAdvance(parser); // consume ':'
             
-            if (ParserMatch(parser, TOKEN_ID)) 
+            AST_Node *type_node = ParseType(parser);
+            if (type_node) 
 			{
-                Token type_name = parser->prev;
                 ParserConsume(parser, TOKEN_SEMICOLON, "Expected ';' after type declaration");
                 
                 AST_Node *node = ASTNodeCreate(parser, AST_ASSIGNMENT);
                 node->name = arena_strdup(parser->arena, var_name.lexeme);
-                
-                AST_Node *type_node = ASTNodeCreate(parser, AST_TYPE);
-                type_node->name = arena_strdup(parser->arena, type_name.lexeme);
                 node->right = type_node;
                 
                 return node;
@@ -426,6 +518,17 @@ static AST_Node *ParseStatement(Parser *parser)
 			return lhs;
 		}
 		
+		// Element and field stores keep the target in left, name stays NULL
+		if (lhs && (lhs->type == AST_INDEX || lhs->type == AST_FIELD_ACCESS) && 
+			ParserMatch(parser, TOKEN_EQ_ASSIGN)) 
+		{
+			AST_Node *node = ASTNodeCreate(parser, AST_ASSIGNMENT);
+			node->left = lhs;
+			node->right = ParseExpression(parser);
+			ParserConsume(parser, TOKEN_SEMICOLON, "Expected ';' after assignment");
+			return node;
+		}
+		
 		ParserConsume(parser, TOKEN_SEMICOLON, "Expected ';' after expression");
 		return lhs;
 	}
@@ -529,14 +632,7 @@ static AST_Node *ParseProcedure(Parser *parser)
                 param->name = arena_strdup(parser->arena, param_name.lexeme);
                 
                 if (ParserMatch(parser, TOKEN_COLON)) 
-				{
-                    if (ParserMatch(parser, TOKEN_ID)) 
-					{
-                        AST_Node *type_node = ASTNodeCreate(parser, AST_TYPE);
-                        type_node->name = arena_strdup(parser->arena, parser->prev.lexeme);
-                        param->right = type_node;
-                    }
-                }
+                    param->right = ParseType(parser);
                 
                 ASTArrayPush(&proc->children, param, parser->arena);
             }
@@ -584,6 +680,16 @@ static AST_Node *ParseDeclaration(Parser *parser)
                 return struct_def;
             }
             
+            // Name :: value; is a constant, the value is folded at compile time
+            if (!ParserCheck(parser, TOKEN_L_PAREN))
+			{
+                AST_Node *constant = ASTNodeCreate(parser, AST_CONST);
+                constant->name = arena_strdup(parser->arena, name.lexeme);
+                constant->right = ParseExpression(parser);
+                ParserConsume(parser, TOKEN_SEMICOLON, "Expected ';' after constant");
+                return constant;
+            }
+            
             // Not a struct, restore state and parse as procedure
             parser->lexer->curr = saved_curr;
             parser->lexer->line = saved_line;
@@ -610,7 +716,24 @@ static AST_Node *ParseFor(Parser *parser)
 {
     AST_Node *node = ASTNodeCreate(parser, AST_FOR_RANGE);
     
-    bool reverse = ParserMatch(parser, TOKEN_LESS);
+    // '<' and the loop pragmas may come in any order, pragmas only matter at -O2
+    bool reverse = false;
+    while (true) 
+	{
+        if (!reverse && ParserMatch(parser, TOKEN_LESS))
+            reverse = true;
+        else if (ParserMatch(parser, TOKEN_DIRECTIVE)) 
+		{
+            if (strcmp(parser->prev.lexeme, "#unroll") == 0)
+                node->flags |= AST_FLAG_UNROLL;
+            else if (strcmp(parser->prev.lexeme, "#simd") == 0)
+                node->flags |= AST_FLAG_SIMD;
+            else
+                ParserError(parser, "Unknown for loop directive");
+        }
+        else
+            break;
+    }
     
     Token iterator_name = {0};
     bool has_iterator_name = false;
@@ -686,6 +809,18 @@ static AST_Node *ParseStruct(Parser *parser)
     AST_Node *node = ASTNodeCreate(parser, AST_STRUCT);
     ASTArrayInit(&node->children); // For fields
     
+    // #reorder lets the layout engine sort fields to minimize padding,
+    // #soa splits arrays of the struct into one array per field
+    while (ParserMatch(parser, TOKEN_DIRECTIVE)) 
+	{
+        if (strcmp(parser->prev.lexeme, "#reorder") == 0)
+            node->flags |= AST_FLAG_REORDER;
+        else if (strcmp(parser->prev.lexeme, "#soa") == 0)
+            node->flags |= AST_FLAG_SOA;
+        else
+            ParserError(parser, "Unknown struct directive");
+    }
+    
     ParserConsume(parser, TOKEN_L_BRACE, "Expected '{' after 'struct'");
     
     // Parse fields: name: type;
@@ -707,6 +842,11 @@ static AST_Node *ParseStruct(Parser *parser)
             ParserConsume(parser, TOKEN_SEMICOLON, "Expected ';' after field");
             ASTArrayPush(&node->children, field, parser->arena);
         }
+        else 
+		{
+            ParserError(parser, "Expected field name");
+            ParserAdvance(parser);
+        }
     }
     
     ParserConsume(parser, TOKEN_R_BRACE, "Expected '}' after struct fields");
@@ -763,10 +903,22 @@ void ASTPrintNode(AST_Node* node, int depth)
     
     if (node->name) 
         printf(" '%s'", node->name);
+    if (node->type == AST_BIN_OP)
+        printf(" '%s'", ASTOpName(node->op));
     
     if (node->type == AST_NUM) 
         printf(" (%ld)", node->num);
 
+	if (node->type == AST_TYPE && node->num > 0)
+        printf(" [%ld]", node->num);
+	if (node->type == AST_TYPE && (node->flags & AST_FLAG_SLICE))
+        printf(" []");
+
+	if (node->type == AST_STRUCT && (node->flags & AST_FLAG_REORDER))
+        printf(" #reorder");
+	if (node->type == AST_STRUCT && (node->flags & AST_FLAG_SOA))
+        printf(" #soa");
+
 	if (node->type == AST_BIN_OP && !node->left)
         printf(" (UNARY)");
     
@@ -808,6 +960,10 @@ void ASTPrintNode(AST_Node* node, int depth)
 
 		if (node->flags & AST_FLAG_REVERSE)
 			printf(" (REVERSE)");
+		if (node->flags & AST_FLAG_UNROLL)
+			printf(" #unroll");
+		if (node->flags & AST_FLAG_SIMD)
+			printf(" #simd");
 		printf("\n");
 		
 		if (node->left) 
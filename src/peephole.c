@@ -0,0 +1,466 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <string.h>
+
+// Pattern table peephole over the x86 instruction list. A rule matches a
+// window of consecutive instructions, binding operand variables on the way,
+// and replaces the window when its liveness conditions hold afterwards
+
+typedef enum {
+    PAT_NONE,
+    PAT_REG,     // exactly register value
+    PAT_REG8,    // exactly the low byte of register value
+    PAT_IMM,     // exactly the immediate value
+    PAT_VAR,     // binds or compares variable var, constrained by cls
+    PAT_VAR32,   // replacement only, a register variable as its 32-bit half
+    PAT_LOG2,    // replacement only, log2 of an immediate variable
+} Pat_Kind;
+
+typedef enum {
+    CLS_ANY,
+    CLS_GPR,     // any 64-bit register
+    CLS_MEM,     // any memory operand
+    CLS_IMM32,   // immediate that fits a sign-extended imm32
+    CLS_POW2,    // power of two immediate above one
+    CLS_REG,     // register other than rax, rcx and rsp
+    CLS_RM,      // CLS_REG or memory not addressed through rax, rcx or rsp
+    CLS_SOURCE,  // CLS_RM or any immediate
+} Pat_Class;
+
+typedef struct {
+    Pat_Kind kind;
+    int value;
+    int var;
+    Pat_Class cls;
+} Pat_Operand;
+
+// keep > 0 copies matched instruction keep - 1 into the replacement as is
+typedef struct {
+    X86_Op op;
+    Pat_Operand dst, src;
+    int keep;
+} Pat_Inst;
+
+#define PEEP_MAX_WINDOW 4
+#define PEEP_MAX_VARS 2
+
+typedef struct {
+    const char *name;
+    int match_count;
+    Pat_Inst match[PEEP_MAX_WINDOW];
+    int replace_count;
+    Pat_Inst replace[PEEP_MAX_WINDOW];
+    uint32_t dead_regs;   // must not be read after the window
+    bool dead_flags;      // flags must not be read after the window
+} Peephole_Rule;
+
+#define P_NONE      { PAT_NONE, 0, 0, CLS_ANY }
+#define P_REG(r)    { PAT_REG, X86_##r, 0, CLS_ANY }
+#define P_REG8(r)   { PAT_REG8, X86_##r, 0, CLS_ANY }
+#define P_IMM(v)    { PAT_IMM, v, 0, CLS_ANY }
+#define P_VAR(n, c) { PAT_VAR, 0, n, CLS_##c }
+#define P_VAR32(n)  { PAT_VAR32, 0, n, CLS_ANY }
+#define P_LOG2(n)   { PAT_LOG2, 0, n, CLS_ANY }
+#define P_INST(op, d, s) { X86_##op, d, s, 0 }
+#define P_KEEP(i)   { X86_LABEL, P_NONE, P_NONE, (i) + 1 }
+#define P_EMPTY     P_KEEP(-1)
+#define DEAD(r)     (1u << X86_##r)
+
+// Immediate operand forms of the binary ops, rcx only carried the constant
+#define FOLD_IMM(op) \
+    { "fold immediate " #op, 2, \
+      { P_INST(MOV, P_REG(RCX), P_VAR(0, IMM32)), P_INST(op, P_REG(RAX), P_REG(RCX)) }, \
+      1, { P_INST(op, P_REG(RAX), P_VAR(0, ANY)) }, DEAD(RCX), false }
+
+#define FOLD_RM(op) \
+    { "fold operand " #op, 2, \
+      { P_INST(MOV, P_REG(RCX), P_VAR(0, RM)), P_INST(op, P_REG(RAX), P_REG(RCX)) }, \
+      1, { P_INST(op, P_REG(RAX), P_VAR(0, ANY)) }, DEAD(RCX), false }
+
+// Order matters, the first rule that matches at a position wins
+static const Peephole_Rule peephole_rules[] = {
+    { "empty push/pop", 2,
+      { P_INST(PUSH, P_REG(RAX), P_NONE), P_INST(POP, P_REG(RAX), P_NONE) },
+      0, { P_EMPTY }, 0, false },
+
+    // push rax / mov rax, x / mov rcx, rax / pop rax, the right operand of
+    // every two-operand macro
+    { "load right operand", 4,
+      { P_INST(PUSH, P_REG(RAX), P_NONE), P_INST(MOV, P_REG(RAX), P_VAR(0, SOURCE)),
+        P_INST(MOV, P_REG(RCX), P_REG(RAX)), P_INST(POP, P_REG(RAX), P_NONE) },
+      1, { P_INST(MOV, P_REG(RCX), P_VAR(0, ANY)) }, 0, false },
+
+    { "store then reload", 2,
+      { P_INST(MOV, P_VAR(0, MEM), P_REG(RAX)), P_INST(MOV, P_REG(RAX), P_VAR(0, MEM)) },
+      1, { P_KEEP(0) }, 0, false },
+
+    { "multiply by one", 2,
+      { P_INST(MOV, P_REG(RCX), P_IMM(1)), P_INST(IMUL, P_REG(RAX), P_REG(RCX)) },
+      0, { P_EMPTY }, DEAD(RCX), true },
+
+    { "multiply by power of two", 2,
+      { P_INST(MOV, P_REG(RCX), P_VAR(0, POW2)), P_INST(IMUL, P_REG(RAX), P_REG(RCX)) },
+      1, { P_INST(SHL, P_REG(RAX), P_LOG2(0)) }, DEAD(RCX), true },
+
+    FOLD_IMM(ADD), FOLD_IMM(SUB), FOLD_IMM(IMUL), FOLD_IMM(AND), FOLD_IMM(CMP),
+    FOLD_RM(ADD), FOLD_RM(SUB), FOLD_RM(IMUL), FOLD_RM(AND), FOLD_RM(CMP),
+
+    { "compare register directly", 2,
+      { P_INST(MOV, P_REG(RAX), P_VAR(0, REG)), P_INST(CMP, P_REG(RAX), P_VAR(1, ANY)) },
+      1, { P_INST(CMP, P_VAR(0, ANY), P_VAR(1, ANY)) }, DEAD(RAX), false },
+
+    { "compare memory with immediate", 2,
+      { P_INST(MOV, P_REG(RAX), P_VAR(0, MEM)), P_INST(CMP, P_REG(RAX), P_VAR(1, IMM32)) },
+      1, { P_INST(CMP, P_VAR(0, ANY), P_VAR(1, ANY)) }, DEAD(RAX), false },
+
+    // The zero has to land after the compare, xor would clobber its flags
+    { "zero extend setcc", 2,
+      { P_INST(MOV, P_REG(RAX), P_IMM(0)), P_INST(SETCC, P_REG8(RAX), P_NONE) },
+      2, { P_KEEP(1), P_INST(MOVZX, P_REG(RAX), P_REG8(RAX)) }, 0, false },
+
+    { "store immediate", 2,
+      { P_INST(MOV, P_REG(RAX), P_VAR(0, IMM32)), P_INST(MOV, P_VAR(1, MEM), P_REG(RAX)) },
+      1, { P_INST(MOV, P_VAR(1, ANY), P_VAR(0, ANY)) }, DEAD(RAX), false },
+
+    { "store register", 2,
+      { P_INST(MOV, P_REG(RAX), P_VAR(0, REG)), P_INST(MOV, P_VAR(1, MEM), P_REG(RAX)) },
+      1, { P_INST(MOV, P_VAR(1, ANY), P_VAR(0, ANY)) }, DEAD(RAX), false },
+
+    { "move into register", 2,
+      { P_INST(MOV, P_REG(RAX), P_VAR(0, SOURCE)), P_INST(MOV, P_VAR(1, GPR), P_REG(RAX)) },
+      1, { P_INST(MOV, P_VAR(1, ANY), P_VAR(0, ANY)) }, DEAD(RAX), false },
+
+    { "zero register", 1,
+      { P_INST(MOV, P_VAR(0, GPR), P_IMM(0)) },
+      1, { P_INST(XOR, P_VAR32(0), P_VAR32(0)) }, 0, true },
+};
+
+static const uint32_t arg_reg_mask = DEAD(RDI) | DEAD(RSI) | DEAD(RDX) | DEAD(RCX) | DEAD(R8) | DEAD(R9);
+
+static uint32_t AddressRegs(X86_Operand *opnd)
+{
+    if (opnd->kind != X86_OPND_MEM || opnd->label)
+        return 0;
+    return (1u << opnd->reg) | (opnd->scale ? 1u << opnd->index : 0);
+}
+
+static uint32_t OperandRegs(X86_Operand *opnd)
+{
+    switch (opnd->kind)
+	{
+        case X86_OPND_REG:
+        case X86_OPND_REG32:
+        case X86_OPND_REG16:
+        case X86_OPND_REG8:
+            return 1u << opnd->reg;
+        case X86_OPND_MEM:
+            return AddressRegs(opnd);
+        default:
+            return 0;
+    }
+}
+
+static bool IsGpr(X86_Operand *opnd)
+{
+    return opnd->kind == X86_OPND_REG || opnd->kind == X86_OPND_REG32 || 
+           opnd->kind == X86_OPND_REG16 || opnd->kind == X86_OPND_REG8;
+}
+
+static uint32_t InstReads(X86_Inst *inst)
+{
+    switch (inst->op)
+	{
+        case X86_MOV:
+        case X86_MOVZX:
+        case X86_LEA:
+        case X86_POP:
+            return AddressRegs(&inst->dst) | OperandRegs(&inst->src);
+        case X86_XOR:
+            // xor r, r is the zeroing idiom, it doesn't depend on r
+            if (IsGpr(&inst->dst) && IsGpr(&inst->src) && inst->dst.reg == inst->src.reg)
+                return 0;
+            return OperandRegs(&inst->dst) | OperandRegs(&inst->src);
+        case X86_SETCC:
+            // Only the low byte is written, the rest of the register survives
+            return OperandRegs(&inst->dst);
+        // rdx:rax is the implicit dividend
+        case X86_CQO:
+            return DEAD(RAX);
+        case X86_IDIV:
+            return DEAD(RAX) | DEAD(RDX) | OperandRegs(&inst->dst);
+        default:
+            return OperandRegs(&inst->dst) | OperandRegs(&inst->src) | OperandRegs(&inst->src2);
+    }
+}
+
+static uint32_t InstWrites(X86_Inst *inst)
+{
+    switch (inst->op)
+	{
+        case X86_CMP:
+        case X86_TEST:
+        case X86_PUSH:
+            return 0;
+        case X86_CQO:
+            return DEAD(RDX);
+        case X86_IDIV:
+            return DEAD(RAX) | DEAD(RDX);
+        default:
+            return IsGpr(&inst->dst) ? 1u << inst->dst.reg : 0;
+    }
+}
+
+static bool ReadsFlags(X86_Op op)
+	{ return op == X86_SETCC || op == X86_JCC; }
+
+static bool WritesFlags(X86_Op op)
+{
+    return op == X86_ADD || op == X86_SUB || op == X86_IMUL || op == X86_AND || op == X86_XOR ||
+           op == X86_SHL || op == X86_CMP || op == X86_TEST || op == X86_DEC || op == X86_INC ||
+           op == X86_NEG || op == X86_IDIV;
+}
+
+// Scratch registers never carry values across TAC boundaries, so a label or
+// local branch ends their lifetime. Jumps to other procedures are tail calls
+// that pass arguments, calls read the argument registers and ret reads rax
+static bool RegDeadAfter(X86_List *list, size_t from, X86_Reg reg)
+{
+    uint32_t bit = 1u << reg;
+    for (size_t i = from; i < list->count; i++)
+	{
+        X86_Inst *inst = &list->items[i];
+        switch (inst->op)
+		{
+            case X86_LABEL:
+            case X86_JCC:
+                return true;
+            case X86_JMP:
+                if (inst->dst.label[0] == '.')
+                    return true;
+                return !(bit & arg_reg_mask);
+            case X86_CALL:
+                return !(bit & arg_reg_mask);
+            case X86_RET:
+                return reg != X86_RAX;
+            default:
+                break;
+        }
+        if (InstReads(inst) & bit)
+            return false;
+        if (InstWrites(inst) & bit)
+            return true;
+    }
+    return reg != X86_RAX;
+}
+
+static bool FlagsDeadAfter(X86_List *list, size_t from)
+{
+    for (size_t i = from; i < list->count; i++)
+	{
+        X86_Op op = list->items[i].op;
+        if (ReadsFlags(op))
+            return false;
+        if (WritesFlags(op) || op == X86_LABEL || op == X86_JMP || op == X86_CALL || op == X86_RET)
+            return true;
+    }
+    return true;
+}
+
+static bool OperandsEqual(X86_Operand *a, X86_Operand *b)
+{
+    if (a->kind != b->kind)
+        return false;
+    switch (a->kind)
+	{
+        case X86_OPND_IMM:
+            return a->imm == b->imm;
+        case X86_OPND_MEM:
+            if (a->label || b->label)
+                return a->label && b->label && strcmp(a->label, b->label) == 0 && a->disp == b->disp;
+            return a->reg == b->reg && a->disp == b->disp && a->scale == b->scale && a->size == b->size &&
+                   (!a->scale || a->index == b->index);
+        case X86_OPND_LABEL:
+            return strcmp(a->label, b->label) == 0;
+        case X86_OPND_NONE:
+            return true;
+        default:
+            return a->reg == b->reg;
+    }
+}
+
+static bool IsScratch(X86_Operand *opnd)
+{
+    uint32_t scratch = DEAD(RAX) | DEAD(RCX) | DEAD(RSP);
+    return (OperandRegs(opnd) & scratch) != 0;
+}
+
+static bool InClass(X86_Operand *opnd, Pat_Class cls)
+{
+    switch (cls)
+	{
+        case CLS_ANY:
+            return true;
+        case CLS_GPR:
+            return opnd->kind == X86_OPND_REG;
+        case CLS_MEM:
+            return opnd->kind == X86_OPND_MEM;
+        case CLS_IMM32:
+            return opnd->kind == X86_OPND_IMM && opnd->imm >= INT32_MIN && opnd->imm <= INT32_MAX;
+        case CLS_POW2:
+            return opnd->kind == X86_OPND_IMM && opnd->imm > 1 && (opnd->imm & (opnd->imm - 1)) == 0;
+        case CLS_REG:
+            return opnd->kind == X86_OPND_REG && !IsScratch(opnd);
+        case CLS_RM:
+            return (opnd->kind == X86_OPND_REG || opnd->kind == X86_OPND_MEM) && !IsScratch(opnd);
+        case CLS_SOURCE:
+            return opnd->kind == X86_OPND_IMM ||
+                   ((opnd->kind == X86_OPND_REG || opnd->kind == X86_OPND_MEM) && !IsScratch(opnd));
+    }
+    return false;
+}
+
+static bool MatchOperand(const Pat_Operand *pat, X86_Operand *opnd, X86_Operand *vars, bool *bound)
+{
+    switch (pat->kind)
+	{
+        case PAT_NONE:
+            return opnd->kind == X86_OPND_NONE;
+        case PAT_REG:
+            return opnd->kind == X86_OPND_REG && opnd->reg == pat->value;
+        case PAT_REG8:
+            return opnd->kind == X86_OPND_REG8 && opnd->reg == pat->value;
+        case PAT_IMM:
+            return opnd->kind == X86_OPND_IMM && opnd->imm == pat->value;
+        case PAT_VAR:
+            if (bound[pat->var])
+                return OperandsEqual(&vars[pat->var], opnd);
+            if (!InClass(opnd, pat->cls))
+                return false;
+            vars[pat->var] = *opnd;
+            bound[pat->var] = true;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static X86_Operand BuildOperand(const Pat_Operand *pat, X86_Operand *vars)
+{
+    X86_Operand opnd = {0};
+    switch (pat->kind)
+	{
+        case PAT_REG:
+            opnd.kind = X86_OPND_REG;
+            opnd.reg = pat->value;
+            break;
+        case PAT_REG8:
+            opnd.kind = X86_OPND_REG8;
+            opnd.reg = pat->value;
+            break;
+        case PAT_IMM:
+            opnd.kind = X86_OPND_IMM;
+            opnd.imm = pat->value;
+            break;
+        case PAT_VAR:
+            opnd = vars[pat->var];
+            break;
+        case PAT_VAR32:
+            opnd = vars[pat->var];
+            opnd.kind = X86_OPND_REG32;
+            break;
+        case PAT_LOG2:
+            opnd.kind = X86_OPND_IMM;
+            while ((1ll << opnd.imm) < vars[pat->var].imm)
+                opnd.imm++;
+            break;
+        default:
+            break;
+    }
+    return opnd;
+}
+
+static bool TryRule(X86_List *list, size_t at, const Peephole_Rule *rule)
+{
+    if (at + rule->match_count > list->count)
+        return false;
+
+    X86_Operand vars[PEEP_MAX_VARS];
+    bool bound[PEEP_MAX_VARS] = {0};
+    for (int k = 0; k < rule->match_count; k++)
+	{
+        X86_Inst *inst = &list->items[at + k];
+        const Pat_Inst *pat = &rule->match[k];
+        if (inst->op != pat->op || inst->src2.kind != X86_OPND_NONE ||
+            !MatchOperand(&pat->dst, &inst->dst, vars, bound) ||
+            !MatchOperand(&pat->src, &inst->src, vars, bound))
+            return false;
+    }
+
+    size_t after = at + rule->match_count;
+    for (int r = 0; r < 16; r++)
+        if ((rule->dead_regs & (1u << r)) && !RegDeadAfter(list, after, r))
+            return false;
+    if (rule->dead_flags && !FlagsDeadAfter(list, after))
+        return false;
+
+    X86_Inst replacement[PEEP_MAX_WINDOW];
+    for (int k = 0; k < rule->replace_count; k++)
+	{
+        const Pat_Inst *pat = &rule->replace[k];
+        if (pat->keep)
+            replacement[k] = list->items[at + pat->keep - 1];
+        else
+            replacement[k] = (X86_Inst){
+                .op = pat->op,
+                .dst = BuildOperand(&pat->dst, vars),
+                .src = BuildOperand(&pat->src, vars),
+                .line = list->items[at].line,
+            };
+    }
+
+    size_t tail = list->count - after;
+    memmove(&list->items[at + rule->replace_count], &list->items[after], tail * sizeof(X86_Inst));
+    memcpy(&list->items[at], replacement, rule->replace_count * sizeof(X86_Inst));
+    list->count = at + rule->replace_count + tail;
+    return true;
+}
+
+// Whatever follows a jmp or ret up to the next label can never run, the
+// epilogue after an explicit return is the usual case
+static void RemoveUnreachable(X86_List *list)
+{
+    size_t out = 0;
+    bool reachable = true;
+    for (size_t i = 0; i < list->count; i++)
+	{
+        X86_Inst *inst = &list->items[i];
+        if (inst->op == X86_LABEL)
+            reachable = true;
+        if (reachable)
+            list->items[out++] = *inst;
+        if (inst->op == X86_JMP || inst->op == X86_RET)
+            reachable = false;
+    }
+    list->count = out;
+}
+
+void X86Peephole(X86_List *list)
+{
+    RemoveUnreachable(list);
+
+    size_t rule_count = sizeof(peephole_rules) / sizeof(peephole_rules[0]);
+    size_t i = 0;
+    while (i < list->count)
+	{
+        bool changed = false;
+        for (size_t r = 0; r < rule_count && !changed; r++)
+            changed = TryRule(list, i, &peephole_rules[r]);
+
+        // A rewrite can complete a pattern that starts a few instructions back
+        if (changed)
+            i = i >= PEEP_MAX_WINDOW ? i - PEEP_MAX_WINDOW : 0;
+        else
+            i++;
+    }
+}
@@ -0,0 +1,456 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Code placement after Pettis and Hansen. Basic blocks are chained along
+// their heaviest edges so the likely successor is the fall-through, chains
+// that never run go to the end of the procedure. Procedures are merged into
+// groups the same way over the call graph, so callers sit next to the
+// callees they use most
+
+#define NONE SIZE_MAX
+
+// Without a profile a block is expected to run 8 times per loop around it
+#define LOOP_WEIGHT_SHIFT 3
+#define MAX_WEIGHT_SHIFT 48
+
+typedef struct {
+    size_t from, to;
+    uint64_t weight;
+} Place_Edge;
+
+typedef struct {
+    Place_Edge *items;
+    size_t count, capacity;
+} Place_Edges;
+
+// Heaviest first, ties in source order so the layout is stable
+static int CompareEdges(const void *a, const void *b)
+{
+    const Place_Edge *x = a, *y = b;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    return x->to < y->to ? -1 : x->to > y->to;
+}
+
+static bool FallsThrough(TAC_Inst *inst)
+	{ return inst->type != TAC_JUMP && inst->type != TAC_RETURN && inst->type != TAC_TAIL_CALL; }
+
+static uint64_t MinWeight(uint64_t a, uint64_t b)
+	{ return a < b ? a : b; }
+
+static uint64_t* BlockWeights(CFG *cfg, const uint64_t *counts)
+{
+    uint64_t *weights = calloc(cfg->count, sizeof(uint64_t));
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        if (!cfg->items[b].reachable)
+            continue;
+        if (counts)
+		{
+            weights[b] = counts[b];
+            continue;
+        }
+        int shift = 0;
+        for (size_t l = 0; l < cfg->loops.count; l++)
+            if (cfg->loops.items[l].blocks[b] && shift < MAX_WEIGHT_SHIFT)
+                shift += LOOP_WEIGHT_SHIFT;
+        weights[b] = 1ull << shift;
+    }
+    return weights;
+}
+
+typedef struct {
+    size_t *next, *prev, *head;
+} Chains;
+
+static Chains ChainsInit(size_t count)
+{
+    Chains c = {
+        .next = malloc(count * sizeof(size_t)),
+        .prev = malloc(count * sizeof(size_t)),
+        .head = malloc(count * sizeof(size_t)),
+    };
+    for (size_t i = 0; i < count; i++)
+	{
+        c.next[i] = c.prev[i] = NONE;
+        c.head[i] = i;
+    }
+    return c;
+}
+
+static void ChainsLink(Chains *c, size_t from, size_t to)
+{
+    c->next[from] = to;
+    c->prev[to] = from;
+    for (size_t i = to; i != NONE; i = c->next[i])
+        c->head[i] = c->head[from];
+}
+
+static void ChainsFree(Chains *c)
+{
+    free(c->next);
+    free(c->prev);
+    free(c->head);
+}
+
+static uint64_t ChainWeight(Chains *c, const uint64_t *weights, size_t head)
+{
+    uint64_t weight = 0;
+    for (size_t i = head; i != NONE; i = c->next[i])
+        if (weights[i] > weight)
+            weight = weights[i];
+    return weight;
+}
+
+typedef struct {
+    size_t head;
+    uint64_t weight;
+} Place_Chain;
+
+// Hot chains first, then the ones that never ran, each in source order
+static int CompareChains(const void *a, const void *b)
+{
+    const Place_Chain *x = a, *y = b;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    return x->head < y->head ? -1 : x->head > y->head;
+}
+
+static int LabelNumber(const char *label)
+	{ return atoi(label + 2); }
+
+// A block's instructions in the old list, with the label and the jump
+// placement may have to add around them
+typedef struct {
+    size_t begin, end;
+    TAC_Inst label, jump;
+    bool has_label, has_jump;
+} Block_Span;
+
+static TAC_Inst* SpanHead(TAC_List *tac, Block_Span *span)
+	{ return span->has_label ? &span->label : &tac->items[span->begin]; }
+
+static TAC_Inst* SpanTail(TAC_List *tac, Block_Span *span)
+	{ return span->has_jump ? &span->jump : &tac->items[span->end - 1]; }
+
+// The block's label, a fresh one when nothing jumped to it before
+static char* BlockLabel(TAC_List *tac, Block_Span *span, int *next_label, Arena *arena)
+{
+    TAC_Inst *head = SpanHead(tac, span);
+    if (head->type == TAC_LABEL)
+        return head->dest;
+    span->label = (TAC_Inst){ .type = TAC_LABEL, .dest = arena_sprintf(arena, ".L%d", (*next_label)++) };
+    span->has_label = true;
+    return span->label.dest;
+}
+
+static bool StartsWith(TAC_List *tac, Block_Span *span, const char *label)
+{
+    TAC_Inst *head = SpanHead(tac, span);
+    return head->type == TAC_LABEL && strcmp(head->dest, label) == 0;
+}
+
+// Rewrites the control flow at the end of every block for its new
+// successor, then drops the jumps that now go to the next block and
+// copies the blocks into a new list in the new order
+static void Relink(Proc_Unit *unit, CFG *cfg, size_t *order, Arena *arena)
+{
+    TAC_List *tac = &unit->tac;
+    int next_label = 0;
+    Block_Span *spans = malloc(cfg->count * sizeof(Block_Span));
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        spans[b] = (Block_Span){ .begin = cfg->items[b].begin, .end = cfg->items[b].end };
+        TAC_Inst *head = SpanHead(tac, &spans[b]);
+        if (head->type == TAC_LABEL && LabelNumber(head->dest) >= next_label)
+            next_label = LabelNumber(head->dest) + 1;
+    }
+
+    for (size_t i = 0; i < cfg->count; i++)
+	{
+        size_t b = order[i];
+        size_t next = i + 1 < cfg->count ? order[i + 1] : NONE;
+        size_t fall = b + 1 < cfg->count ? b + 1 : NONE;
+        TAC_Inst *tail = SpanTail(tac, &spans[b]);
+        if (!FallsThrough(tail) || fall == next)
+            continue;
+
+        bool conditional = tail->type == TAC_JUMP_IF || tail->type == TAC_JUMP_IF_NOT;
+        if (conditional && next != NONE && StartsWith(tac, &spans[next], tail->dest))
+		{
+            tail->type = tail->type == TAC_JUMP_IF ? TAC_JUMP_IF_NOT : TAC_JUMP_IF;
+            tail->dest = BlockLabel(tac, &spans[fall], &next_label, arena);
+            continue;
+        }
+
+        spans[b].jump = (TAC_Inst){ .type = TAC_JUMP, .dest = BlockLabel(tac, &spans[fall], &next_label, arena) };
+        spans[b].has_jump = true;
+    }
+
+    for (size_t i = 0; i + 1 < cfg->count; i++)
+	{
+        Block_Span *span = &spans[order[i]];
+        TAC_Inst *tail = SpanTail(tac, span);
+        if (tail->type != TAC_JUMP || !StartsWith(tac, &spans[order[i + 1]], tail->dest))
+            continue;
+        if (span->has_jump)
+            span->has_jump = false;
+        else
+            span->end--;
+    }
+
+    TAC_List out = {0};
+    for (size_t i = 0; i < cfg->count; i++)
+	{
+        Block_Span *span = &spans[order[i]];
+        if (span->has_label)
+            arena_da_append(arena, &out, span->label);
+        for (size_t k = span->begin; k < span->end; k++)
+            arena_da_append(arena, &out, tac->items[k]);
+        if (span->has_jump)
+            arena_da_append(arena, &out, span->jump);
+    }
+    *tac = out;
+    free(spans);
+}
+
+// Chains grow along the heaviest edges first. The entry block stays in
+// front, and a last block that runs into the epilogue stays last
+void PlaceBlocks(Proc_Unit *unit, const uint64_t *counts, Arena *arena)
+{
+    CFG cfg;
+    CFGBuild(&cfg, &unit->tac);
+    if (cfg.count == 0)
+        return;
+    CFGFindLoops(&cfg);
+    uint64_t *weights = BlockWeights(&cfg, counts);
+
+    for (size_t b = 0; b < cfg.count; b++)
+	{
+        for (size_t i = cfg.items[b].begin; i < cfg.items[b].end; i++)
+		{
+            TAC_Inst *inst = &unit->tac.items[i];
+            if (inst->type != TAC_CALL && inst->type != TAC_TAIL_CALL)
+                continue;
+            Call_Site site = { .callee = inst->src1, .weight = weights[b] };
+            arena_da_append(arena, &unit->calls, site);
+        }
+    }
+
+    Place_Edges edges = {0};
+    for (size_t b = 0; b < cfg.count; b++)
+	{
+        Basic_Block *block = &cfg.items[b];
+        for (size_t i = 0; block->reachable && i < block->succs.count; i++)
+		{
+            // Back edges stay jumps, a loop keeps its header on top
+            size_t s = block->succs.items[i];
+            if (s != 0 && !CFGDominates(&cfg, s, b))
+			{
+                Place_Edge edge = { b, s, MinWeight(weights[b], weights[s]) };
+                nob_da_append(&edges, edge);
+            }
+        }
+    }
+    qsort(edges.items, edges.count, sizeof(edges.items[0]), CompareEdges);
+
+    size_t pinned = FallsThrough(&unit->tac.items[cfg.items[cfg.count - 1].end - 1]) ? cfg.count - 1 : NONE;
+    Chains chains = ChainsInit(cfg.count);
+    for (size_t i = 0; i < edges.count; i++)
+	{
+        size_t from = edges.items[i].from, to = edges.items[i].to;
+        if (chains.next[from] != NONE || chains.prev[to] != NONE || from == pinned ||
+            chains.head[from] == chains.head[to])
+            continue;
+        if (pinned != NONE && chains.head[from] == 0 && chains.head[to] == chains.head[pinned])
+            continue;
+        ChainsLink(&chains, from, to);
+    }
+
+    // Chains by their hottest block, the entry and pinned chains at the ends
+    Place_Chain *heads = malloc(cfg.count * sizeof(Place_Chain));
+    size_t head_count = 0;
+    size_t pinned_head = pinned != NONE ? chains.head[pinned] : NONE;
+    for (size_t b = 1; b < cfg.count; b++)
+        if (chains.prev[b] == NONE && b != pinned_head)
+            heads[head_count++] = (Place_Chain){ b, ChainWeight(&chains, weights, b) };
+    qsort(heads, head_count, sizeof(heads[0]), CompareChains);
+
+    size_t *order = malloc(cfg.count * sizeof(size_t));
+    size_t placed = 0;
+    for (size_t b = 0; b != NONE; b = chains.next[b])
+        order[placed++] = b;
+    for (size_t h = 0; h < head_count; h++)
+        for (size_t b = heads[h].head; b != NONE; b = chains.next[b])
+            order[placed++] = b;
+    if (pinned_head != NONE && pinned_head != 0)
+        for (size_t b = pinned_head; b != NONE; b = chains.next[b])
+            order[placed++] = b;
+
+    Relink(unit, &cfg, order, arena);
+
+    free(order);
+    free(heads);
+    ChainsFree(&chains);
+    nob_da_free(edges);
+    free(weights);
+    CFGFree(&cfg);
+}
+
+static const char* UnitName(Proc_Unit *unit)
+	{ return unit->node->name ? unit->node->name : ""; }
+
+static Proc_Unit *name_units;
+
+static int CompareUnitNames(const void *a, const void *b)
+	{ return strcmp(UnitName(&name_units[*(const size_t*)a]), UnitName(&name_units[*(const size_t*)b])); }
+
+static size_t FindUnit(Proc_Unit *units, size_t *by_name, size_t count, const char *name)
+{
+    size_t low = 0, high = count;
+    while (low < high)
+	{
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(UnitName(&units[by_name[mid]]), name);
+        if (cmp == 0)
+            return by_name[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NONE;
+}
+
+static int CompareEnds(const void *a, const void *b)
+{
+    const Place_Edge *x = a, *y = b;
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    return x->to < y->to ? -1 : x->to > y->to;
+}
+
+// Calls between two procedures in either direction add up to one edge
+static void CallEdges(Proc_Unit *units, size_t count, Place_Edges *edges)
+{
+    size_t *by_name = malloc(count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++)
+        by_name[i] = i;
+    name_units = units;
+    qsort(by_name, count, sizeof(by_name[0]), CompareUnitNames);
+
+    Place_Edges calls = {0};
+    for (size_t i = 0; i < count; i++)
+	{
+        for (size_t c = 0; c < units[i].calls.count; c++)
+		{
+            Call_Site *site = &units[i].calls.items[c];
+            size_t callee = FindUnit(units, by_name, count, site->callee);
+            if (callee == NONE || callee == i)
+                continue;
+            Place_Edge edge = { i < callee ? i : callee, i < callee ? callee : i, site->weight };
+            nob_da_append(&calls, edge);
+        }
+    }
+    qsort(calls.items, calls.count, sizeof(calls.items[0]), CompareEnds);
+
+    for (size_t i = 0; i < calls.count; i++)
+	{
+        Place_Edge *last = edges->count > 0 ? &edges->items[edges->count - 1] : NULL;
+        if (last && CompareEnds(last, &calls.items[i]) == 0)
+            last->weight += calls.items[i].weight;
+        else
+            nob_da_append(edges, calls.items[i]);
+    }
+    nob_da_free(calls);
+    free(by_name);
+}
+
+// Procedure groups grow along the heaviest call edges. Merging two groups
+// picks whichever of the four orientations puts the two procedures closest
+void PlaceProcs(Proc_Unit *units, size_t count)
+{
+    if (count < 2)
+        return;
+
+    Place_Edges edges = {0};
+    CallEdges(units, count, &edges);
+    qsort(edges.items, edges.count, sizeof(edges.items[0]), CompareEdges);
+
+    // Every group is a list of unit indices, group[i] is the one unit i is in
+    size_t *group = malloc(count * sizeof(size_t));
+    size_t **members = malloc(count * sizeof(size_t*));
+    size_t *sizes = malloc(count * sizeof(size_t));
+    Place_Chain *groups = malloc(count * sizeof(Place_Chain));
+    for (size_t i = 0; i < count; i++)
+	{
+        group[i] = i;
+        members[i] = malloc(sizeof(size_t));
+        members[i][0] = i;
+        sizes[i] = 1;
+        groups[i] = (Place_Chain){ i, 0 };
+    }
+
+    for (size_t e = 0; e < edges.count; e++)
+	{
+        size_t a = group[edges.items[e].from], b = group[edges.items[e].to];
+        groups[a].weight += edges.items[e].weight;
+        if (a == b)
+            continue;
+
+        size_t pa = 0, pb = 0;
+        while (members[a][pa] != edges.items[e].from)
+            pa++;
+        while (members[b][pb] != edges.items[e].to)
+            pb++;
+        size_t la = sizes[a], lb = sizes[b];
+        size_t gaps[4] = { la - 1 - pa + pb, la - 1 - pa + lb - 1 - pb, pa + pb, pa + lb - 1 - pb };
+        int best = 0;
+        for (int k = 1; k < 4; k++)
+            if (gaps[k] < gaps[best])
+                best = k;
+
+        size_t *merged = malloc((la + lb) * sizeof(size_t));
+        bool flip_a = best >= 2, flip_b = best == 1 || best == 3;
+        for (size_t k = 0; k < la; k++)
+            merged[k] = members[a][flip_a ? la - 1 - k : k];
+        for (size_t k = 0; k < lb; k++)
+		{
+            merged[la + k] = members[b][flip_b ? lb - 1 - k : k];
+            group[merged[la + k]] = a;
+        }
+        free(members[a]);
+        members[a] = merged;
+        sizes[a] = la + lb;
+        groups[a].weight += groups[b].weight;
+        sizes[b] = 0;
+    }
+
+    // Heaviest groups first, procedures that make no calls keep their order
+    size_t group_count = 0;
+    for (size_t i = 0; i < count; i++)
+        if (sizes[i] > 0)
+            groups[group_count++] = groups[i];
+    qsort(groups, group_count, sizeof(groups[0]), CompareChains);
+
+    Proc_Unit *placed = malloc(count * sizeof(Proc_Unit));
+    size_t n = 0;
+    for (size_t g = 0; g < group_count; g++)
+        for (size_t k = 0; k < sizes[groups[g].head]; k++)
+            placed[n++] = units[members[groups[g].head][k]];
+    memcpy(units, placed, count * sizeof(Proc_Unit));
+
+    for (size_t i = 0; i < count; i++)
+        free(members[i]);
+    free(placed);
+    free(groups);
+    free(members);
+    free(sizes);
+    free(group);
+    nob_da_free(edges);
+}
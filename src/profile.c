@@ -0,0 +1,79 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Profile guided builds. --instrument puts a counter at the head of every
+// basic block, the program dumps them on exit as a profile file:
+//
+//     magic, hash, count, count qwords of block counts
+//
+// --profile-use reads the file back. The counts only line up with the
+// blocks of the same program built with the same options, which is what
+// the hash checks
+
+uint64_t ProfileHash(AST_Node *program, const Compile_Options *opts)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    int64_t shape[] = { opts->opt_level, opts->avx2, opts->bounds_check };
+    for (size_t i = 0; i < sizeof(shape) / sizeof(shape[0]); i++)
+        hash = (hash ^ (uint64_t)shape[i]) * 0x100000001b3ull;
+    return ASTHash(program, hash);
+}
+
+bool ProfileLoad(Profile *profile, const char *path)
+{
+    Nob_String_Builder sb = {0};
+    if (!nob_read_entire_file(path, &sb))
+        return false;
+
+    uint64_t header[3];
+    bool ok = sb.count >= sizeof(header);
+    if (ok)
+	{
+        memcpy(header, sb.items, sizeof(header));
+        ok = header[0] == PROFILE_MAGIC && sb.count == sizeof(header) + header[2] * sizeof(uint64_t);
+    }
+    if (!ok)
+	{
+        nob_log(NOB_ERROR, "%s is not a profile", path);
+        nob_sb_free(sb);
+        return false;
+    }
+
+    profile->hash = header[1];
+    profile->count = header[2];
+    profile->counts = malloc(profile->count * sizeof(uint64_t));
+    memcpy(profile->counts, sb.items + sizeof(header), profile->count * sizeof(uint64_t));
+    nob_sb_free(sb);
+    return true;
+}
+
+bool ProfileWrite(const char *path, uint64_t hash, const uint64_t *counts, size_t count)
+{
+    Nob_String_Builder sb = {0};
+    uint64_t header[3] = { PROFILE_MAGIC, hash, count };
+    nob_sb_append_buf(&sb, header, sizeof(header));
+    nob_sb_append_buf(&sb, counts, count * sizeof(uint64_t));
+    bool ok = nob_write_entire_file(path, sb.items, sb.count);
+    nob_sb_free(sb);
+    return ok;
+}
+
+// Block b of the procedure counts into counter base + b. The increment goes
+// after the block's label so every edge into the block passes it
+void ProfileInstrument(TAC_List *tac, CFG *cfg, size_t base, Arena *arena)
+{
+    TAC_Edit edit;
+    TACEditInit(&edit, tac);
+    for (size_t b = 0; b < cfg->count; b++)
+	{
+        size_t begin = cfg->items[b].begin;
+        TAC_Inst count = { .type = TAC_COUNT, .num = (int64_t)(base + b) };
+        if (tac->items[begin].type == TAC_LABEL)
+            begin++;
+        TACEditInsert(&edit, begin, count);
+    }
+    TACEditApply(&edit, tac, arena);
+}
@@ -1,17 +1,37 @@
 #define TAC_DEF
 #include <cmpl.h>
 #include <nob.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 void TACInit(TAC_Builder *tb, Arena *arena) 
 {
-    tb->head = NULL;
-    tb->tail = NULL;
+    tb->list = (TAC_List){0};
     tb->temp_count = 0;
+    tb->label_count = 0;
+    tb->loop_depth = 0;
+    tb->line = 0;
+    tb->aliases.items = NULL;
+    tb->aliases.count = tb->aliases.capacity = 0;
+    tb->var_types.items = NULL;
+    tb->var_types.count = tb->var_types.capacity = 0;
+    tb->opts = NULL;
+    tb->types = NULL;
+    tb->had_err = false;
     tb->arena = arena;
 }
 
+// for loop iterators get a name of their own so nested loops can shadow 'it'
+static char* ResolveName(TAC_Builder *tb, const char *name)
+{
+    for (size_t i = tb->aliases.count; i-- > 0;)
+        if (strcmp(tb->aliases.items[i].name, name) == 0)
+            return tb->aliases.items[i].alias;
+    return arena_strdup(tb->arena, name);
+}
+
 static char* NewTemp(TAC_Builder *tb) 
 {
     char buffer[32];
@@ -19,10 +39,17 @@ static char* NewTemp(TAC_Builder *tb)
     return arena_strdup(tb->arena, buffer);
 }
 
-int TACGetMaxTemp(TAC_Inst *tac) 
+static char* NewLabel(TAC_Builder *tb) 
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), ".L%d", tb->label_count++);
+    return arena_strdup(tb->arena, buffer);
+}
+
+int TACGetMaxTemp(TAC_List *tac) 
 {
     int max_temp = -1;
-    for (TAC_Inst *inst = tac; inst != NULL; inst = inst->next) 
+    for (TAC_Inst *inst = tac->items; inst < tac->items + tac->count; inst++) 
 	{
         const char *fields[] = { 
 			inst->dest, 
@@ -44,23 +71,261 @@ int TACGetMaxTemp(TAC_Inst *tac)
     return max_temp;
 }
 
-static void TACAppend(TAC_Builder *tb, TAC_Inst *inst) 
+// Instructions are filled in on the stack and copied to the list, the
+// pointer returned is good until the next append
+static TAC_Inst* TACAppend(TAC_Builder *tb, TAC_Inst *inst) 
+{
+    arena_da_append(tb->arena, &tb->list, *inst);
+    return &tb->list.items[tb->list.count - 1];
+}
+
+static TAC_Inst TACCreate(TAC_Builder *tb, TAC_Op type) 
+	{ return (TAC_Inst){ .type = type, .line = tb->line }; }
+
+static TAC_Inst* TACLast(TAC_Builder *tb)
+	{ return &tb->list.items[tb->list.count - 1]; }
+
+static TAC_Var_Type* FindVarType(TAC_Builder *tb, const char *name)
+{
+    for (size_t i = tb->var_types.count; i-- > 0;)
+        if (strcmp(tb->var_types.items[i].name, name) == 0)
+            return &tb->var_types.items[i];
+    return NULL;
+}
+
+static bool ArrayIsSlice(TAC_Builder *tb, const char *name)
+{
+    TAC_Var_Type *var = FindVarType(tb, name);
+    return var && var->slice;
+}
+
+static TypeInfo* VarStruct(TAC_Builder *tb, const char *name, int64_t *length)
+{
+    TAC_Var_Type *var = FindVarType(tb, name);
+    if (!var)
+        return NULL;
+    TypeInfo *type = LayoutFindType(tb->types, var->type);
+    *length = var->length;
+    return type && type->fields.count > 0 ? type : NULL;
+}
+
+// A resolved field: [base slot + offset + index*stride], index is the
+// element expression for arrays of structs and NULL otherwise
+typedef struct {
+    char *base;
+    AST_Node *index;
+    int64_t offset, length;
+    uint32_t size, stride;
+} Field_Ref;
+
+// The vectorizer probes fields without reporting, lowering reports later
+static Field_Info* FieldError(TAC_Builder *tb, bool report, const char *fmt, ...)
 {
-    if (!tb->head) 
-        tb->head = tb->tail = inst;
-	else 
+    if (report)
 	{
-        tb->tail->next = inst;
-        tb->tail = inst;
+        char message[256];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(message, sizeof(message), fmt, args);
+        va_end(args);
+        nob_log(NOB_ERROR, "%s", message);
+        tb->had_err = true;
     }
+    return NULL;
 }
 
-static TAC_Inst* TACCreate(TAC_Builder *tb, TAC_Op type) 
+// Walks a.b.c or a[i].b.c down to the struct variable a, the offsets of
+// every field on the way add up to one fixed displacement. Elements of
+// arrays are struct sized apart, or field sized apart in #soa arrays
+static Field_Info* ResolveField(TAC_Builder *tb, AST_Node *node, Field_Ref *ref, bool report)
 {
-    TAC_Inst *inst = arena_alloc(tb->arena, sizeof(TAC_Inst));
-    memset(inst, 0, sizeof(TAC_Inst));
-    inst->type = type;
-    return inst;
+    AST_Node *left = node->left;
+    Field_Info *field = NULL;
+    if (left && left->type == AST_FIELD_ACCESS)
+	{
+        Field_Info *outer = ResolveField(tb, left, ref, report);
+        if (!outer)
+            return NULL;
+        TypeInfo *type = LayoutFindType(tb->types, outer->type);
+        if (type->fields.count == 0)
+            return FieldError(tb, report, "Field '%s' is not a struct", outer->name);
+        field = LayoutFindField(type, node->name);
+        if (!field)
+            return FieldError(tb, report, "Struct '%s' has no field '%s'", type->name, node->name);
+        ref->offset += field->offset;
+        ref->size = (uint32_t)field->size;
+        return field;
+    }
+
+    bool element = left && left->type == AST_INDEX;
+    AST_Node *var = element ? left->left : left;
+    if (!var || var->type != AST_ID)
+        return FieldError(tb, report, "Only named struct variables have fields");
+
+    int64_t length = 0;
+    TypeInfo *type = VarStruct(tb, var->name, &length);
+    if (!type)
+        return FieldError(tb, report, "'%s' is not a struct variable", var->name);
+    if (element && length == 0)
+        return FieldError(tb, report, "'%s' is not an array", var->name);
+    if (!element && length > 0)
+        return FieldError(tb, report, "'%s' is an array, index it to reach the fields", var->name);
+
+    field = LayoutFindField(type, node->name);
+    if (!field)
+        return FieldError(tb, report, "Struct '%s' has no field '%s'", type->name, node->name);
+
+    *ref = (Field_Ref){
+        .base = ResolveName(tb, var->name),
+        .index = element ? left->right : NULL,
+        .offset = element ? (int64_t)LayoutArrayField(type, field, length) : (int64_t)field->offset,
+        .length = length,
+        .size = (uint32_t)field->size,
+        .stride = element ? (uint32_t)(type->soa ? field->size : type->size) : 0,
+    };
+    return field;
+}
+
+// Loads and stores move one scalar, whole structs don't fit a register
+static Field_Info* ResolveScalarField(TAC_Builder *tb, AST_Node *node, Field_Ref *ref)
+{
+    Field_Info *field = ResolveField(tb, node, ref, true);
+    if (field && LayoutFindType(tb->types, field->type)->fields.count > 0)
+        return FieldError(tb, true, "Field '%s' is a struct, only scalar fields can be read or written", node->name);
+    return field;
+}
+
+static bool IsConstOperand(const char *s)
+	{ return s && ((s[0] >= '0' && s[0] <= '9') || s[0] == '-'); }
+
+static char* SliceField(TAC_Builder *tb, char *slice, int64_t offset)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_LOAD_FIELD);
+    inst.dest = NewTemp(tb);
+    inst.src1 = slice;
+    inst.offset = offset;
+    inst.size = 8;
+    if (offset == SLICE_COUNT_OFFSET)
+        inst.flags |= TAC_FLAG_COUNT;
+    TACAppend(tb, &inst);
+    return inst.dest;
+}
+
+static void StoreSliceField(TAC_Builder *tb, char *slice, int64_t offset, char *value)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_STORE_FIELD);
+    inst.dest = slice;
+    inst.src2 = value;
+    inst.offset = offset;
+    inst.size = 8;
+    TACAppend(tb, &inst);
+}
+
+// Element count of a fixed array or slice, NULL for anything else
+static char* ArrayCount(TAC_Builder *tb, const char *name)
+{
+    TAC_Var_Type *var = FindVarType(tb, name);
+    if (var && var->slice)
+        return SliceField(tb, ResolveName(tb, name), SLICE_COUNT_OFFSET);
+    if (var && var->length > 0)
+        return arena_sprintf(tb->arena, "%ld", var->length);
+    return NULL;
+}
+
+static void EmitCheck(TAC_Builder *tb, char *index, char *count)
+{
+    if (IsConstOperand(index) && IsConstOperand(count) && strtoll(index, NULL, 10) >= 0 && 
+        strtoll(index, NULL, 10) < strtoll(count, NULL, 10))
+        return;
+
+    TAC_Inst inst = TACCreate(tb, TAC_BOUNDS_CHECK);
+    inst.src1 = index;
+    inst.src2 = count;
+    TACAppend(tb, &inst);
+}
+
+// Indices are checked unsigned against the count, which catches negative
+// ones too. Constant indices into fixed arrays are checked right here
+static void EmitBoundsCheck(TAC_Builder *tb, const char *name, int64_t length, bool slice, char *index)
+{
+    if (!slice && IsConstOperand(index))
+	{
+        int64_t value = strtoll(index, NULL, 10);
+        if (value < 0 || value >= length)
+		{
+            nob_log(NOB_ERROR, "Index %ld is out of bounds for '%s' of length %ld", value, name, length);
+            tb->had_err = true;
+        }
+        return;
+    }
+    if (!tb->opts || !tb->opts->bounds_check)
+        return;
+
+    EmitCheck(tb, index, slice ? SliceField(tb, ResolveName(tb, name), SLICE_COUNT_OFFSET) : 
+                                 arena_sprintf(tb->arena, "%ld", length));
+}
+
+// Element access through a[i]: the array or slice variable being indexed,
+// NULL after reporting when there is none
+static TAC_Var_Type* IndexedArray(TAC_Builder *tb, AST_Node *node, const char *verb)
+{
+    int64_t length;
+    if (!node->left || node->left->type != AST_ID)
+	{
+        nob_log(NOB_ERROR, "Only named arrays can be indexed");
+        tb->had_err = true;
+        return NULL;
+    }
+    if (VarStruct(tb, node->left->name, &length))
+	{
+        nob_log(NOB_ERROR, "Elements of '%s' can only be %s through their fields", node->left->name, verb);
+        tb->had_err = true;
+        return NULL;
+    }
+    TAC_Var_Type *var = FindVarType(tb, node->left->name);
+    if (!var || (!var->slice && var->length == 0))
+	{
+        nob_log(NOB_ERROR, "'%s' is not an array or slice", node->left->name);
+        tb->had_err = true;
+        return NULL;
+    }
+    return var;
+}
+
+// The { data, count } pair a fixed array or slice passes as, a fixed array
+// contributes its address and constant length
+static bool SliceParts(TAC_Builder *tb, AST_Node *node, char **data, char **count)
+{
+    int64_t length;
+    TAC_Var_Type *var = node && node->type == AST_ID ? FindVarType(tb, node->name) : NULL;
+    if (!var || (!var->slice && var->length == 0) || VarStruct(tb, node->name, &length))
+	{
+        nob_log(NOB_ERROR, "Slices can only be made from arrays of scalars or other slices");
+        tb->had_err = true;
+        return false;
+    }
+
+    char *name = ResolveName(tb, node->name);
+    if (var->slice)
+	{
+        *data = SliceField(tb, name, 0);
+        *count = SliceField(tb, name, SLICE_COUNT_OFFSET);
+        return true;
+    }
+
+    TAC_Inst inst = TACCreate(tb, TAC_ADDR);
+    inst.dest = NewTemp(tb);
+    inst.src1 = name;
+    TACAppend(tb, &inst);
+    *data = inst.dest;
+    *count = arena_sprintf(tb->arena, "%ld", var->length);
+    return true;
+}
+
+static bool IsArrayArg(TAC_Builder *tb, AST_Node *node)
+{
+    TAC_Var_Type *var = node->type == AST_ID ? FindVarType(tb, node->name) : NULL;
+    return var && (var->slice || var->length > 0);
 }
 
 char* ExprToTAC(TAC_Builder *tb, AST_Node *node) 
@@ -78,7 +343,52 @@ char* ExprToTAC(TAC_Builder *tb, AST_Node *node)
 		}
         
         case AST_ID: 
-            return arena_strdup(tb->arena, node->name);
+            return ResolveName(tb, node->name);
+        
+        case AST_INDEX: 
+		{
+			TAC_Var_Type *var = IndexedArray(tb, node, "read");
+			if (!var)
+				return NULL;
+			char *index = ExprToTAC(tb, node->right);
+			EmitBoundsCheck(tb, node->left->name, var->length, var->slice, index);
+
+			TAC_Inst inst = TACCreate(tb, TAC_LOAD);
+			inst.dest = NewTemp(tb);
+			inst.src1 = ResolveName(tb, node->left->name);
+			inst.src2 = index;
+			if (var->slice)
+				inst.flags |= TAC_FLAG_SLICE;
+			TACAppend(tb, &inst);
+			return inst.dest;
+		}
+        
+        case AST_FIELD_ACCESS: 
+		{
+			if (node->left && node->left->type == AST_ID && strcmp(node->name, "count") == 0)
+			{
+				char *count = ArrayCount(tb, node->left->name);
+				if (count)
+					return count;
+			}
+
+			Field_Ref ref;
+			if (!ResolveScalarField(tb, node, &ref))
+				return NULL;
+			char *index = ref.index ? ExprToTAC(tb, ref.index) : NULL;
+			if (index)
+				EmitBoundsCheck(tb, ref.base, ref.length, false, index);
+
+			TAC_Inst inst = TACCreate(tb, TAC_LOAD_FIELD);
+			inst.dest = NewTemp(tb);
+			inst.src1 = ref.base;
+			inst.src2 = index;
+			inst.offset = ref.offset;
+			inst.size = ref.size;
+			inst.stride = ref.stride;
+			TACAppend(tb, &inst);
+			return inst.dest;
+		}
         
         case AST_BIN_OP: 
 		{
@@ -86,12 +396,12 @@ char* ExprToTAC(TAC_Builder *tb, AST_Node *node)
 			char *right = ExprToTAC(tb, node->right);
 			char *result = NewTemp(tb);
 
-			TAC_Inst *inst = TACCreate(tb, TAC_BINOP);
-			inst->dest = result;
-			inst->src1 = left;
-			inst->src2 = right;
-			inst->op = arena_strdup(tb->arena, node->name);
-			TACAppend(tb, inst);
+			TAC_Inst inst = TACCreate(tb, TAC_BINOP);
+			inst.dest = result;
+			inst.src1 = left;
+			inst.src2 = right;
+			inst.op = ASTOpName(node->op);
+			TACAppend(tb, &inst);
 			return result;
 		}
         
@@ -99,12 +409,54 @@ char* ExprToTAC(TAC_Builder *tb, AST_Node *node)
 		{
 			if (node->left && node->left->type == AST_ID) 
 			{
+				size_t argc = node->children.used;
+
+				// Arguments are fully evaluated before any of them is moved into
+				// its register, nested calls would clobber rdi..r9 otherwise.
+				// Arrays and slices pass as a data, count pair
+				char **args = arena_alloc(tb->arena, (argc ? argc : 1) * 2 * sizeof(char*));
+				memset(args, 0, (argc ? argc : 1) * 2 * sizeof(char*));
+				int words = 0;
+				bool views = false;
+				for (size_t i = 0; i < argc; i++)
+				{
+					AST_Node *arg = node->children.data[i];
+					if (IsArrayArg(tb, arg))
+					{
+						SliceParts(tb, arg, &args[words], &args[words + 1]);
+						words += 2;
+						views = true;
+					}
+					else
+						args[words++] = ExprToTAC(tb, arg);
+				}
+
+				int regs = 0, stack = 0, next = 0;
+				for (size_t i = 0; i < argc; i++)
+				{
+					int arg_words = IsArrayArg(tb, node->children.data[i]) ? 2 : 1;
+					int pos = LayoutArgPosition(&regs, &stack, arg_words);
+					for (int w = 0; w < arg_words; w++)
+					{
+						TAC_Inst param = TACCreate(tb, TAC_PARAM);
+						param.src1 = args[next++];
+						param.num = pos + w;
+						TACAppend(tb, &param);
+					}
+				}
+
 				char *result = NewTemp(tb);
 
-				TAC_Inst *inst = TACCreate(tb, TAC_CALL);
-				inst->dest = result;
-				inst->src1 = arena_strdup(tb->arena, node->left->name);
-				TACAppend(tb, inst);
+				TAC_Inst inst = TACCreate(tb, TAC_CALL);
+				inst.dest = result;
+				inst.src1 = arena_strdup(tb->arena, node->left->name);
+				inst.num = words;
+				if (node->flags & AST_FLAG_TAIL)
+					inst.flags |= TAC_FLAG_MUST_TAIL;
+				// A view may point into this frame, which a tail call tears down
+				if ((node->flags & AST_FLAG_NO_TAIL) || views)
+					inst.flags |= TAC_FLAG_NO_TAIL;
+				TACAppend(tb, &inst);
 
 				return result;
 			}
@@ -113,49 +465,637 @@ char* ExprToTAC(TAC_Builder *tb, AST_Node *node)
         
         default:
             nob_log(NOB_ERROR, "Unsupported expression type in TAC: %d", node->type);
+            tb->had_err = true;
             return NULL;
     }
 }
 
+static void EmitLabel(TAC_Builder *tb, char *label)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_LABEL);
+    inst.dest = label;
+    TACAppend(tb, &inst);
+}
+
+static void EmitCompareJump(TAC_Builder *tb, TAC_Op type, char *left, const char *op, char *right, char *label)
+{
+    TAC_Inst inst = TACCreate(tb, type);
+    inst.src1 = left;
+    inst.src2 = right;
+    inst.op = arena_strdup(tb->arena, op);
+    inst.dest = label;
+    TACAppend(tb, &inst);
+}
+
+static char* EmitCopy(TAC_Builder *tb, char *dest, char *src)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_COPY);
+    inst.dest = dest;
+    inst.src1 = src;
+    TACAppend(tb, &inst);
+    return dest;
+}
+
+static char* EmitBinOp(TAC_Builder *tb, char *left, const char *op, char *right)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_BINOP);
+    inst.dest = NewTemp(tb);
+    inst.src1 = left;
+    inst.src2 = right;
+    inst.op = arena_strdup(tb->arena, op);
+    TACAppend(tb, &inst);
+    return inst.dest;
+}
+
+static void EmitJump(TAC_Builder *tb, char *label)
+{
+    TAC_Inst inst = TACCreate(tb, TAC_JUMP);
+    inst.dest = label;
+    TACAppend(tb, &inst);
+}
+
+static char* NewIterator(TAC_Builder *tb, AST_Node *node, char *init)
+{
+    char *iter = arena_sprintf(tb->arena, "%s__%d", node->name, tb->label_count);
+    EmitCopy(tb, iter, init);
+    TACLast(tb)->flags |= TAC_FLAG_ITERATOR;
+    TACLast(tb)->num = tb->loop_depth;
+    return iter;
+}
+
+static void RangeBodyToTAC(TAC_Builder *tb, AST_Node *node, char *iter)
+{
+    TAC_Alias alias = { .name = node->name, .alias = iter };
+    arena_da_append(tb->arena, &tb->aliases, alias);
+    tb->loop_depth++;
+    StmtToTAC(tb, node->body);
+    tb->loop_depth--;
+    tb->aliases.count--;
+}
+
+static void StepIterator(TAC_Builder *tb, char *iter, const char *op, char *step)
+	{ EmitCopy(tb, iter, EmitBinOp(tb, iter, op, step)); }
+
+// One iteration per trip from the current iterator value through limit,
+// runs whatever is left over by the unrolled and vectorized loops
+static void RangeRestToTAC(TAC_Builder *tb, AST_Node *node, char *iter, const char *cmp, char *limit, 
+                           char *exit_label)
+{
+    char *head_label = NewLabel(tb);
+    EmitCompareJump(tb, TAC_JUMP_IF_NOT, iter, cmp, limit, exit_label);
+    EmitLabel(tb, head_label);
+    RangeBodyToTAC(tb, node, iter);
+    StepIterator(tb, iter, strcmp(cmp, "<=") == 0 ? "+" : "-", "1");
+    EmitCompareJump(tb, TAC_JUMP_IF, iter, cmp, limit, head_label);
+}
+
+// #unroll: UNROLL_FACTOR copies of the body per trip for as long as that many
+// iterations remain, the bottom test runs once per copy set
+static void ForRangeUnrolledToTAC(TAC_Builder *tb, AST_Node *node, char *start, char *end)
+{
+    bool reverse = node->flags & AST_FLAG_REVERSE;
+    const char *cmp = reverse ? ">=" : "<=";
+    char *limit = reverse ? start : end;
+    char *head_label = NewLabel(tb);
+    char *rest_label = NewLabel(tb);
+    char *exit_label = NewLabel(tb);
+
+    char *span = arena_sprintf(tb->arena, "%d", UNROLL_FACTOR - 1);
+    char *last = EmitBinOp(tb, limit, reverse ? "+" : "-", span);
+    char *iter = NewIterator(tb, node, reverse ? end : start);
+
+    EmitCompareJump(tb, TAC_JUMP_IF_NOT, iter, cmp, last, rest_label);
+    EmitLabel(tb, head_label);
+    for (int i = 0; i < UNROLL_FACTOR; i++)
+	{
+        RangeBodyToTAC(tb, node, iter);
+        StepIterator(tb, iter, reverse ? "-" : "+", "1");
+    }
+    EmitCompareJump(tb, TAC_JUMP_IF, iter, cmp, last, head_label);
+
+    EmitLabel(tb, rest_label);
+    RangeRestToTAC(tb, node, iter, cmp, limit, exit_label);
+    EmitLabel(tb, exit_label);
+}
+
+static AST_Node** LoopStatements(AST_Node *loop, size_t *count)
+{
+    if (loop->body && loop->body->type == AST_BLOCK)
+	{
+        *count = loop->body->children.used;
+        return loop->body->children.data;
+    }
+    *count = loop->body ? 1 : 0;
+    return &loop->body;
+}
+
+// Scalars the vectorized loop can compute once and broadcast: no element
+// reads, no calls and no reference to the iterator
+static bool IsLoopInvariantExpr(AST_Node *node, const char *iter)
+{
+    switch (node->type)
+	{
+        case AST_NUM:
+            return true;
+        case AST_ID:
+            return strcmp(node->name, iter) != 0;
+        case AST_BIN_OP:
+            return node->left && IsLoopInvariantExpr(node->left, iter) && 
+                   IsLoopInvariantExpr(node->right, iter);
+        default:
+            return false;
+    }
+}
+
+// Fields of #soa arrays indexed by the iterator are consecutive qwords, the
+// same as a plain array that starts at the field's offset
+static bool IsFieldStream(TAC_Builder *tb, AST_Node *node, const char *iter)
+{
+    Field_Ref ref;
+    Field_Info *field = ResolveField(tb, node, &ref, false);
+    return field && LayoutFindType(tb->types, field->type)->fields.count == 0 &&
+           ref.index && ref.index->type == AST_ID && strcmp(ref.index->name, iter) == 0 && 
+           ref.stride == 8 && ref.size == 8;
+}
+
+// Peak number of vector registers VecExprToTAC needs for node, -1 when the
+// expression has no packed form. Broadcast invariants live in registers of
+// their own, counted by CountSplats
+static int VecRegsNeeded(TAC_Builder *tb, AST_Node *node, const char *iter)
+{
+    if (IsLoopInvariantExpr(node, iter))
+        return 0;
+
+    // Slices would need their data pointer loaded for every access
+    if (node->type == AST_INDEX)
+        return node->left->type == AST_ID && node->right->type == AST_ID && 
+               strcmp(node->right->name, iter) == 0 && !ArrayIsSlice(tb, node->left->name) ? 1 : -1;
+
+    if (node->type == AST_FIELD_ACCESS)
+        return IsFieldStream(tb, node, iter) ? 1 : -1;
+
+    // There is no packed 64-bit multiply before AVX-512
+    if (node->type != AST_BIN_OP || !node->left || 
+        (node->op != AST_OP_ADD && node->op != AST_OP_SUB))
+        return -1;
+
+    int left = VecRegsNeeded(tb, node->left, iter);
+    int right = VecRegsNeeded(tb, node->right, iter);
+    if (left < 0 || right < 0)
+        return -1;
+    return left > right + 1 ? left : right + 1;
+}
+
+static int CountSplats(AST_Node *node, const char *iter)
+{
+    if (IsLoopInvariantExpr(node, iter))
+        return 1;
+    if (node->type == AST_BIN_OP)
+        return CountSplats(node->left, iter) + CountSplats(node->right, iter);
+    return 0;
+}
+
+// Element-wise bodies only: every statement stores to a[it] and reads other
+// arrays at [it] too, so no iteration depends on another
+static bool IsVectorizable(TAC_Builder *tb, AST_Node *loop)
+{
+    if (loop->flags & AST_FLAG_REVERSE)
+        return false;
+
+    size_t count;
+    AST_Node **stmts = LoopStatements(loop, &count);
+    if (count == 0)
+        return false;
+
+    int regs = 0, splats = 0;
+    for (size_t i = 0; i < count; i++)
+	{
+        AST_Node *stmt = stmts[i];
+        if (stmt->type != AST_ASSIGNMENT || !stmt->left || VecRegsNeeded(tb, stmt->left, loop->name) != 1)
+            return false;
+
+        int needed = VecRegsNeeded(tb, stmt->right, loop->name);
+        if (needed < 0)
+            return false;
+        if (needed > regs)
+            regs = needed;
+        splats += CountSplats(stmt->right, loop->name);
+    }
+    return regs + splats <= VEC_REG_COUNT;
+}
+
+typedef struct {
+    TAC_Builder *tb;
+    AST_Node *loop;
+    char *iter;
+    int lanes;
+    int next_reg, next_splat;
+    struct {
+        const char **items;
+        size_t count, capacity;
+    } checked;
+} Vec_Lowering;
+
+static char* VecReg(Vec_Lowering *vl, int reg)
+	{ return arena_sprintf(vl->tb->arena, "_v%d", reg); }
+
+static TAC_Inst* EmitVec(Vec_Lowering *vl, TAC_Op type, char *dest, char *src1, char *src2)
+{
+    TAC_Inst inst = TACCreate(vl->tb, type);
+    inst.dest = dest;
+    inst.src1 = src1;
+    inst.src2 = src2;
+    inst.num = vl->lanes;
+    return TACAppend(vl->tb, &inst);
+}
+
+// Broadcasts are handed out from the top register down, in the same order
+// VecExprToTAC visits the invariants
+static void VecSplatsToTAC(Vec_Lowering *vl, AST_Node *node)
+{
+    if (IsLoopInvariantExpr(node, vl->loop->name))
+        EmitVec(vl, TAC_VEC_SPLAT, VecReg(vl, vl->next_splat--), ExprToTAC(vl->tb, node), NULL);
+    else if (node->type == AST_BIN_OP)
+	{
+        VecSplatsToTAC(vl, node->left);
+        VecSplatsToTAC(vl, node->right);
+    }
+}
+
+// Array elements and field streams both sit at [slot + offset + iter*8]
+static TAC_Inst* EmitVecAccess(Vec_Lowering *vl, TAC_Op type, AST_Node *node, char *reg)
+{
+    Field_Ref ref = {0};
+    if (node->type == AST_FIELD_ACCESS)
+        ResolveField(vl->tb, node, &ref, false);
+    else
+        ref.base = ResolveName(vl->tb, node->left->name);
+
+    TAC_Inst *inst = type == TAC_VEC_LOAD ? EmitVec(vl, type, reg, ref.base, vl->iter) : 
+                                            EmitVec(vl, type, ref.base, vl->iter, reg);
+    inst->offset = ref.offset;
+    return inst;
+}
+
+// Packed accesses go unchecked, instead the first and the last index of the
+// packed loop are checked once against every array it streams
+static void VecBoundsChecks(Vec_Lowering *vl, AST_Node *node, char *end)
+{
+    if (!node)
+        return;
+    if (node->type == AST_BIN_OP)
+	{
+        VecBoundsChecks(vl, node->left, end);
+        VecBoundsChecks(vl, node->right, end);
+        return;
+    }
+
+    const char *name;
+    int64_t length = 0;
+    if (node->type == AST_INDEX)
+	{
+        name = node->left->name;
+        length = FindVarType(vl->tb, name)->length;
+    }
+    else if (node->type == AST_FIELD_ACCESS)
+	{
+        Field_Ref ref;
+        ResolveField(vl->tb, node, &ref, false);
+        name = ref.base;
+        length = ref.length;
+    }
+    else
+        return;
+
+    for (size_t i = 0; i < vl->checked.count; i++)
+        if (strcmp(vl->checked.items[i], name) == 0)
+            return;
+    arena_da_append(vl->tb->arena, &vl->checked, name);
+
+    char *count = arena_sprintf(vl->tb->arena, "%ld", length);
+    EmitCheck(vl->tb, vl->iter, count);
+    EmitCheck(vl->tb, end, count);
+}
+
+static char* VecExprToTAC(Vec_Lowering *vl, AST_Node *node)
+{
+    if (IsLoopInvariantExpr(node, vl->loop->name))
+        return VecReg(vl, vl->next_splat--);
+
+    if (node->type == AST_INDEX || node->type == AST_FIELD_ACCESS)
+        return EmitVecAccess(vl, TAC_VEC_LOAD, node, VecReg(vl, vl->next_reg++))->dest;
+
+    bool left_invariant = IsLoopInvariantExpr(node->left, vl->loop->name);
+    char *left = VecExprToTAC(vl, node->left);
+    int dest = left_invariant ? vl->next_reg++ : atoi(left + 2);
+    char *right = VecExprToTAC(vl, node->right);
+    vl->next_reg = dest + 1;
+
+    TAC_Inst *inst = EmitVec(vl, TAC_VEC_BINOP, VecReg(vl, dest), left, right);
+    inst->op = ASTOpName(node->op);
+    return inst->dest;
+}
+
+// #simd: a scalar prologue runs until the iterator is a multiple of the lane
+// count, which lines element accesses up with the 16 byte aligned frame
+// arrays. The packed loop then handles lanes iterations per trip and a
+// scalar epilogue finishes the range
+static void ForRangeVectorToTAC(TAC_Builder *tb, AST_Node *node, char *start, char *end)
+{
+    Vec_Lowering vl = {
+        .tb = tb,
+        .loop = node,
+        .lanes = tb->opts->avx2 ? 4 : 2,
+    };
+    char *peel_label = NewLabel(tb);
+    char *setup_label = NewLabel(tb);
+    char *vec_label = NewLabel(tb);
+    char *rest_label = NewLabel(tb);
+    char *exit_label = NewLabel(tb);
+    char *lane_mask = arena_sprintf(tb->arena, "%d", vl.lanes - 1);
+
+    vl.iter = NewIterator(tb, node, start);
+    EmitCompareJump(tb, TAC_JUMP_IF_NOT, vl.iter, "<=", end, exit_label);
+
+    EmitLabel(tb, peel_label);
+    EmitCompareJump(tb, TAC_JUMP_IF, EmitBinOp(tb, vl.iter, "&", lane_mask), "==", "0", setup_label);
+    RangeBodyToTAC(tb, node, vl.iter);
+    StepIterator(tb, vl.iter, "+", "1");
+    EmitCompareJump(tb, TAC_JUMP_IF, vl.iter, "<=", end, peel_label);
+    EmitJump(tb, exit_label);
+
+    EmitLabel(tb, setup_label);
+    char *last = EmitBinOp(tb, end, "-", lane_mask);
+    size_t count;
+    AST_Node **stmts = LoopStatements(node, &count);
+    vl.next_splat = VEC_REG_COUNT - 1;
+    for (size_t i = 0; i < count; i++)
+        VecSplatsToTAC(&vl, stmts[i]->right);
+    EmitCompareJump(tb, TAC_JUMP_IF_NOT, vl.iter, "<=", last, rest_label);
+    if (tb->opts->bounds_check)
+	{
+        for (size_t i = 0; i < count; i++)
+		{
+            VecBoundsChecks(&vl, stmts[i]->left, end);
+            VecBoundsChecks(&vl, stmts[i]->right, end);
+        }
+    }
+
+    EmitLabel(tb, vec_label);
+    vl.next_splat = VEC_REG_COUNT - 1;
+    for (size_t i = 0; i < count; i++)
+	{
+        vl.next_reg = 0;
+        char *value = VecExprToTAC(&vl, stmts[i]->right);
+        EmitVecAccess(&vl, TAC_VEC_STORE, stmts[i]->left, value);
+    }
+    StepIterator(tb, vl.iter, "+", arena_sprintf(tb->arena, "%d", vl.lanes));
+    EmitCompareJump(tb, TAC_JUMP_IF, vl.iter, "<=", last, vec_label);
+
+    EmitLabel(tb, rest_label);
+    EmitVec(&vl, TAC_VEC_END, NULL, NULL, NULL);
+    RangeRestToTAC(tb, node, vl.iter, "<=", end, exit_label);
+    EmitLabel(tb, exit_label);
+}
+
+// Ranges are inclusive and both bounds are evaluated once, up front. Loops
+// are rotated, a guard skips empty ranges and the test sits at the bottom.
+// When the body never reads the iterator the trip count is counted down
+// to zero instead, which the backend turns into dec/jnz
+static void ForRangeToTAC(TAC_Builder *tb, AST_Node *node)
+{
+    bool reverse = node->flags & AST_FLAG_REVERSE;
+
+    char *start = ExprToTAC(tb, node->left);
+    char *end = ExprToTAC(tb, node->right);
+
+    // The body may assign to the variables the bounds were read from
+    if (node->left && node->left->type == AST_ID)
+        start = EmitCopy(tb, NewTemp(tb), start);
+    if (node->right && node->right->type == AST_ID)
+        end = EmitCopy(tb, NewTemp(tb), end);
+
+    if (tb->opts && tb->opts->opt_level >= 2 && (node->flags & (AST_FLAG_SIMD | AST_FLAG_UNROLL)))
+	{
+        if ((node->flags & AST_FLAG_SIMD) && IsVectorizable(tb, node))
+		{
+            ForRangeVectorToTAC(tb, node, start, end);
+            return;
+        }
+        if (node->flags & AST_FLAG_SIMD)
+            nob_log(NOB_WARNING, "Line %u: #simd loop can not be vectorized, unrolling instead", node->line);
+        ForRangeUnrolledToTAC(tb, node, start, end);
+        return;
+    }
+
+    char *head_label = NewLabel(tb);
+    char *exit_label = NewLabel(tb);
+    if (!ASTReferences(node->body, node->name))
+	{
+        char *counter = arena_sprintf(tb->arena, "_n%d", tb->label_count);
+        char *span = EmitBinOp(tb, end, "-", start);
+        EmitCopy(tb, counter, EmitBinOp(tb, span, "+", "1"));
+        TAC_Inst *init = TACLast(tb);
+        init->flags |= TAC_FLAG_ITERATOR;
+        init->num = tb->loop_depth;
+
+        EmitCompareJump(tb, TAC_JUMP_IF_NOT, counter, ">", "0", exit_label);
+        EmitLabel(tb, head_label);
+
+        tb->loop_depth++;
+        StmtToTAC(tb, node->body);
+        tb->loop_depth--;
+
+        TAC_Inst dec = TACCreate(tb, TAC_DEC_JUMP_NZ);
+        dec.src1 = counter;
+        dec.dest = head_label;
+        TACAppend(tb, &dec);
+
+        EmitLabel(tb, exit_label);
+        return;
+    }
+
+    char *iter = NewIterator(tb, node, reverse ? end : start);
+    const char *cmp = reverse ? ">=" : "<=";
+    char *limit = reverse ? start : end;
+    EmitCompareJump(tb, TAC_JUMP_IF_NOT, iter, cmp, limit, exit_label);
+    EmitLabel(tb, head_label);
+
+    RangeBodyToTAC(tb, node, iter);
+    StepIterator(tb, iter, reverse ? "-" : "+", "1");
+    EmitCompareJump(tb, TAC_JUMP_IF, iter, cmp, limit, head_label);
+    EmitLabel(tb, exit_label);
+}
+
 static void StmtToTAC(TAC_Builder *tb, AST_Node *node) 
 {
     if (!node) 
 		return;
+
+    // Code a statement emits after its nested statements still belongs to it
+    uint32_t line = tb->line;
+    if (node->line)
+        tb->line = node->line;
     
     switch (node->type) 
 	{
         case AST_ASSIGNMENT: 
 		{
+			// Declarations only matter for field access, the frame is laid out by the generator
 			if (node->right && node->right->type == AST_TYPE)
+			{
+				TAC_Var_Type var = { 
+					.name = node->name, 
+					.type = node->right->name, 
+					.length = node->right->num,
+					.slice = node->right->flags & AST_FLAG_SLICE,
+				};
+				arena_da_append(tb->arena, &tb->var_types, var);
+				break;
+			}
+
+			if (node->left && node->left->type == AST_FIELD_ACCESS)
+			{
+				Field_Ref ref;
+				if (!ResolveScalarField(tb, node->left, &ref))
+					break;
+				char *index = ref.index ? ExprToTAC(tb, ref.index) : NULL;
+				char *value = ExprToTAC(tb, node->right);
+
+				TAC_Inst inst = TACCreate(tb, TAC_STORE_FIELD);
+				inst.dest = ref.base;
+				inst.src1 = index;
+				inst.src2 = value;
+				inst.offset = ref.offset;
+				inst.size = ref.size;
+				inst.stride = ref.stride;
+				TACAppend(tb, &inst);
+				break;
+			}
+
+			if (node->left && node->left->type == AST_INDEX)
+			{
+				AST_Node *target = node->left;
+				TAC_Var_Type *var = IndexedArray(tb, target, "written");
+				if (!var)
+					break;
+				char *index = ExprToTAC(tb, target->right);
+				EmitBoundsCheck(tb, target->left->name, var->length, var->slice, index);
+				char *value = ExprToTAC(tb, node->right);
+
+				TAC_Inst inst = TACCreate(tb, TAC_STORE);
+				inst.dest = ResolveName(tb, target->left->name);
+				inst.src1 = index;
+				inst.src2 = value;
+				if (var->slice)
+					inst.flags |= TAC_FLAG_SLICE;
+				TACAppend(tb, &inst);
 				break;
+			}
+
+			// Slices take the view of another slice or of a whole fixed array
+			TAC_Var_Type *target = node->name ? FindVarType(tb, node->name) : NULL;
+			if (target && target->slice)
+			{
+				char *data, *count;
+				if (!SliceParts(tb, node->right, &data, &count))
+					break;
+				char *slice = ResolveName(tb, node->name);
+				StoreSliceField(tb, slice, 0, data);
+				StoreSliceField(tb, slice, SLICE_COUNT_OFFSET, count);
+				break;
+			}
+
 			char *src = ExprToTAC(tb, node->right);
 
-			TAC_Inst *inst = TACCreate(tb, TAC_COPY);
-			inst->dest = arena_strdup(tb->arena, node->name);
-			inst->src1 = src;
-			TACAppend(tb, inst);
+			TAC_Inst inst = TACCreate(tb, TAC_COPY);
+			inst.dest = ResolveName(tb, node->name);
+			inst.src1 = src;
+			TACAppend(tb, &inst);
 			break;
 		}
         
         case AST_RETURN: 
 		{
 			char *src = node->right ? ExprToTAC(tb, node->right) : "0";
-			TAC_Inst *inst = TACCreate(tb, TAC_RETURN);
-			inst->src1 = src;
-			TACAppend(tb, inst);
+			TAC_Inst inst = TACCreate(tb, TAC_RETURN);
+			inst.src1 = src;
+			TACAppend(tb, &inst);
 			break;
 		}
         
 		case AST_IF:
+		{
+			char *else_label = NewLabel(tb);
+			char *cond = ExprToTAC(tb, node->left);
+
+			TAC_Inst jump = TACCreate(tb, TAC_JUMP_IF_NOT);
+			jump.src1 = cond;
+			jump.dest = else_label;
+			TACAppend(tb, &jump);
+
+			StmtToTAC(tb, node->body);
+
+			if (node->right)
+			{
+				char *end_label = NewLabel(tb);
+				TAC_Inst skip = TACCreate(tb, TAC_JUMP);
+				skip.dest = end_label;
+				TACAppend(tb, &skip);
+
+				TAC_Inst label = TACCreate(tb, TAC_LABEL);
+				label.dest = else_label;
+				TACAppend(tb, &label);
+
+				StmtToTAC(tb, node->right);
+
+				label = TACCreate(tb, TAC_LABEL);
+				label.dest = end_label;
+				TACAppend(tb, &label);
+			}
+			else
+			{
+				TAC_Inst label = TACCreate(tb, TAC_LABEL);
+				label.dest = else_label;
+				TACAppend(tb, &label);
+			}
+			break;
+		}
+
         case AST_WHILE:
 		{
-			TAC_Inst *inst = TACCreate(tb, 
-						   node->type == AST_IF ? TAC_JUMP_IF : TAC_JUMP_IF_NOT);
-			inst->src1 = (char*)node;
-			TACAppend(tb, inst);
+			// The header label is only reachable by falling into it or from the
+			// back edge, the loop passes rely on that to place a preheader
+			char *head_label = NewLabel(tb);
+			char *exit_label = NewLabel(tb);
+
+			TAC_Inst label = TACCreate(tb, TAC_LABEL);
+			label.dest = head_label;
+			TACAppend(tb, &label);
+
+			TAC_Inst jump = TACCreate(tb, TAC_JUMP_IF_NOT);
+			jump.src1 = ExprToTAC(tb, node->left);
+			jump.dest = exit_label;
+			TACAppend(tb, &jump);
+
+			tb->loop_depth++;
+			StmtToTAC(tb, node->body);
+			tb->loop_depth--;
+
+			TAC_Inst back = TACCreate(tb, TAC_JUMP);
+			back.dest = head_label;
+			TACAppend(tb, &back);
+
+			label = TACCreate(tb, TAC_LABEL);
+			label.dest = exit_label;
+			TACAppend(tb, &label);
 			break;
 		}
         
+        case AST_FOR_RANGE:
+            ForRangeToTAC(tb, node);
+            break;
+        
         case AST_BLOCK: 
             for (size_t i = 0; i < node->children.used; i++)
                 StmtToTAC(tb, node->children.data[i]);
@@ -164,18 +1104,120 @@ static void StmtToTAC(TAC_Builder *tb, AST_Node *node)
         default:
             break;
     }
+    tb->line = line;
+}
+
+// A call is in tail position when its result flows straight into a return,
+// either directly or through a single copy. Only register-passed arguments
+// qualify, stack arguments would have to overwrite the caller's outgoing area.
+// The list is compacted in place, the return goes away
+void TACMarkTailCalls(TAC_List *tac)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < tac->count; i++) 
+	{
+        TAC_Inst *inst = &tac->items[out++];
+        *inst = tac->items[i];
+        if (inst->type != TAC_CALL || (inst->flags & TAC_FLAG_NO_TAIL) || inst->num > ARG_REG_COUNT)
+            continue;
+
+        size_t ret = i + 1;
+        const char *value = inst->dest;
+        if (ret < tac->count && tac->items[ret].type == TAC_COPY && tac->items[ret].src1 && 
+            strcmp(tac->items[ret].src1, value) == 0)
+		{
+            value = tac->items[ret].dest;
+            ret++;
+        }
+
+        if (ret >= tac->count || tac->items[ret].type != TAC_RETURN || !tac->items[ret].src1 || 
+            strcmp(tac->items[ret].src1, value) != 0)
+            continue;
+
+        inst->type = TAC_TAIL_CALL;
+        i = ret;
+    }
+    tac->count = out;
+}
+
+void TACEditInit(TAC_Edit *edit, TAC_List *tac)
+	{ *edit = (TAC_Edit){ .dropped = calloc(tac->count + 1, sizeof(bool)) }; }
+
+void TACEditDrop(TAC_Edit *edit, size_t i)
+	{ edit->dropped[i] = true; }
+
+// Instructions inserted before the same index keep the order they were
+// inserted in
+void TACEditInsert(TAC_Edit *edit, size_t before, TAC_Inst inst)
+{
+    TAC_Insert insert = { .before = before, .inst = inst };
+    nob_da_append(&edit->inserts, insert);
+}
+
+// Rebuilds the list with the edits in one pass and frees the side tables
+void TACEditApply(TAC_Edit *edit, TAC_List *tac, Arena *arena)
+{
+    // A stable insertion sort, passes only ever insert a few instructions
+    TAC_Insert *inserts = edit->inserts.items;
+    size_t insert_count = edit->inserts.count;
+    for (size_t i = 1; i < insert_count; i++)
+	{
+        TAC_Insert item = inserts[i];
+        size_t j = i;
+        for (; j > 0 && inserts[j - 1].before > item.before; j--)
+            inserts[j] = inserts[j - 1];
+        inserts[j] = item;
+    }
+
+    TAC_List out = {0};
+    size_t capacity = tac->count + insert_count;
+    out.items = arena_alloc(arena, (capacity ? capacity : 1) * sizeof(TAC_Inst));
+    out.capacity = capacity;
+    size_t next = 0;
+    for (size_t i = 0; i <= tac->count; i++)
+	{
+        while (next < insert_count && inserts[next].before == i)
+            out.items[out.count++] = inserts[next++].inst;
+        if (i < tac->count && !edit->dropped[i])
+            out.items[out.count++] = tac->items[i];
+    }
+    *tac = out;
+
+    free(edit->dropped);
+    nob_da_free(edit->inserts);
+    *edit = (TAC_Edit){0};
 }
 
-TAC_Inst* FuncBodyToTAC(AST_Node *body, Arena *arena) 
+TAC_List FuncBodyToTAC(AST_Node *proc, const Compile_Options *opts, const Type_Table *types, Arena *arena, bool *had_err) 
 {
     TAC_Builder tb;
     TACInit(&tb, arena);
+    tb.opts = opts;
+    tb.types = types;
+    tb.line = proc->line;
+
+    // Slice parameters are indexed like local slices
+    for (size_t i = 0; i < proc->children.used; i++)
+	{
+        AST_Node *param = proc->children.data[i];
+        if (!param->right || param->right->type != AST_TYPE)
+            continue;
+        TAC_Var_Type var = { 
+            .name = param->name, 
+            .type = param->right->name, 
+            .slice = param->right->flags & AST_FLAG_SLICE,
+        };
+        arena_da_append(tb.arena, &tb.var_types, var);
+    }
     
+    AST_Node *body = proc->body;
     if (body && body->type == AST_BLOCK) 
         for (size_t i = 0; i < body->children.used; i++)
             StmtToTAC(&tb, body->children.data[i]);
 	else
         StmtToTAC(&tb, body);
     
-    return tb.head;
+    TACMarkTailCalls(&tb.list);
+    *had_err = tb.had_err;
+    return tb.list;
 }
@@ -0,0 +1,786 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytecode interpreter: procedures are lowered to TAC the same way the
+// backends see them, then translated into a register bytecode. Named
+// variables, temps and constants each get a register of the frame, arrays,
+// structs and slices live in the frame memory right below the registers.
+// #run expressions and top-level constants are evaluated on demand and
+// spliced back into the AST as numbers, --run executes main directly
+
+static bool VMError(VM *vm, const char *fmt, ...)
+{
+    char message[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    nob_log(NOB_ERROR, "%s", message);
+    vm->had_err = true;
+    return false;
+}
+
+static bool IsConstOperand(const char *s)
+	{ return s && ((s[0] >= '0' && s[0] <= '9') || s[0] == '-'); }
+
+static size_t AlignUp(size_t value, size_t align)
+	{ return (value + align - 1) & ~(align - 1); }
+
+static VM_Proc* FindProc(VM *vm, const char *name)
+{
+    for (size_t i = 0; i < vm->procs.count; i++)
+        if (strcmp(vm->procs.items[i].name, name) == 0)
+            return &vm->procs.items[i];
+    return NULL;
+}
+
+static AST_Node* FindConst(VM *vm, const char *name)
+{
+    for (size_t i = 0; i < vm->program->children.used; i++)
+	{
+        AST_Node *decl = vm->program->children.data[i];
+        if (decl->type == AST_CONST && strcmp(decl->name, name) == 0)
+            return decl;
+    }
+    return NULL;
+}
+
+static void Splice(AST_Node *node, int64_t value)
+{
+    node->type = AST_NUM;
+    node->num = value;
+    node->name = NULL;
+    node->left = node->right = node->body = NULL;
+    ASTArrayInit(&node->children);
+}
+
+typedef struct {
+    const char *name;
+    int64_t value;
+    bool constant;
+} VM_Reg;
+
+typedef struct {
+    const char *name;
+    int64_t offset;
+} VM_Memory;
+
+typedef struct {
+    VM *vm;
+    VM_Proc *proc;
+    struct {
+        VM_Reg *items;
+        size_t count, capacity;
+    } regs;
+    struct {
+        VM_Memory *items;
+        size_t count, capacity;
+    } memory;
+    struct {
+        const char **items;
+        size_t count, capacity;
+    } known;
+    int32_t *labels;
+} VM_Compiler;
+
+static bool IsKnown(VM_Compiler *c, const char *name)
+{
+    for (size_t i = 0; i < c->known.count; i++)
+        if (strcmp(c->known.items[i], name) == 0)
+            return true;
+    return false;
+}
+
+// Missing operands read as 0, unary minus comes out of the TAC as 0 - x
+static int32_t Reg(VM_Compiler *c, const char *name)
+{
+    const char *key = name ? name : "0";
+    bool constant = IsConstOperand(key);
+    int64_t value = constant ? strtoll(key, NULL, 10) : 0;
+    for (size_t i = 0; i < c->regs.count; i++)
+	{
+        VM_Reg *reg = &c->regs.items[i];
+        if (constant ? reg->constant && reg->value == value : !reg->constant && strcmp(reg->name, key) == 0)
+            return (int32_t)i;
+    }
+
+    if (!constant && !IsKnown(c, key))
+        VMError(c->vm, "%s: '%s' is not defined", c->proc->name, key);
+    VM_Reg reg = { .name = key, .value = value, .constant = constant };
+    arena_da_append(c->vm->arena, &c->regs, reg);
+    return (int32_t)c->regs.count - 1;
+}
+
+// Offsets are taken from the registers, which start right above the memory
+static int64_t Memory(VM_Compiler *c, const char *name)
+{
+    for (size_t i = 0; i < c->memory.count; i++)
+        if (strcmp(c->memory.items[i].name, name) == 0)
+            return c->memory.items[i].offset - (int64_t)c->proc->mem_words * 8;
+    VMError(c->vm, "%s: '%s' has no memory", c->proc->name, name);
+    return 0;
+}
+
+static void AddMemory(VM_Compiler *c, const char *name, size_t size, size_t align, size_t *offset)
+{
+    *offset = AlignUp(*offset, align);
+    VM_Memory mem = { .name = name, .offset = (int64_t)*offset };
+    arena_da_append(c->vm->arena, &c->memory, mem);
+    *offset += size;
+}
+
+// Same rules as the frame layout of the backends, only sizes matter here
+static void LayoutVars(VM_Compiler *c, AST_Array *vars, size_t param_count)
+{
+    size_t offset = 0;
+    int regs = 0, stack = 0;
+    for (size_t i = 0; i < vars->used; i++)
+	{
+        AST_Node *var = vars->data[i];
+        arena_da_append(c->vm->arena, &c->known, var->name);
+        AST_Node *type = var->right && var->right->type == AST_TYPE ? var->right : NULL;
+        TypeInfo *info = type ? LayoutFindType(&c->vm->types, type->name) : NULL;
+        bool slice = type && (type->flags & AST_FLAG_SLICE);
+        if (type && !info)
+		{
+            VMError(c->vm, "%s: unknown type '%s'", c->proc->name, type->name);
+            continue;
+        }
+
+        if (i < param_count)
+		{
+            if (info && !slice && (info->fields.count > 0 || type->num > 0))
+                VMError(c->vm, "%s: parameter '%s' must be a scalar or a slice", c->proc->name, var->name);
+            VM_Param param = { .words = LayoutParamWords(var), .reg = -1 };
+            param.pos = LayoutArgPosition(&regs, &stack, param.words);
+            arena_da_append(c->vm->arena, &c->proc->params, param);
+        }
+
+        if (slice)
+            AddMemory(c, var->name, SLICE_SIZE, 8, &offset);
+        else if (info && type->num > 0 && info->fields.count > 0)
+            AddMemory(c, var->name, LayoutArraySize(info, type->num), 16, &offset);
+        else if (info && type->num > 0)
+		{
+            if (info->size != 8)
+                VMError(c->vm, "%s: array '%s' must have 8 byte elements", c->proc->name, var->name);
+            AddMemory(c, var->name, info->size * type->num, 16, &offset);
+        }
+        else if (info && info->fields.count > 0)
+            AddMemory(c, var->name, info->size, info->align, &offset);
+    }
+    c->proc->mem_words = (int)(AlignUp(offset, 16) / 8);
+}
+
+static const struct {
+    const char *op;
+    VM_Op binop, jump_if, jump_if_not;
+} vm_ops[] = {
+    { "+",  VM_ADD, 0,      0      },
+    { "-",  VM_SUB, 0,      0      },
+    { "*",  VM_MUL, 0,      0      },
+    { "/",  VM_DIV, 0,      0      },
+    { "%",  VM_MOD, 0,      0      },
+    { "&",  VM_AND, 0,      0      },
+    { "==", VM_EQ,  VM_JEQ, VM_JNE },
+    { "!=", VM_NE,  VM_JNE, VM_JEQ },
+    { "<",  VM_LT,  VM_JLT, VM_JGE },
+    { "<=", VM_LE,  VM_JLE, VM_JGT },
+    { ">",  VM_GT,  VM_JGT, VM_JLE },
+    { ">=", VM_GE,  VM_JGE, VM_JLT },
+};
+
+static int FindOp(const char *op)
+{
+    for (size_t i = 0; i < sizeof(vm_ops) / sizeof(vm_ops[0]); i++)
+        if (strcmp(vm_ops[i].op, op) == 0)
+            return (int)i;
+    return -1;
+}
+
+static VM_Inst* Emit(VM_Compiler *c, VM_Op op, int32_t a, int32_t b, int32_t cr)
+{
+    VM_Inst inst = { .op = op, .a = a, .b = b, .c = cr };
+    arena_da_append(c->vm->arena, &c->proc->code, inst);
+    return &c->proc->code.items[c->proc->code.count - 1];
+}
+
+// Labels come from NewLabel as ".L<n>", the number indexes the label table
+static int32_t LabelIndex(const char *label)
+	{ return atoi(label + 2); }
+
+static int CallWords(VM_Proc *callee)
+{
+    int words = 0;
+    for (size_t i = 0; i < callee->ast->children.used; i++)
+        words += LayoutParamWords(callee->ast->children.data[i]);
+    return words;
+}
+
+static void CompileInst(VM_Compiler *c, TAC_Inst *inst)
+{
+    switch (inst->type)
+	{
+        case TAC_COPY:
+            Emit(c, VM_MOV, Reg(c, inst->dest), Reg(c, inst->src1), 0);
+            break;
+
+        case TAC_BINOP:
+		{
+            // !x has no left operand, it is x == 0
+            if (strcmp(inst->op, "!") == 0)
+			{
+                Emit(c, VM_EQ, Reg(c, inst->dest), Reg(c, inst->src2), Reg(c, "0"));
+                break;
+            }
+            int op = FindOp(inst->op);
+            if (op < 0)
+			{
+                VMError(c->vm, "%s: operator '%s' is not supported", c->proc->name, inst->op);
+                break;
+            }
+            Emit(c, vm_ops[op].binop, Reg(c, inst->dest), Reg(c, inst->src1), Reg(c, inst->src2));
+            break;
+        }
+
+        case TAC_LOAD:
+            Emit(c, inst->flags & TAC_FLAG_SLICE ? VM_LOAD_PTR : VM_LOAD, Reg(c, inst->dest),
+                 Reg(c, inst->src2), 0)->imm = Memory(c, inst->src1);
+            break;
+
+        case TAC_STORE:
+            Emit(c, inst->flags & TAC_FLAG_SLICE ? VM_STORE_PTR : VM_STORE, 0,
+                 Reg(c, inst->src1), Reg(c, inst->src2))->imm = Memory(c, inst->dest);
+            break;
+
+        case TAC_LOAD_FIELD:
+		{
+            VM_Inst *load = Emit(c, VM_LOAD_FIELD, Reg(c, inst->dest), Reg(c, inst->src2), 0);
+            load->imm = Memory(c, inst->src1) + inst->offset;
+            load->size = inst->size;
+            load->stride = inst->src2 ? inst->stride : 0;
+            break;
+        }
+
+        case TAC_STORE_FIELD:
+		{
+            VM_Inst *store = Emit(c, VM_STORE_FIELD, 0, Reg(c, inst->src1), Reg(c, inst->src2));
+            store->imm = Memory(c, inst->dest) + inst->offset;
+            store->size = inst->size;
+            store->stride = inst->src1 ? inst->stride : 0;
+            break;
+        }
+
+        case TAC_ADDR:
+            Emit(c, VM_ADDR, Reg(c, inst->dest), 0, 0)->imm = Memory(c, inst->src1);
+            break;
+
+        case TAC_BOUNDS_CHECK:
+            Emit(c, VM_CHECK, 0, Reg(c, inst->src1), Reg(c, inst->src2));
+            break;
+
+        case TAC_PARAM:
+            if (inst->num >= VM_MAX_ARGS)
+			{
+                VMError(c->vm, "%s: too many arguments", c->proc->name);
+                break;
+            }
+            Emit(c, VM_ARG, 0, Reg(c, inst->src1), 0)->imm = inst->num;
+            break;
+
+        case TAC_CALL:
+        case TAC_TAIL_CALL:
+		{
+            VM_Proc *callee = FindProc(c->vm, inst->src1);
+            if (!callee)
+			{
+                VMError(c->vm, "%s: call to unknown procedure '%s'", c->proc->name, inst->src1);
+                break;
+            }
+            if (CallWords(callee) != inst->num)
+			{
+                VMError(c->vm, "%s: arguments of the call to '%s' don't match its parameters",
+                        c->proc->name, inst->src1);
+                break;
+            }
+            VM_Op op = inst->type == TAC_CALL ? VM_CALL : VM_TAIL_CALL;
+            int32_t dest = inst->type == TAC_CALL ? Reg(c, inst->dest) : 0;
+            Emit(c, op, dest, 0, 0)->imm = callee - c->vm->procs.items;
+            break;
+        }
+
+        case TAC_RETURN:
+            Emit(c, VM_RET, 0, Reg(c, inst->src1), 0);
+            break;
+
+        case TAC_LABEL:
+            c->labels[LabelIndex(inst->dest)] = (int32_t)c->proc->code.count;
+            break;
+
+        case TAC_JUMP:
+            Emit(c, VM_JMP, LabelIndex(inst->dest), 0, 0);
+            break;
+
+        case TAC_JUMP_IF:
+        case TAC_JUMP_IF_NOT:
+		{
+            bool negate = inst->type == TAC_JUMP_IF_NOT;
+            if (!inst->op)
+			{
+                Emit(c, negate ? VM_JZ : VM_JNZ, LabelIndex(inst->dest), Reg(c, inst->src1), 0);
+                break;
+            }
+            int op = FindOp(inst->op);
+            if (op < 0 || !vm_ops[op].jump_if)
+			{
+                VMError(c->vm, "%s: can't branch on '%s'", c->proc->name, inst->op);
+                break;
+            }
+            Emit(c, negate ? vm_ops[op].jump_if_not : vm_ops[op].jump_if, LabelIndex(inst->dest),
+                 Reg(c, inst->src1), Reg(c, inst->src2));
+            break;
+        }
+
+        case TAC_DEC_JUMP_NZ:
+            Emit(c, VM_DJNZ, LabelIndex(inst->dest), Reg(c, inst->src1), 0);
+            break;
+
+        default:
+            VMError(c->vm, "%s: TAC instruction %d has no bytecode", c->proc->name, inst->type);
+            break;
+    }
+}
+
+static bool CompileProc(VM *vm, VM_Proc *proc)
+{
+    AST_Node *node = proc->ast;
+    VM_Compiler c = { .vm = vm, .proc = proc };
+
+    AST_Array vars;
+    ASTArrayInit(&vars);
+    for (size_t i = 0; i < node->children.used; i++)
+        CollectVariables(node->children.data[i], &vars, vm->arena);
+    size_t param_count = vars.used;
+    CollectVariables(node->body, &vars, vm->arena);
+
+    bool tac_err = false;
+    TAC_List tac = FuncBodyToTAC(node, &vm->opts, &vm->types, vm->arena, &tac_err);
+    if (tac_err)
+	{
+        vm->had_err = true;
+        return false;
+    }
+    if (vm->opts.opt_level >= 1)
+	{
+        EliminateBoundsChecks(&tac);
+        OptimizeLoops(&tac, vm->arena);
+    }
+
+    LayoutVars(&c, &vars, param_count);
+    int32_t max_label = -1;
+    for (size_t i = 0; i < tac.count; i++)
+	{
+        TAC_Inst *inst = &tac.items[i];
+        if (inst->dest && inst->type != TAC_LABEL && !IsKnown(&c, inst->dest))
+            arena_da_append(vm->arena, &c.known, inst->dest);
+        if (inst->type == TAC_LABEL && LabelIndex(inst->dest) > max_label)
+            max_label = LabelIndex(inst->dest);
+    }
+    c.labels = arena_alloc(vm->arena, (max_label + 1) * sizeof(int32_t));
+
+    // Parameters claim their registers before anything else
+    for (size_t i = 0; i < param_count; i++)
+	{
+        VM_Param *param = &proc->params.items[i];
+        if (param->words == 1)
+            param->reg = Reg(&c, vars.data[i]->name);
+        else
+            param->offset = Memory(&c, vars.data[i]->name);
+    }
+
+    for (size_t i = 0; i < tac.count; i++)
+        CompileInst(&c, &tac.items[i]);
+    Emit(&c, VM_RET, 0, Reg(&c, "0"), 0);
+
+    for (size_t i = 0; i < proc->code.count; i++)
+	{
+        VM_Inst *inst = &proc->code.items[i];
+        if (inst->op >= VM_JMP && inst->op <= VM_DJNZ)
+            inst->a = c.labels[inst->a];
+    }
+
+    // An even register count keeps every frame 16 byte aligned
+    proc->reg_count = (int)AlignUp(c.regs.count, 2);
+    proc->init = arena_alloc(vm->arena, proc->reg_count * sizeof(int64_t));
+    memset(proc->init, 0, proc->reg_count * sizeof(int64_t));
+    for (size_t i = 0; i < c.regs.count; i++)
+        proc->init[i] = c.regs.items[i].value;
+    return !vm->had_err;
+}
+
+static bool ResolveRuns(VM *vm, AST_Node *node);
+
+// Runs every #run inside the procedure first, then compiles it and the
+// procedures it calls. A procedure that is still preparing has no code yet,
+// calling it while a #run executes means the #run depends on itself
+static bool PrepareProc(VM *vm, VM_Proc *proc)
+{
+    if (proc->state != VM_PROC_UNSEEN)
+        return true;
+    proc->state = VM_PROC_PREPARING;
+
+    if (!ResolveRuns(vm, proc->ast->body))
+        return false;
+
+    if (!CompileProc(vm, proc))
+        return false;
+    proc->state = VM_PROC_READY;
+
+    for (size_t i = 0; i < proc->code.count; i++)
+	{
+        VM_Inst *inst = &proc->code.items[i];
+        if ((inst->op == VM_CALL || inst->op == VM_TAIL_CALL) && !PrepareProc(vm, &vm->procs.items[inst->imm]))
+            return false;
+    }
+    return true;
+}
+
+static void EnterFrame(VM *vm, VM_Proc *proc, int64_t *r)
+{
+    memset(r - proc->mem_words, 0, proc->mem_words * sizeof(int64_t));
+    memcpy(r, proc->init, proc->reg_count * sizeof(int64_t));
+    for (size_t i = 0; i < proc->params.count; i++)
+	{
+        VM_Param *param = &proc->params.items[i];
+        if (param->words == 1)
+            r[param->reg] = vm->args[param->pos];
+        else
+            memcpy((uint8_t*)r + param->offset, &vm->args[param->pos], SLICE_SIZE);
+    }
+}
+
+static int64_t LoadSized(const uint8_t *addr, uint32_t size)
+{
+    switch (size)
+	{
+        case 1: return *addr;
+        case 2: { uint16_t v; memcpy(&v, addr, 2); return v; }
+        case 4: { uint32_t v; memcpy(&v, addr, 4); return v; }
+        default: { int64_t v; memcpy(&v, addr, 8); return v; }
+    }
+}
+
+static void StoreSized(uint8_t *addr, uint32_t size, int64_t value)
+	{ memcpy(addr, &value, size ? size : 8); }
+
+// Arithmetic wraps like the machine code does
+#define WRAP(x, op, y) ((int64_t)((uint64_t)(x) op (uint64_t)(y)))
+
+// Direct threaded: every handler ends in its own indirect jump through the
+// handler table, which predicts far better than one shared switch jump
+#define NEXT() do { in = pc++; goto *handlers[in->op]; } while (0)
+#define JUMP_IF(cond) do { if (cond) pc = code + in->a; NEXT(); } while (0)
+
+static bool VMExecute(VM *vm, VM_Proc *entry, int64_t *result)
+{
+    static void *handlers[] = {
+        [VM_MOV] = &&op_mov, [VM_ADD] = &&op_add, [VM_SUB] = &&op_sub, [VM_MUL] = &&op_mul,
+        [VM_DIV] = &&op_div, [VM_MOD] = &&op_div, [VM_AND] = &&op_and,
+        [VM_EQ] = &&op_eq, [VM_NE] = &&op_ne, [VM_LT] = &&op_lt, [VM_LE] = &&op_le, 
+        [VM_GT] = &&op_gt, [VM_GE] = &&op_ge,
+        [VM_JMP] = &&op_jmp, [VM_JZ] = &&op_jz, [VM_JNZ] = &&op_jnz, 
+        [VM_JEQ] = &&op_jeq, [VM_JNE] = &&op_jne, [VM_JLT] = &&op_jlt, [VM_JLE] = &&op_jle, 
+        [VM_JGT] = &&op_jgt, [VM_JGE] = &&op_jge, [VM_DJNZ] = &&op_djnz,
+        [VM_LOAD] = &&op_load, [VM_STORE] = &&op_store, [VM_LOAD_PTR] = &&op_load_ptr, 
+        [VM_STORE_PTR] = &&op_store_ptr, [VM_LOAD_FIELD] = &&op_load_field, 
+        [VM_STORE_FIELD] = &&op_store_field, [VM_ADDR] = &&op_addr, [VM_CHECK] = &&op_check,
+        [VM_ARG] = &&op_arg, [VM_CALL] = &&op_call, [VM_TAIL_CALL] = &&op_call, [VM_RET] = &&op_ret,
+    };
+
+    int64_t *stack_end = vm->stack + VM_STACK_WORDS;
+    size_t depth = 0;
+    VM_Proc *proc = entry;
+    int64_t *r = vm->stack + entry->mem_words;
+    if (r + entry->reg_count > stack_end)
+        return VMError(vm, "%s: stack overflow", proc->name);
+    EnterFrame(vm, proc, r);
+    const VM_Inst *code = proc->code.items;
+    const VM_Inst *pc = code;
+    const VM_Inst *in;
+    NEXT();
+
+op_mov: r[in->a] = r[in->b]; NEXT();
+op_add: r[in->a] = WRAP(r[in->b], +, r[in->c]); NEXT();
+op_sub: r[in->a] = WRAP(r[in->b], -, r[in->c]); NEXT();
+op_mul: r[in->a] = WRAP(r[in->b], *, r[in->c]); NEXT();
+op_and: r[in->a] = r[in->b] & r[in->c]; NEXT();
+op_eq: r[in->a] = r[in->b] == r[in->c]; NEXT();
+op_ne: r[in->a] = r[in->b] != r[in->c]; NEXT();
+op_lt: r[in->a] = r[in->b] < r[in->c]; NEXT();
+op_le: r[in->a] = r[in->b] <= r[in->c]; NEXT();
+op_gt: r[in->a] = r[in->b] > r[in->c]; NEXT();
+op_ge: r[in->a] = r[in->b] >= r[in->c]; NEXT();
+
+// Native code divides with idiv, which traps on both of these, so the VM
+// fails on them too instead of making up a result
+op_div:
+    if (r[in->c] == 0)
+        return VMError(vm, "%s: division by zero", proc->name);
+    if (r[in->c] == -1 && r[in->b] == INT64_MIN)
+        return VMError(vm, "%s: division overflow", proc->name);
+    r[in->a] = in->op == VM_DIV ? r[in->b] / r[in->c] : r[in->b] % r[in->c];
+    NEXT();
+
+op_jmp: pc = code + in->a; NEXT();
+op_jz: JUMP_IF(!r[in->b]);
+op_jnz: JUMP_IF(r[in->b]);
+op_jeq: JUMP_IF(r[in->b] == r[in->c]);
+op_jne: JUMP_IF(r[in->b] != r[in->c]);
+op_jlt: JUMP_IF(r[in->b] < r[in->c]);
+op_jle: JUMP_IF(r[in->b] <= r[in->c]);
+op_jgt: JUMP_IF(r[in->b] > r[in->c]);
+op_jge: JUMP_IF(r[in->b] >= r[in->c]);
+op_djnz: JUMP_IF(--r[in->b] != 0);
+
+op_load: 
+    r[in->a] = *(int64_t*)((uint8_t*)r + in->imm + r[in->b] * 8); 
+    NEXT();
+op_store: 
+    *(int64_t*)((uint8_t*)r + in->imm + r[in->b] * 8) = r[in->c]; 
+    NEXT();
+op_load_ptr: 
+    r[in->a] = (*(int64_t**)((uint8_t*)r + in->imm))[r[in->b]]; 
+    NEXT();
+op_store_ptr: 
+    (*(int64_t**)((uint8_t*)r + in->imm))[r[in->b]] = r[in->c]; 
+    NEXT();
+op_load_field: 
+    r[in->a] = LoadSized((uint8_t*)r + in->imm + r[in->b] * in->stride, in->size); 
+    NEXT();
+op_store_field: 
+    StoreSized((uint8_t*)r + in->imm + r[in->b] * in->stride, in->size, r[in->c]); 
+    NEXT();
+op_addr: 
+    r[in->a] = (int64_t)(intptr_t)((uint8_t*)r + in->imm); 
+    NEXT();
+
+op_check:
+    if ((uint64_t)r[in->b] >= (uint64_t)r[in->c])
+        return VMError(vm, "%s: index %ld is out of bounds for count %ld", proc->name, r[in->b], r[in->c]);
+    NEXT();
+
+op_arg: vm->args[in->imm] = r[in->b]; NEXT();
+
+op_call:
+{
+    VM_Proc *callee = &vm->procs.items[in->imm];
+    if (!callee->code.items)
+        return VMError(vm, "%s: #run needs '%s' while it is still being compiled", proc->name, callee->name);
+
+    // Tail calls put the new frame where the current one started
+    int64_t *base = in->op == VM_CALL ? r + proc->reg_count : r - proc->mem_words;
+    int64_t *next = base + callee->mem_words;
+    if (next + callee->reg_count > stack_end || (in->op == VM_CALL && depth + 1 >= VM_MAX_DEPTH))
+        return VMError(vm, "%s: stack overflow", callee->name);
+    if (in->op == VM_CALL)
+        vm->frames[depth++] = (VM_Frame){ .proc = proc, .ret = pc, .regs = r, .dest = in->a };
+
+    proc = callee;
+    r = next;
+    EnterFrame(vm, proc, r);
+    code = pc = proc->code.items;
+    NEXT();
+}
+
+op_ret:
+{
+    int64_t value = r[in->b];
+    if (depth == 0)
+	{
+        *result = value;
+        return true;
+    }
+    VM_Frame *frame = &vm->frames[--depth];
+    proc = frame->proc;
+    r = frame->regs;
+    code = proc->code.items;
+    pc = frame->ret;
+    r[frame->dest] = value;
+    NEXT();
+}
+}
+
+#undef NEXT
+#undef JUMP_IF
+
+// Frames live on a stack that never moves, slices keep pointing into it
+static bool VMCall(VM *vm, VM_Proc *proc, int64_t *result)
+{
+    if (!vm->stack)
+	{
+        vm->stack = malloc(VM_STACK_WORDS * sizeof(int64_t));
+        vm->frames = malloc(VM_MAX_DEPTH * sizeof(VM_Frame));
+    }
+    return VMExecute(vm, proc, result);
+}
+
+// The expression becomes the return value of a procedure of its own
+static bool EvalExpr(VM *vm, AST_Node *expr, int64_t *value)
+{
+    AST_Node *ret = arena_alloc(vm->arena, sizeof(AST_Node));
+    memset(ret, 0, sizeof(AST_Node));
+    ret->type = AST_RETURN;
+    ret->right = expr;
+    ret->line = expr->line;
+
+    AST_Node *node = arena_alloc(vm->arena, sizeof(AST_Node));
+    memset(node, 0, sizeof(AST_Node));
+    node->type = AST_PROC;
+    node->name = arena_sprintf(vm->arena, "#run at line %u", expr->line);
+    node->body = ret;
+    ASTArrayInit(&node->children);
+
+    VM_Proc run = { .ast = node, .name = node->name };
+    return PrepareProc(vm, &run) && VMCall(vm, &run, value);
+}
+
+static bool EvalConst(VM *vm, AST_Node *decl)
+{
+    if (decl->right->type == AST_NUM)
+        return true;
+    for (size_t i = 0; i < vm->busy.count; i++)
+        if (vm->busy.items[i] == decl)
+            return VMError(vm, "Line %u: constant '%s' depends on itself", decl->line, decl->name);
+
+    arena_da_append(vm->arena, &vm->busy, decl);
+    AST_Node *expr = decl->right->type == AST_RUN ? decl->right->right : decl->right;
+    int64_t value;
+    bool ok = EvalExpr(vm, expr, &value);
+    vm->busy.count--;
+    if (ok)
+        Splice(decl->right, value);
+    return ok;
+}
+
+static bool ResolveRuns(VM *vm, AST_Node *node)
+{
+    if (!node)
+        return true;
+
+    if (node->type == AST_RUN)
+	{
+        int64_t value;
+        if (!EvalExpr(vm, node->right, &value))
+            return false;
+        Splice(node, value);
+        return true;
+    }
+
+    if (node->type == AST_ID)
+	{
+        AST_Node *decl = FindConst(vm, node->name);
+        if (decl)
+		{
+            if (!EvalConst(vm, decl))
+                return false;
+            Splice(node, decl->right->num);
+        }
+        return true;
+    }
+
+    if (!ResolveRuns(vm, node->left) || !ResolveRuns(vm, node->right) || !ResolveRuns(vm, node->body))
+        return false;
+    for (size_t i = 0; i < node->children.used; i++)
+        if (!ResolveRuns(vm, node->children.data[i]))
+            return false;
+    return true;
+}
+
+static bool HasDirectives(AST_Node *node)
+{
+    if (!node)
+        return false;
+    if (node->type == AST_CONST || node->type == AST_RUN)
+        return true;
+    if (HasDirectives(node->left) || HasDirectives(node->right) || HasDirectives(node->body))
+        return true;
+    for (size_t i = 0; i < node->children.used; i++)
+        if (HasDirectives(node->children.data[i]))
+            return true;
+    return false;
+}
+
+// Packed loops have no bytecode, lowering stops at -O1 and its TAC passes
+static bool VMInit(VM *vm, AST_Node *program, const Compile_Options *opts, Arena *arena)
+{
+    *vm = (VM){ .arena = arena, .program = program, .opts = *opts };
+    if (vm->opts.opt_level > 1)
+        vm->opts.opt_level = 1;
+
+    LayoutInit(&vm->types, arena);
+    for (size_t i = 0; i < program->children.used; i++)
+	{
+        AST_Node *decl = program->children.data[i];
+        if (decl->type == AST_STRUCT && !LayoutStruct(&vm->types, decl, arena))
+            return false;
+        if (decl->type == AST_PROC)
+		{
+            VM_Proc proc = { .ast = decl, .name = decl->name };
+            arena_da_append(arena, &vm->procs, proc);
+        }
+    }
+    return true;
+}
+
+static void VMFree(VM *vm)
+{
+    free(vm->stack);
+    free(vm->frames);
+}
+
+// Evaluates every constant and #run of the program, afterwards the AST only
+// holds numbers in their place. Programs without either skip the VM. The
+// code they run is always bounds checked
+bool VMRunDirectives(AST_Node *program, Arena *arena)
+{
+    if (!HasDirectives(program))
+        return true;
+
+    VM vm;
+    Compile_Options opts = { .opt_level = 0, .bounds_check = true };
+    if (!VMInit(&vm, program, &opts, arena))
+        return false;
+
+    nob_log(NOB_INFO, "Running compile-time code...");
+    bool ok = true;
+    for (size_t i = 0; i < program->children.used && ok; i++)
+	{
+        AST_Node *decl = program->children.data[i];
+        if (decl->type == AST_CONST)
+            ok = EvalConst(&vm, decl);
+        else if (decl->type == AST_PROC)
+            ok = ResolveRuns(&vm, decl->body);
+    }
+
+    VMFree(&vm);
+    return ok && !vm.had_err;
+}
+
+// Runs the whole program in the VM instead of building it. Only main and
+// what it reaches gets compiled, constants and #run included
+bool VMRunMain(AST_Node *program, const Compile_Options *opts, Arena *arena, int64_t *result)
+{
+    VM vm;
+    if (!VMInit(&vm, program, opts, arena))
+        return false;
+
+    VM_Proc *main_proc = FindProc(&vm, "main");
+    bool ok = main_proc ? PrepareProc(&vm, main_proc) && VMCall(&vm, main_proc, result) : 
+                          VMError(&vm, "There is no procedure 'main' to run");
+    VMFree(&vm);
+    return ok && !vm.had_err;
+}
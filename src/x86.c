@@ -0,0 +1,710 @@
+#include <cmpl.h>
+#include <nob.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Straightforward TAC lowering into an instruction list, one fixed sequence
+// per TAC op the same way the runtime macros expand. rax and rcx are scratch
+// and never carry a value from one TAC op into the next, X86Peephole relies
+// on that to tidy the result
+
+static const char *reg_names[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static const char *reg32_names[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+static const char *reg16_names[] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
+};
+
+static const char *reg8_names[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+static const X86_Reg arg_regs[ARG_REG_COUNT] = { X86_RDI, X86_RSI, X86_RDX, X86_RCX, X86_R8, X86_R9 };
+
+static const struct {
+    const char *op;
+    X86_Cond cc, negated;
+} x86_conds[] = {
+    { "<",  X86_CC_L,  X86_CC_GE },
+    { "<=", X86_CC_LE, X86_CC_G  },
+    { ">",  X86_CC_G,  X86_CC_LE },
+    { ">=", X86_CC_GE, X86_CC_L  },
+    { "==", X86_CC_E,  X86_CC_NE },
+    { "!=", X86_CC_NE, X86_CC_E  },
+};
+
+static int FindCond(const char *op)
+{
+    for (size_t i = 0; i < sizeof(x86_conds) / sizeof(x86_conds[0]); i++)
+        if (strcmp(x86_conds[i].op, op) == 0)
+            return (int)i;
+    return -1;
+}
+
+static X86_Cond CondFor(const char *op, bool negate)
+{
+    int i = FindCond(op);
+    if (i < 0)
+        return X86_CC_NE;
+    return negate ? x86_conds[i].negated : x86_conds[i].cc;
+}
+
+static X86_Operand Reg(X86_Reg reg)
+	{ return (X86_Operand){ .kind = X86_OPND_REG, .reg = reg }; }
+
+static X86_Operand Reg8(X86_Reg reg)
+	{ return (X86_Operand){ .kind = X86_OPND_REG8, .reg = reg }; }
+
+static X86_Operand Imm(int64_t value)
+	{ return (X86_Operand){ .kind = X86_OPND_IMM, .imm = value }; }
+
+static X86_Operand Mem(X86_Reg base, int32_t disp)
+	{ return (X86_Operand){ .kind = X86_OPND_MEM, .reg = base, .disp = disp }; }
+
+static X86_Operand MemIndex(X86_Reg base, int32_t disp, X86_Reg index)
+	{ return (X86_Operand){ .kind = X86_OPND_MEM, .reg = base, .disp = disp, .index = index, .scale = 8 }; }
+
+static X86_Operand MemLabel(const char *label, int32_t disp)
+	{ return (X86_Operand){ .kind = X86_OPND_MEM, .label = label, .disp = disp }; }
+
+static X86_Operand SizedReg(X86_Reg reg, uint32_t size)
+{
+    X86_Operand_Kind kinds[] = { [1] = X86_OPND_REG8, [2] = X86_OPND_REG16, [4] = X86_OPND_REG32, [8] = X86_OPND_REG };
+    return (X86_Operand){ .kind = kinds[size], .reg = reg };
+}
+
+static bool IsScale(uint32_t stride)
+	{ return stride == 1 || stride == 2 || stride == 4 || stride == 8; }
+
+static X86_Operand Label(const char *name)
+	{ return (X86_Operand){ .kind = X86_OPND_LABEL, .label = name }; }
+
+static X86_Operand VecReg(const char *name, int lanes)
+	{ return (X86_Operand){ .kind = lanes == 4 ? X86_OPND_YMM : X86_OPND_XMM, .reg = atoi(name + 2) }; }
+
+static X86_Operand None(void)
+	{ return (X86_Operand){ .kind = X86_OPND_NONE }; }
+
+static void Emit(X86_List *out, X86_Op op, X86_Operand dst, X86_Operand src)
+{
+    X86_Inst inst = { .op = op, .dst = dst, .src = src };
+    nob_da_append(out, inst);
+}
+
+static void Emit3(X86_List *out, X86_Op op, X86_Operand dst, X86_Operand src, X86_Operand src2)
+{
+    X86_Inst inst = { .op = op, .dst = dst, .src = src, .src2 = src2 };
+    nob_da_append(out, inst);
+}
+
+static void EmitCond(X86_List *out, X86_Op op, X86_Cond cc, X86_Operand dst)
+{
+    X86_Inst inst = { .op = op, .cc = cc, .dst = dst };
+    nob_da_append(out, inst);
+}
+
+static bool IsNumber(const char *s)
+	{ return s && ((s[0] >= '0' && s[0] <= '9') || s[0] == '-'); }
+
+static Frame_Slot* FindSlot(Generator *g, const char *name)
+{
+    for (size_t i = 0; i < g->frame.count; i++)
+        if (strcmp(g->frame.items[i].name, name) == 0)
+            return &g->frame.items[i];
+    static Frame_Slot missing = {0};
+    nob_log(NOB_ERROR, "%s: no frame slot for '%s'", g->proc_name, name);
+    g->had_err = true;
+    return &missing;
+}
+
+static X86_Reg RegByName(const char *name)
+{
+    for (int r = 0; r < 16; r++)
+        if (strcmp(reg_names[r], name) == 0)
+            return r;
+    return X86_RAX;
+}
+
+// Where a TAC name lives: an immediate, a callee-saved register or a frame
+// slot. Unary ops have no left operand, it reads as 0 the way the VM has it
+static X86_Operand Location(Generator *g, const char *name)
+{
+    if (!name)
+        return Imm(0);
+    if (IsNumber(name))
+        return Imm(strtoll(name, NULL, 10));
+    for (size_t i = 0; i < g->reg_vars.count; i++)
+        if (strcmp(g->reg_vars.items[i].name, name) == 0)
+            return Reg(RegByName(g->reg_vars.items[i].reg));
+    return Mem(X86_RBP, -FindSlot(g, name)->offset);
+}
+
+static X86_Operand ArrayElement(Generator *g, const char *array, X86_Reg index)
+	{ return MemIndex(X86_RBP, -FindSlot(g, array)->offset, index); }
+
+// [slot + offset], plus index*stride for fields of array elements. Strides
+// that aren't a valid scale were already multiplied into the index
+static X86_Operand StructField(Generator *g, TAC_Inst *inst, const char *base, X86_Reg index)
+{
+    X86_Operand field = Mem(X86_RBP, -FindSlot(g, base)->offset + (int32_t)inst->offset);
+    field.size = inst->size == 8 ? 0 : inst->size;
+    if (inst->stride)
+	{
+        field.index = index;
+        field.scale = IsScale(inst->stride) ? inst->stride : 1;
+    }
+    return field;
+}
+
+static void LoadRax(Generator *g, X86_List *out, const char *src)
+	{ Emit(out, X86_MOV, Reg(X86_RAX), Location(g, src)); }
+
+static void StoreRax(Generator *g, X86_List *out, const char *dest)
+	{ Emit(out, X86_MOV, Location(g, dest), Reg(X86_RAX)); }
+
+// rax = left, rcx = right, the way every two-operand runtime macro starts
+static void LoadPair(Generator *g, X86_List *out, const char *left, const char *right)
+{
+    LoadRax(g, out, left);
+    Emit(out, X86_PUSH, Reg(X86_RAX), None());
+    LoadRax(g, out, right);
+    Emit(out, X86_MOV, Reg(X86_RCX), Reg(X86_RAX));
+    Emit(out, X86_POP, Reg(X86_RAX), None());
+}
+
+// Struct sized strides don't fit the addressing mode scale
+static void ScaleIndex(X86_List *out, X86_Reg index, uint32_t stride)
+{
+    if (IsScale(stride))
+        return;
+    if (index == X86_RCX)
+        Emit(out, X86_IMUL, Reg(X86_RCX), Imm(stride));
+    else
+	{
+        Emit(out, X86_MOV, Reg(X86_RCX), Imm(stride));
+        Emit(out, X86_IMUL, Reg(X86_RAX), Reg(X86_RCX));
+    }
+}
+
+static void RestoreCalleeSaved(Generator *g, X86_List *out)
+{
+    for (size_t i = 0; i < g->reg_vars.count; i++)
+	{
+        const char *reg = g->reg_vars.items[i].reg;
+        Emit(out, X86_MOV, Reg(RegByName(reg)), Location(g, arena_sprintf(g->arena, "_save_%s", reg)));
+    }
+}
+
+static void LeaveFrame(X86_List *out)
+{
+    Emit(out, X86_MOV, Reg(X86_RSP), Reg(X86_RBP));
+    Emit(out, X86_POP, Reg(X86_RBP), None());
+}
+
+// Above this many qwords a variable is cleared in a loop
+#define ZERO_UNROLL 8
+
+// Runs after the parameters are stored, so every scratch register is free
+// and a self tail call through .entry clears the variables again
+void X86ZeroLocals(Generator *g, X86_List *out)
+{
+    for (size_t i = 0; i < g->frame.count; i++)
+	{
+        Frame_Slot *slot = &g->frame.items[i];
+        if (!slot->zero)
+            continue;
+
+        int words = slot->size / 8;
+        if (words > ZERO_UNROLL)
+		{
+            const char *loop = arena_sprintf(g->arena, ".zero%zu", i);
+            Emit(out, X86_MOV, Reg(X86_RCX), Imm(words));
+            Emit(out, X86_LABEL, Label(loop), None());
+            Emit(out, X86_MOV, MemIndex(X86_RBP, -slot->offset - 8, X86_RCX), Imm(0));
+            Emit(out, X86_DEC, Reg(X86_RCX), None());
+            EmitCond(out, X86_JCC, X86_CC_NE, Label(loop));
+        }
+        else
+            for (int w = 0; w < words; w++)
+                Emit(out, X86_MOV, Mem(X86_RBP, -slot->offset + w * 8), Imm(0));
+
+        // Narrow structs end in a dword, word or byte
+        for (int at = words * 8; at < slot->size;)
+		{
+            int size = slot->size - at >= 4 ? 4 : slot->size - at >= 2 ? 2 : 1;
+            X86_Operand tail = Mem(X86_RBP, -slot->offset + at);
+            tail.size = size;
+            Emit(out, X86_MOV, tail, Imm(0));
+            at += size;
+        }
+    }
+}
+
+static void LowerTACInst(Generator *g, TAC_Inst *inst, X86_List *out)
+{
+    switch (inst->type)
+	{
+        case TAC_BINOP:
+		{
+            // -x and !x only have the right operand
+            if (!inst->src1 && strcmp(inst->op, "-") == 0)
+			{
+                LoadRax(g, out, inst->src2);
+                Emit(out, X86_NEG, Reg(X86_RAX), None());
+                StoreRax(g, out, inst->dest);
+                break;
+            }
+            if (strcmp(inst->op, "!") == 0)
+			{
+                LoadRax(g, out, inst->src2);
+                Emit(out, X86_TEST, Reg(X86_RAX), Reg(X86_RAX));
+                Emit(out, X86_MOV, Reg(X86_RAX), Imm(0));
+                EmitCond(out, X86_SETCC, X86_CC_E, Reg8(X86_RAX));
+                StoreRax(g, out, inst->dest);
+                break;
+            }
+
+            LoadPair(g, out, inst->src1, inst->src2);
+            if (strcmp(inst->op, "+") == 0)
+                Emit(out, X86_ADD, Reg(X86_RAX), Reg(X86_RCX));
+            else if (strcmp(inst->op, "-") == 0)
+                Emit(out, X86_SUB, Reg(X86_RAX), Reg(X86_RCX));
+            else if (strcmp(inst->op, "*") == 0)
+                Emit(out, X86_IMUL, Reg(X86_RAX), Reg(X86_RCX));
+            else if (strcmp(inst->op, "&") == 0)
+                Emit(out, X86_AND, Reg(X86_RAX), Reg(X86_RCX));
+            else if (strcmp(inst->op, "/") == 0 || strcmp(inst->op, "%") == 0)
+			{
+                // The remainder comes out in rdx
+                Emit(out, X86_CQO, None(), None());
+                Emit(out, X86_IDIV, Reg(X86_RCX), None());
+                if (inst->op[0] == '%')
+                    Emit(out, X86_MOV, Reg(X86_RAX), Reg(X86_RDX));
+            }
+            else if (FindCond(inst->op) >= 0)
+			{
+                Emit(out, X86_CMP, Reg(X86_RAX), Reg(X86_RCX));
+                Emit(out, X86_MOV, Reg(X86_RAX), Imm(0));
+                EmitCond(out, X86_SETCC, CondFor(inst->op, false), Reg8(X86_RAX));
+            }
+            else
+			{
+                nob_log(NOB_ERROR, "%s: operator '%s' is not supported", g->proc_name, inst->op);
+                g->had_err = true;
+            }
+            StoreRax(g, out, inst->dest);
+            break;
+        }
+
+        case TAC_COPY:
+            LoadRax(g, out, inst->src1);
+            StoreRax(g, out, inst->dest);
+            break;
+
+        // Slice elements are reached through the data pointer at offset 0
+        case TAC_LOAD:
+            LoadRax(g, out, inst->src2);
+            if (inst->flags & TAC_FLAG_SLICE)
+			{
+                Emit(out, X86_MOV, Reg(X86_RCX), Location(g, inst->src1));
+                Emit(out, X86_MOV, Reg(X86_RAX), MemIndex(X86_RCX, 0, X86_RAX));
+            }
+            else
+                Emit(out, X86_MOV, Reg(X86_RAX), ArrayElement(g, inst->src1, X86_RAX));
+            StoreRax(g, out, inst->dest);
+            break;
+
+        case TAC_STORE:
+            if (inst->flags & TAC_FLAG_SLICE)
+			{
+                LoadRax(g, out, inst->src1);
+                Emit(out, X86_MOV, Reg(X86_RCX), Location(g, inst->dest));
+                Emit(out, X86_LEA, Reg(X86_RCX), MemIndex(X86_RCX, 0, X86_RAX));
+                LoadRax(g, out, inst->src2);
+                Emit(out, X86_MOV, Mem(X86_RCX, 0), Reg(X86_RAX));
+                break;
+            }
+            LoadPair(g, out, inst->src2, inst->src1);
+            Emit(out, X86_MOV, ArrayElement(g, inst->dest, X86_RCX), Reg(X86_RAX));
+            break;
+
+        case TAC_ADDR:
+            Emit(out, X86_LEA, Reg(X86_RAX), Location(g, inst->src1));
+            StoreRax(g, out, inst->dest);
+            break;
+
+        // Unsigned, negative indices wrap around and fail as well
+        case TAC_BOUNDS_CHECK:
+            LoadPair(g, out, inst->src1, inst->src2);
+            Emit(out, X86_CMP, Reg(X86_RAX), Reg(X86_RCX));
+            EmitCond(out, X86_JCC, X86_CC_AE, Label("_bounds_fail"));
+            break;
+
+        // Narrow fields are zero extended, a 32-bit mov clears the upper half
+        case TAC_LOAD_FIELD:
+		{
+            if (inst->src2)
+			{
+                LoadRax(g, out, inst->src2);
+                ScaleIndex(out, X86_RAX, inst->stride);
+            }
+            X86_Operand field = StructField(g, inst, inst->src1, X86_RAX);
+            if (inst->size == 8)
+                Emit(out, X86_MOV, Reg(X86_RAX), field);
+            else if (inst->size == 4)
+                Emit(out, X86_MOV, SizedReg(X86_RAX, 4), field);
+            else
+                Emit(out, X86_MOVZX, Reg(X86_RAX), field);
+            StoreRax(g, out, inst->dest);
+            break;
+        }
+
+        case TAC_STORE_FIELD:
+            if (inst->src1)
+			{
+                LoadPair(g, out, inst->src2, inst->src1);
+                ScaleIndex(out, X86_RCX, inst->stride);
+            }
+            else
+                LoadRax(g, out, inst->src2);
+            Emit(out, X86_MOV, StructField(g, inst, inst->dest, X86_RCX), SizedReg(X86_RAX, inst->size));
+            break;
+
+        case TAC_PARAM:
+            LoadRax(g, out, inst->src1);
+            if (inst->num < ARG_REG_COUNT)
+                Emit(out, X86_MOV, Reg(arg_regs[inst->num]), Reg(X86_RAX));
+            else
+                Emit(out, X86_MOV, Mem(X86_RSP, ((int)inst->num - ARG_REG_COUNT) * 8), Reg(X86_RAX));
+            break;
+
+        case TAC_CALL:
+            Emit(out, X86_CALL, Label(arena_sprintf(g->arena, "func_%s", inst->src1)), None());
+            StoreRax(g, out, inst->dest);
+            break;
+
+        case TAC_TAIL_CALL:
+            if (strcmp(inst->src1, g->proc_name) == 0)
+                Emit(out, X86_JMP, Label(arena_sprintf(g->arena, "func_%s.entry", inst->src1)), None());
+            else
+			{
+                RestoreCalleeSaved(g, out);
+                LeaveFrame(out);
+                Emit(out, X86_JMP, Label(arena_sprintf(g->arena, "func_%s", inst->src1)), None());
+            }
+            break;
+
+        case TAC_LABEL:
+            Emit(out, X86_LABEL, Label(inst->dest), None());
+            break;
+
+        case TAC_JUMP:
+            Emit(out, X86_JMP, Label(inst->dest), None());
+            break;
+
+        case TAC_JUMP_IF:
+        case TAC_JUMP_IF_NOT:
+            if (inst->op)
+			{
+                LoadPair(g, out, inst->src1, inst->src2);
+                Emit(out, X86_CMP, Reg(X86_RAX), Reg(X86_RCX));
+                EmitCond(out, X86_JCC, CondFor(inst->op, inst->type == TAC_JUMP_IF_NOT), Label(inst->dest));
+            }
+            else
+			{
+                LoadRax(g, out, inst->src1);
+                Emit(out, X86_TEST, Reg(X86_RAX), Reg(X86_RAX));
+                EmitCond(out, X86_JCC, inst->type == TAC_JUMP_IF ? X86_CC_NE : X86_CC_E, Label(inst->dest));
+            }
+            break;
+
+        case TAC_DEC_JUMP_NZ:
+            Emit(out, X86_DEC, Location(g, inst->src1), None());
+            EmitCond(out, X86_JCC, X86_CC_NE, Label(inst->dest));
+            break;
+
+        case TAC_RETURN:
+            LoadRax(g, out, inst->src1);
+            RestoreCalleeSaved(g, out);
+            LeaveFrame(out);
+            Emit(out, X86_RET, None(), None());
+            break;
+
+        case TAC_VEC_SPLAT:
+		{
+            X86_Operand xmm = VecReg(inst->dest, 2);
+            LoadRax(g, out, inst->src1);
+            if (inst->num == 4)
+			{
+                Emit(out, X86_VMOVQ, xmm, Reg(X86_RAX));
+                Emit(out, X86_VPBROADCASTQ, VecReg(inst->dest, 4), xmm);
+            }
+            else
+			{
+                Emit(out, X86_MOVQ, xmm, Reg(X86_RAX));
+                Emit(out, X86_PUNPCKLQDQ, xmm, xmm);
+            }
+            break;
+        }
+
+        case TAC_VEC_LOAD:
+		{
+            X86_Operand element = ArrayElement(g, inst->src1, X86_RAX);
+            element.disp += (int32_t)inst->offset;
+            LoadRax(g, out, inst->src2);
+            Emit(out, inst->num == 4 ? X86_VMOVDQU : X86_MOVDQA, VecReg(inst->dest, inst->num), element);
+            break;
+        }
+
+        case TAC_VEC_STORE:
+		{
+            X86_Operand element = ArrayElement(g, inst->dest, X86_RAX);
+            element.disp += (int32_t)inst->offset;
+            LoadRax(g, out, inst->src1);
+            Emit(out, inst->num == 4 ? X86_VMOVDQU : X86_MOVDQA, element, VecReg(inst->src2, inst->num));
+            break;
+        }
+
+        case TAC_VEC_BINOP:
+		{
+            bool add = strcmp(inst->op, "+") == 0;
+            X86_Operand dest = VecReg(inst->dest, inst->num);
+            X86_Operand left = VecReg(inst->src1, inst->num);
+            X86_Operand right = VecReg(inst->src2, inst->num);
+            if (inst->num == 4)
+                Emit3(out, add ? X86_VPADDQ : X86_VPSUBQ, dest, left, right);
+            else
+			{
+                if (dest.reg != left.reg)
+                    Emit(out, X86_MOVDQA, dest, left);
+                Emit(out, add ? X86_PADDQ : X86_PSUBQ, dest, right);
+            }
+            break;
+        }
+
+        case TAC_VEC_END:
+            if (inst->num == 4)
+                Emit(out, X86_VZEROUPPER, None(), None());
+            break;
+
+        case TAC_COUNT:
+            Emit(out, X86_INC, MemLabel("_profile_counters", (int32_t)(inst->num * 8)), None());
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void StampLine(X86_List *out, size_t from, uint32_t line)
+{
+    for (size_t i = from; i < out->count; i++)
+        out->items[i].line = line;
+}
+
+void X86LowerProc(Generator *g, AST_Node *proc, TAC_List *tac, X86_List *out)
+{
+    size_t from = out->count;
+    Emit(out, X86_LABEL, Label(arena_sprintf(g->arena, "func_%s", g->proc_name)), None());
+    Emit(out, X86_PUSH, Reg(X86_RBP), None());
+    Emit(out, X86_MOV, Reg(X86_RBP), Reg(X86_RSP));
+    if (g->frame_size > 0)
+        Emit(out, X86_SUB, Reg(X86_RSP), Imm(g->frame_size));
+
+    for (size_t i = 0; i < g->reg_vars.count; i++)
+	{
+        const char *reg = g->reg_vars.items[i].reg;
+        Emit(out, X86_MOV, Location(g, arena_sprintf(g->arena, "_save_%s", reg)), Reg(RegByName(reg)));
+    }
+
+    if (g->self_tail)
+        Emit(out, X86_LABEL, Label(".entry"), None());
+    int regs = 0, stack = 0;
+    for (size_t i = 0; i < proc->children.used; i++)
+	{
+        AST_Node *param = proc->children.data[i];
+        int words = LayoutParamWords(param);
+        int pos = LayoutArgPosition(&regs, &stack, words);
+        for (int w = 0; w < words && pos < ARG_REG_COUNT; w++)
+		{
+            X86_Operand slot = Location(g, param->name);
+            slot.disp += w * 8;
+            Emit(out, X86_MOV, slot, Reg(arg_regs[pos + w]));
+        }
+    }
+    X86ZeroLocals(g, out);
+    StampLine(out, from, proc->line);
+
+    for (size_t i = 0; i < tac->count; i++)
+	{
+        TAC_Inst *inst = &tac->items[i];
+        from = out->count;
+        LowerTACInst(g, inst, out);
+        StampLine(out, from, inst->line);
+    }
+
+    // Falling off the end returns 0, as in the VM
+    Emit(out, X86_XOR, SizedReg(X86_RAX, 4), SizedReg(X86_RAX, 4));
+    RestoreCalleeSaved(g, out);
+    LeaveFrame(out);
+    Emit(out, X86_RET, None(), None());
+}
+
+static const char *x86_mnemonics[] = {
+    [X86_MOV] = "mov",
+    [X86_MOVZX] = "movzx",
+    [X86_LEA] = "lea",
+    [X86_ADD] = "add",
+    [X86_SUB] = "sub",
+    [X86_IMUL] = "imul",
+    [X86_AND] = "and",
+    [X86_XOR] = "xor",
+    [X86_SHL] = "shl",
+    [X86_CMP] = "cmp",
+    [X86_TEST] = "test",
+    [X86_DEC] = "dec",
+    [X86_INC] = "inc",
+    [X86_NEG] = "neg",
+    [X86_CQO] = "cqo",
+    [X86_IDIV] = "idiv",
+    [X86_JMP] = "jmp",
+    [X86_CALL] = "call",
+    [X86_RET] = "ret",
+    [X86_SYSCALL] = "syscall",
+    [X86_PUSH] = "push",
+    [X86_POP] = "pop",
+    [X86_MOVQ] = "movq",
+    [X86_PUNPCKLQDQ] = "punpcklqdq",
+    [X86_MOVDQA] = "movdqa",
+    [X86_PADDQ] = "paddq",
+    [X86_PSUBQ] = "psubq",
+    [X86_VMOVQ] = "vmovq",
+    [X86_VPBROADCASTQ] = "vpbroadcastq",
+    [X86_VMOVDQU] = "vmovdqu",
+    [X86_VPADDQ] = "vpaddq",
+    [X86_VPSUBQ] = "vpsubq",
+    [X86_VZEROUPPER] = "vzeroupper",
+};
+
+static const char *cc_suffixes[16] = {
+    [X86_CC_AE] = "ae",
+    [X86_CC_E] = "e",
+    [X86_CC_NE] = "ne",
+    [X86_CC_L] = "l",
+    [X86_CC_GE] = "ge",
+    [X86_CC_LE] = "le",
+    [X86_CC_G] = "g",
+};
+
+static const char *mem_sizes[] = {
+    [0] = "qword ",
+    [1] = "byte ",
+    [2] = "word ",
+    [4] = "dword ",
+};
+
+static void PrintOperand(Nob_String_Builder *sb, X86_Operand *opnd, bool sized)
+{
+    switch (opnd->kind)
+	{
+        case X86_OPND_REG:
+            EmitStr(sb, reg_names[opnd->reg]);
+            break;
+        case X86_OPND_REG32:
+            EmitStr(sb, reg32_names[opnd->reg]);
+            break;
+        case X86_OPND_REG16:
+            EmitStr(sb, reg16_names[opnd->reg]);
+            break;
+        case X86_OPND_REG8:
+            EmitStr(sb, reg8_names[opnd->reg]);
+            break;
+        case X86_OPND_XMM:
+            EmitLit(sb, "xmm");
+            EmitInt(sb, opnd->reg);
+            break;
+        case X86_OPND_YMM:
+            EmitLit(sb, "ymm");
+            EmitInt(sb, opnd->reg);
+            break;
+        case X86_OPND_IMM:
+            EmitInt(sb, opnd->imm);
+            break;
+        case X86_OPND_MEM:
+            if (sized)
+                EmitStr(sb, mem_sizes[opnd->size]);
+            EmitChar(sb, '[');
+            EmitStr(sb, opnd->label ? opnd->label : reg_names[opnd->reg]);
+            if (opnd->disp)
+			{
+                EmitStr(sb, opnd->disp < 0 ? " - " : " + ");
+                EmitInt(sb, abs(opnd->disp));
+            }
+            if (opnd->scale)
+			{
+                EmitLit(sb, " + ");
+                EmitStr(sb, reg_names[opnd->index]);
+                EmitChar(sb, '*');
+                EmitInt(sb, opnd->scale);
+            }
+            EmitChar(sb, ']');
+            break;
+        case X86_OPND_LABEL:
+            EmitStr(sb, opnd->label);
+            break;
+        default:
+            break;
+    }
+}
+
+void X86Print(Nob_String_Builder *sb, X86_List *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+	{
+        X86_Inst *inst = &list->items[i];
+        if (inst->op == X86_LABEL)
+		{
+            EmitStr(sb, inst->dst.label);
+            EmitLit(sb, ":\n");
+            continue;
+        }
+
+        EmitLit(sb, "    ");
+        if (inst->op == X86_SETCC || inst->op == X86_JCC)
+		{
+            EmitStr(sb, inst->op == X86_SETCC ? "set" : "j");
+            EmitStr(sb, cc_suffixes[inst->cc]);
+        }
+        else
+            EmitStr(sb, x86_mnemonics[inst->op]);
+
+        // Vector moves take their size from the register operand, lea
+        // doesn't access memory at all
+        bool sized = inst->op < X86_MOVQ && inst->op != X86_LEA;
+        X86_Operand *operands[] = { &inst->dst, &inst->src, &inst->src2 };
+
+        // imul by an immediate only exists in the three operand form
+        if (inst->op == X86_IMUL && inst->src.kind == X86_OPND_IMM)
+		{
+            X86_Operand *imul_operands[] = { &inst->dst, &inst->dst, &inst->src };
+            memcpy(operands, imul_operands, sizeof(operands));
+        }
+
+        for (int k = 0; k < 3 && operands[k]->kind != X86_OPND_NONE; k++)
+		{
+            EmitStr(sb, k == 0 ? " " : ", ");
+            PrintOperand(sb, operands[k], sized);
+        }
+        EmitChar(sb, '\n');
+    }
+}